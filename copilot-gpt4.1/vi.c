@@ -1,42 +1,434 @@
+// build: cc -O2 -pthread vi.c ../src/vt.c -o vi
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <limits.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include "../src/vt.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define GAP_SIZE 256
-#define LINE_CAP 4096
-#define MAX_LINES 4096
 #define FILENAME_MAXLEN 256
+#define OFF_CHUNK 65536
+#define LAZY_MIN (8L << 20)     // files this big are mapped and indexed in the background
+#define ROW_CK 64
+#define BRK_CK 4096             // bytes between the cached layout points of a long wide line
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 typedef enum { MODE_INSERT, MODE_COMMAND, MODE_NORMAL, MODE_SEARCH } EditorMode;
 
+// Where a long wide line is at every BRK_CK bytes when laid out at width
+// w, so that a row or a cursor is found from the nearest point instead of
+// from the start. An edit drops the points on the bytes it touched and
+// moves the ones after them, which are laid out again on the next use.
+typedef struct {
+    int at, row, col;   // place after bytes [0, at)
+    int cells;          // cells up to the next point when no character there
+                        // is wider than one, else -1
+} Brk;
+
+typedef struct {
+    Brk *b;
+    int n, cap;
+    int ok;             // b[0, ok) are laid out; the rest keep their rows
+                        // from before the last edit
+    int w;
+    const char *key;    // the loaded line they are for, NULL on an edited one
+} Breaks;
+
 typedef struct {
     char *buf;
     int gap_start, gap_end, buf_size;
+    int wide;           // may hold bytes >= 0x80, laid out character by character
+    Breaks *brk;        // made once the line is wide and longer than BRK_CK
 } GapBuf;
 
+typedef struct Piece Piece;
+struct Piece {
+    Piece *left, *right;
+    unsigned prio;
+    int count;          // lines held by this piece
+    int total;          // lines in this subtree
+    long rows;          // screen rows of this piece at the indexed width
+    long rows_total;    // same for the subtree
+    int first;          // first line in the loaded text, -1 for an edited line
+    GapBuf gb;          // text of an edited line
+};
+
+// The loaded file, never modified: pieces reference runs of its lines.
+// Big files are mmap'ed and a worker thread fills in the line index while
+// the editor runs; lines and done are published with release stores.
+typedef struct {
+    char *data;
+    long len;
+    int mapped;
+    long **off;         // start of line i at off[i / OFF_CHUNK][i % OFF_CHUNK],
+                        // each chunk followed by orig_wide flags
+    int chunks;
+    int lines;          // lines indexed so far; line lines is the end marker
+    int done;
+    int stop;
+    int threaded;
+    pthread_t indexer;
+} OrigText;
+
+enum { UNDO_INS, UNDO_DEL };
+
+// One edit: text inserted at or deleted from line y, column x; the text may
+// hold newlines. A run of backspaces is one deletion stored back to front.
+typedef struct {
+    int kind;
+    int y, x;
+    int ey, ex;         // insertions: where the text ends
+    long at, len;       // text in the arena
+    int backward;
+    int orig;           // the text is at in the loaded text instead; such
+                        // ops are copied to the arena before being saved
+} UndoOp;
+
+// A group of edits undone together: one insert session or one command.
+typedef struct {
+    int parent;
+    int child;          // most recent child, the one redo goes to
+    int op, nops;
+} UndoNode;
+
+// The undo tree. Ops and their text are appended to arenas; node 0 is the
+// state before any recorded edit.
+typedef struct {
+    UndoOp *ops;
+    int nops, ops_cap;
+    char *text;
+    long text_len, text_cap;
+    UndoNode *nodes;
+    int nnodes, nodes_cap;
+    int cur;            // last group applied
+    int open;           // cur still takes edits
+    int applying;       // undo or redo in progress: record nothing
+    int saved_ops, saved_nodes; // prefixes already in the history file
+    long saved_text;
+    int *fix;           // saved nodes whose child changed since
+    int nfix, fix_cap;
+    int need_lines;     // lines the loaded file must have for the history
+                        // read with it; checked once it is indexed
+} Undo;
+
+// What one save appends to the history file: the ops, nodes and text added
+// or changed since the previous save, followed by nfix (node, child) pairs
+// for older nodes. The last block names the file content it belongs to.
+typedef struct {
+    int first_op, nops;
+    int first_node, nnodes;
+    long text_at, text_len;
+    int nfix, cur;
+    long size, mtime, mtime_ns;
+    unsigned long hash;
+} UndoBlock;
+
+// A line as (at most) two byte runs, e.g. both sides of a gap. Lines that
+// are not wide are plain ASCII and lay out a byte to a cell.
+typedef struct {
+    const char *p[2];
+    int n[2];
+    int wide;
+    Breaks *brk;        // layout cache of the line, if it keeps one
+} LineView;
+
+// A compiled literal pattern: Two-Way critical factorization of pat.
+typedef struct {
+    unsigned char pat[128];
+    int m;
+    int suffix, period;
+    int periodic;
+} Finder;
+
+enum { RE_SET, RE_SPLIT, RE_JMP, RE_BOL, RE_EOL, RE_MATCH };
+
+typedef struct {
+    int op;
+    int x, y;           // RE_SET: byte set x; RE_SPLIT: x and y; RE_JMP: x
+} ReInst;
+
+// One direction of a compiled regex: its NFA program and the DFA states
+// built from it so far. A state is a list of NFA threads grouped by the
+// position they started at, earliest first, groups ended by -1.
+typedef struct {
+    ReInst *prog;
+    int len;
+    int unanchored;     // a new thread starts at every position
+    int *trans;         // nclass entries per state, -1 until computed
+    unsigned char *flags;
+    int *set_at, *set_len;
+    int *pool;          // thread lists of all states
+    int pool_len, pool_cap;
+    int nstates, cap;
+    int *table;         // open hash of state ids
+    int table_cap;
+    int start[2];       // start state, without and with ^ satisfied
+    int flushed;
+    long flushes;
+    int *mark, *stack, *work, *tmp;
+    int gen;
+} ReDfa;
+
+typedef struct {
+    int literal;        // no operators: searched with the Two-Way finder
+    Finder lit;
+    int first;          // byte every match starts with, or -1
+    unsigned char (*sets)[32];
+    int nsets;
+    unsigned char cls[256];     // byte -> equivalence class
+    int nclass;
+    ReDfa fwd, rev;
+} Regex;
+
+// A frozen copy of the line structure for a worker thread. Runs of loaded
+// lines point into OrigText, which never changes; edited lines point at
+// their buffers, which nothing writes to or frees while a worker runs: any
+// key cancels a search first, and a substitute waits for its workers.
+typedef struct {
+    int line;           // first line of the run in the document
+    int first;          // first line in the loaded text, -1 for an edited line
+    int count;
+    const GapBuf *gb;   // edited line: its buffer
+} SnapRun;
+
+typedef struct {
+    SnapRun *runs;
+    int nruns, cap;
+    int lines;
+    int hint;           // run of the last line looked up
+    OrigText *orig;
+} Snapshot;
+
+// A search running on a worker thread over a snapshot. The next key cancels
+// it; what it finds is published with release stores and a poke on wake.
+typedef struct {
+    pthread_t thread;
+    int active;         // started and not joined yet
+    int threaded;
+    int stop;
+    int found;          // 0 while looking, 1 when ty, tx is the match, -1 for none
+    int applied;        // the editor has acted on found
+    int ty, tx;
+    long before, total; // matches before ty, tx and in all lines scanned
+    int done;
+    int wake[2];
+    int dir, cy, cx;
+    int load_at, loaded;        // to place ty if lines were loaded meanwhile
+    char pat[128];
+    Snapshot snap;      // kept for the next search while edits matches
+    long edits;
+} SearchJob;
+
+#define ATTR_REVERSE 1
+#define ATTR_FG(c) ((c) << 4)  // colour c is SGR 29 + c, 0 for the default
+
+// Eight bytes without padding, so that rows compare with memcmp.
+typedef struct {
+    unsigned ch : 21;   // code point, 0 for the right half of a wide one
+    unsigned attr : 11;
+    unsigned mark;      // combining mark drawn over it, or 0
+} Cell;
+
+// Growable byte buffer, same growth policy as buffer__append in src/std.c.
+typedef struct {
+    char *data;
+    long length;
+    long alloced;
+} OutBuf;
+
+// What the terminal shows (prev) and what the next frame should show (cur).
+typedef struct {
+    int rows, cols;
+    int text_rows;      // rows above the status line that scroll together
+    Cell *cur, *prev;
+    int *map;           // cell of each byte of the wide line being drawn
+    int map_cap;
+    int valid;          // prev matches the terminal
+    int crow, ccol;     // terminal cursor, -1 when unknown
+    unsigned char attr; // SGR state of the terminal
+    OutBuf ob;          // the frame being built, sent with one write
+    long frame_bytes, total_bytes, frames;
+} Screen;
+
+#define FRAME_INTERVAL (1.0 / 60)
+#define LAT_BUCKETS 20          // by powers of two from 16 us
+#define LAT_PENDING 256
+
+// Key-to-paint latency: when each key handled since the last frame came
+// in, and a histogram of how long keys waited to be shown.
+typedef struct {
+    double pending[LAT_PENDING];        // keys read together share a slot
+    int count[LAT_PENDING];
+    int npending;
+    long hist[LAT_BUCKETS];
+    long keys, frames;
+    double max;
+} Latency;
+
+// Crash journal: every edit is appended to dir/.name.swp as it is made, or
+// to .swo, .swn... if a crashed session left that one behind. write()
+// happens once per key; a syncer thread fdatasyncs in batches.
+typedef struct {
+    int on;
+    int fd;
+    char path[FILENAME_MAXLEN + 8];
+    OutBuf buf;         // records of the current key, not written yet
+    pthread_t syncer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int threaded, stop;
+    int dirty;          // written since the last fdatasync
+    long pending;       // bytes of it
+    double due;         // when it must be synced
+    int replaying;      // recovery: the edits are in the journal already
+    long records, bytes, syncs;
+} Journal;
+
+typedef struct {
+    unsigned long h;
+    unsigned char tail[8];
+    int ntail;
+    long len;
+} Hash;
+
+#define SAVE_IOV 1024
+
+// A save in progress: segments queued for the next writev.
 typedef struct {
-    GapBuf **lines;
-    int num_lines, cap_lines;
+    int fd;
+    struct iovec iov[SAVE_IOV];
+    int n;
+    long bytes;
+    Hash hash;
+    int err;
+} SaveOut;
+
+// The journal starts with the state of the file it applies to.
+typedef struct {
+    char magic[8];
+    long size, mtime, mtime_ns;
+} JournalHead;
+
+typedef struct {
+    int kind, y, x;             // an UndoOp without its bookkeeping
+    long len;
+} JournalRec;
+
+#define SYN_STALE 0x80
+#define SYN_STATE 0x7f
+
+// Highlighting: the lexer state at the end of each of lines [0, len). A line
+// is flagged SYN_STALE when its text or the state it was lexed from changed
+// since; none are before dirty.
+typedef struct {
+    int lang;
+    unsigned char *st;
+    int len, cap;
+    int dirty;
+    unsigned char *cls; // classes of the line being drawn
+    int cls_cap;
+} Syntax;
+
+// A position that moves with the text. Positions live in a treap ordered by
+// (y, x); an edit splits off the ones after it and leaves their shift
+// pending at the root of each part, so it costs O(log positions) however
+// many there are. A node's place is its own plus the shifts pending on its
+// ancestors.
+typedef struct Mark Mark;
+struct Mark {
+    Mark *left, *right, *parent;
+    unsigned prio;
+    int y, x;
+    int dy, dx;         // pending for the subtree; dx only where it is one line
+};
+
+#define JUMPS 100
+
+typedef struct {
+    Mark *root;
+    Mark *named[26];    // set with m{a-z}
+    Mark **jumps;       // up to JUMPS, oldest first; made on the first jump
+    int njumps;
+    int jump_at;        // entry Ctrl-O/Ctrl-I last went to, njumps if none
+} Marks;
+
+typedef struct {
+    Piece *root;
+    Piece *open;        // edited line currently holding a gap
+    OrigText orig;
+    int loaded;         // lines of orig already in the piece tree
+    int load_at;        // where lines still being indexed will be inserted
+    int rows_width;     // width the row counts are valid for, 0 = none yet
+    long *rowck;        // rows of loaded lines before each ROW_CK-line block
+    int rowck_n, rowck_cap;
+    Breaks orig_brk;    // layout cache of the last long loaded line asked for
+    int top, top_sub;   // viewport: first line shown and its first wrapped row
+    int num_lines;
+    long edits;         // bumped by every change to the text
+    Undo undo;
     int cx, cy;
     EditorMode mode;
     char command[128];
     char search[128];
-    int search_last_y;
+    char message[128];
     int search_found;
+    int pending;        // m, ' or ` waiting for the name of its mark
+    Syntax syn;
+    Regex re;           // last search pattern, for n/N, :s and highlighting
+    char pattern[128];  // its source
+    SearchJob job;
     char filename[FILENAME_MAXLEN];
+    Screen scr;
+    OutBuf overlay;     // a report shown over the text until the next key
+    Latency lat;
+    Journal journal;
+    long keys;
+    Marks marks;
 } Editor;
 
 static struct termios orig_termios;
 static int raw_mode_enabled = 0;
 
+// A headless run (--replay) has a virtual terminal whose output goes to
+// sink, and takes its keys from trace.
+static struct {
+    int rows, cols;
+    OutBuf *sink;
+    const char *trace;
+    long trace_len, trace_pos;
+} headless;
+
 void die(const char *s) { perror(s); exit(1); }
 
+// bracketed paste and SGR mouse reports
+#define TERM_MODES_ON "\x1b[?2004h\x1b[?1000h\x1b[?1006h"
+#define TERM_MODES_OFF "\x1b[?1006l\x1b[?1000l\x1b[?2004l"
+
 void disableRawMode(void) {
     if (raw_mode_enabled) {
+        if (write(STDOUT_FILENO, TERM_MODES_OFF, sizeof(TERM_MODES_OFF) - 1) < 0) {}
         tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
         raw_mode_enabled = 0;
     }
@@ -46,48 +438,280 @@ void enableRawMode(void) {
     raw_mode_enabled = 1;
     atexit(disableRawMode);
     struct termios raw = orig_termios;
-    raw.c_lflag &= ~(ECHO | ICANON | ISIG);
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
     raw.c_iflag &= ~(IXON | ICRNL);
     raw.c_oflag &= ~(OPOST);
     raw.c_cc[VMIN] = 1;
     raw.c_cc[VTIME] = 0;
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+    if (write(STDOUT_FILENO, TERM_MODES_ON, sizeof(TERM_MODES_ON) - 1) < 0) die("write");
 }
 
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+static int write_all(int fd, const char *p, long n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+// Writes all of iov[0, n), resuming after short writes; iov is consumed.
+static int writev_all(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n > IOV_MAX ? IOV_MAX : n);
+        if (w < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return -1;
+        }
+        for (; n > 0 && (size_t)w >= iov->iov_len; --n, ++iov) w -= iov->iov_len;
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
 int get_terminal_width(void) {
     struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) return 80;
+    if (headless.cols) return headless.cols;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) return 80;
     return ws.ws_col;
 }
 int get_terminal_height(void) {
     struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) return 24;
+    if (headless.rows) return headless.rows;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_row == 0) return 24;
     return ws.ws_row;
 }
 
-GapBuf *make_gapbuf(int cap) {
-    GapBuf *gb = malloc(sizeof(GapBuf));
-    gb->buf = calloc(1, cap);
-    gb->buf_size = cap;
+// --- Text width: lines are UTF-8, shown by the cells each character takes ---
+
+// Length of the run of ASCII bytes that p[0, n) starts with.
+static int ascii_run(const char *p, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 64 <= n; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(p + i + 48));
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)))) break;
+    }
+    for (; i + 16 <= n; i += 16) {
+        int m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p + i)));
+        if (m) return i + __builtin_ctz(m);
+    }
+#endif
+    while (i < n && !(p[i] & 0x80)) ++i;
+    return i;
+}
+// Decodes the character s[0, n) starts with into *cp and returns its
+// length. A byte that starts no well-formed sequence is one U+FFFD.
+static int utf8_decode(const unsigned char *s, int n, unsigned *cp) {
+    unsigned c = s[0];
+    int len = c < 0x80 ? 1 : c < 0xC2 ? 0 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : c < 0xF5 ? 4 : 0;
+    *cp = c;
+    if (len == 1) return 1;
+    *cp = 0xFFFD;
+    if (!len || len > n) return 1;
+    unsigned v = c & (0x7F >> len);
+    for (int i = 1; i < len; ++i) {
+        if ((s[i] & 0xC0) != 0x80) return 1;
+        v = v << 6 | (s[i] & 0x3F);
+    }
+    // overlong forms, surrogates and code points past U+10FFFF
+    if ((len == 3 && v < 0x800) || (len == 4 && (v < 0x10000 || v > 0x10FFFF)) || (v >= 0xD800 && v <= 0xDFFF))
+        return 1;
+    *cp = v;
+    return len;
+}
+static int utf8_encode(unsigned cp, char *out) {
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xC0 | cp >> 6;
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xE0 | cp >> 12;
+        out[1] = 0x80 | (cp >> 6 & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | cp >> 18;
+    out[1] = 0x80 | (cp >> 12 & 0x3F);
+    out[2] = 0x80 | (cp >> 6 & 0x3F);
+    out[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+// Control characters show as '?'.
+static unsigned glyph_of(unsigned cp) {
+    return cp < 32 || (cp >= 127 && cp < 160) ? '?' : cp;
+}
+// Cells cp takes, from the table the terminal model in src/vt.c uses too.
+static int char_width(unsigned cp) {
+    return cp < 0x300 ? 1 : vt__width(cp);
+}
+
+// --- Line storage: size-classed slabs, so short lines pack together ---
+
+#define SLAB_MIN 16
+#define SLAB_MAX 4096
+#define SLAB_CHUNK 65536
+#define SLAB_CLASSES 9
+
+typedef struct SlabFree { struct SlabFree *next; } SlabFree;
+typedef struct {
+    SlabFree *free[SLAB_CLASSES];
+    char *chunk;
+    int chunk_left;
+    long in_use;        // bytes handed out to line buffers
+    long reserved;      // bytes taken from malloc
+} Slab;
+
+// Line buffers come from here. Worker threads fill slabs of their own,
+// which are merged in with slab_merge.
+static Slab slab;
+
+static int slab_class(int size) {
+    int c = 0;
+    while ((SLAB_MIN << c) < size) c++;
+    return c;
+}
+// Capacity actually handed out for a request of size bytes.
+int slab_round(int size) {
+    if (size <= 0) return 0;
+    if (size > SLAB_MAX) return (size + SLAB_MAX - 1) & ~(SLAB_MAX - 1);
+    return SLAB_MIN << slab_class(size);
+}
+static void slab_release(Slab *sl, char *p, int size) {
+    SlabFree *f = (SlabFree *)p;
+    int c = slab_class(size);
+    f->next = sl->free[c];
+    sl->free[c] = f;
+}
+// Hands the rest of from's chunk to the classes of to.
+static void slab_retire(Slab *from, Slab *to) {
+    while (from->chunk_left >= SLAB_MIN) {
+        int s = from->chunk_left >= SLAB_MAX ? SLAB_MAX : SLAB_MIN << slab_class(from->chunk_left);
+        if (s > from->chunk_left) s >>= 1;
+        slab_release(to, from->chunk, s);
+        from->chunk += s;
+        from->chunk_left -= s;
+    }
+}
+static char *slab_take(Slab *sl, int size) {
+    size = slab_round(size);
+    if (size == 0) return NULL;
+    sl->in_use += size;
+    if (size > SLAB_MAX) {
+        sl->reserved += size;
+        return malloc(size);
+    }
+    int c = slab_class(size);
+    if (sl->free[c]) {
+        SlabFree *f = sl->free[c];
+        sl->free[c] = f->next;
+        return (char *)f;
+    }
+    if (sl->chunk_left < size) {
+        slab_retire(sl, sl);
+        sl->chunk = malloc(SLAB_CHUNK);
+        sl->chunk_left = SLAB_CHUNK;
+        sl->reserved += SLAB_CHUNK;
+    }
+    char *p = sl->chunk;
+    sl->chunk += size;
+    sl->chunk_left -= size;
+    return p;
+}
+char *slab_alloc(int size) {
+    return slab_take(&slab, size);
+}
+void slab_free(char *p, int size) {
+    if (!p) return;
+    slab.in_use -= size;
+    if (size > SLAB_MAX) {
+        slab.reserved -= size;
+        free(p);
+        return;
+    }
+    slab_release(&slab, p, size);
+}
+// Takes over what a worker's slab holds.
+static void slab_merge(Slab *from) {
+    slab_retire(from, &slab);
+    for (int c = 0; c < SLAB_CLASSES; ++c) {
+        while (from->free[c]) {
+            SlabFree *f = from->free[c];
+            from->free[c] = f->next;
+            f->next = slab.free[c];
+            slab.free[c] = f;
+        }
+    }
+    slab.in_use += from->in_use;
+    slab.reserved += from->reserved;
+    memset(from, 0, sizeof(*from));
+}
+
+void gapbuf_init(GapBuf *gb, int cap) {
+    gb->buf = slab_alloc(cap);
+    gb->buf_size = slab_round(cap);
     gb->gap_start = 0;
-    gb->gap_end = GAP_SIZE;
-    if (gb->gap_end > gb->buf_size) gb->gap_end = gb->buf_size;
-    return gb;
+    gb->gap_end = gb->buf_size;
+    gb->wide = 0;
+    gb->brk = NULL;
+}
+void free_gapbuf(GapBuf *gb) {
+    slab_free(gb->buf, gb->buf_size);
+    if (gb->brk) free(gb->brk->b);
+    free(gb->brk);
+    gb->brk = NULL;
+    gb->buf = NULL;
+    gb->buf_size = gb->gap_start = gb->gap_end = gb->wide = 0;
 }
-void free_gapbuf(GapBuf *gb) { if (gb) { free(gb->buf); free(gb); } }
 
 void ensure_gap(GapBuf *gb, int min_gap) {
     int gap_len = gb->gap_end - gb->gap_start;
     if (gap_len >= min_gap) return;
-    int new_size = gb->buf_size + GAP_SIZE;
-    char *new_buf = calloc(1, new_size);
+    int len = gb->buf_size - gap_len;
+    int grow = len / 2 > GAP_SIZE ? len / 2 : GAP_SIZE;
+    int new_size = slab_round(len + min_gap + grow);
+    int tail = gb->buf_size - gb->gap_end;
+    char *new_buf = slab_alloc(new_size);
     memcpy(new_buf, gb->buf, gb->gap_start);
-    memcpy(new_buf + gb->gap_start + GAP_SIZE, gb->buf + gb->gap_end, gb->buf_size - gb->gap_end);
-    free(gb->buf);
+    memcpy(new_buf + new_size - tail, gb->buf + gb->gap_end, tail);
+    slab_free(gb->buf, gb->buf_size);
     gb->buf = new_buf;
-    gb->gap_end = gb->gap_start + GAP_SIZE;
+    gb->gap_end = new_size - tail;
     gb->buf_size = new_size;
 }
+// Drops the gap of a line that is no longer being edited.
+void gapbuf_compact(GapBuf *gb) {
+    int len = gb->buf_size - (gb->gap_end - gb->gap_start);
+    int size = slab_round(len);
+    if (size == gb->buf_size) return;
+    char *new_buf = slab_alloc(size);
+    memcpy(new_buf, gb->buf, gb->gap_start);
+    memcpy(new_buf + gb->gap_start, gb->buf + gb->gap_end, gb->buf_size - gb->gap_end);
+    slab_free(gb->buf, gb->buf_size);
+    gb->buf = new_buf;
+    gb->buf_size = size;
+    gb->gap_start = len;
+    gb->gap_end = size;
+}
 void move_gap(GapBuf *gb, int pos) {
     if (pos < 0) pos = 0;
     int len = gb->gap_start + (gb->buf_size - gb->gap_end);
@@ -111,6 +735,15 @@ void gapbuf_insert(GapBuf *gb, int pos, char c) {
     move_gap(gb, pos);
     ensure_gap(gb, 1);
     gb->buf[gb->gap_start++] = c;
+    if (c & 0x80) gb->wide = 1;
+}
+void gapbuf_insert_bytes(GapBuf *gb, int pos, const char *s, int n) {
+    if (n <= 0) return;
+    move_gap(gb, pos);
+    ensure_gap(gb, n);
+    memcpy(gb->buf + gb->gap_start, s, n);
+    gb->gap_start += n;
+    if (!gb->wide && ascii_run(s, n) < n) gb->wide = 1;
 }
 void gapbuf_delete(GapBuf *gb, int pos) {
     int len = gb->gap_start + (gb->buf_size - gb->gap_end);
@@ -127,332 +760,5592 @@ char gapbuf_get(GapBuf *gb, int i) {
     if (i < gb->gap_start) return gb->buf[i];
     else return gb->buf[i + (gb->gap_end - gb->gap_start)];
 }
-void gapbuf_to_cstr(GapBuf *gb, char *out, size_t out_size) {
-    int len = gapbuf_length(gb);
-    if ((size_t)len >= out_size) len = out_size - 1;
-    int i, j = 0;
-    for (i = 0; i < len; ++i)
-        out[j++] = gapbuf_get(gb, i);
-    out[j] = '\0';
+static void gapbuf_view(GapBuf *gb, LineView *lv) {
+    lv->p[0] = gb->buf;
+    lv->n[0] = gb->gap_start;
+    lv->p[1] = gb->buf + gb->gap_end;
+    lv->n[1] = gb->buf_size - gb->gap_end;
+    lv->wide = gb->wide;
+    if (gb->wide && !gb->brk && lv->n[0] + lv->n[1] > BRK_CK) gb->brk = calloc(1, sizeof(Breaks));
+    lv->brk = gb->brk;
 }
 
-void insert_line(Editor *ed, int at) {
-    for (int i = ed->num_lines; i > at; --i)
-        ed->lines[i] = ed->lines[i-1];
-    ed->lines[at] = make_gapbuf(LINE_CAP);
-    ed->num_lines++;
+// --- Loaded text and its line index ---
+
+static long orig_off(OrigText *o, int i) {
+    return o->off[i / OFF_CHUNK][i % OFF_CHUNK];
 }
-void split_line(Editor *ed, int y, int x) {
-    GapBuf *gb = ed->lines[y];
-    int len = gapbuf_length(gb);
-    if (x < 0) x = 0;
-    if (x > len) x = len;
-    insert_line(ed, y+1);
-    GapBuf *next = ed->lines[y+1];
-    for (int i = x; i < len; ++i)
-        gapbuf_insert(next, gapbuf_length(next), gapbuf_get(gb, i));
-    gb->gap_start = x;
-    gb->gap_end = gb->buf_size;
+// Flag of the ROW_CK-line block holding line i, set when one of its lines
+// has bytes >= 0x80; the lines of clear blocks are ASCII.
+static unsigned char *orig_wide(OrigText *o, int i) {
+    return (unsigned char *)(o->off[i / OFF_CHUNK] + OFF_CHUNK) + i % OFF_CHUNK / ROW_CK;
 }
-void delete_line(Editor *ed, int at) {
-    if (ed->num_lines <= 1) return;
-    free_gapbuf(ed->lines[at]);
-    for (int i = at; i < ed->num_lines-1; i++)
-        ed->lines[i] = ed->lines[i+1];
-    ed->lines[ed->num_lines-1] = NULL;
-    --ed->num_lines;
+static void orig_set_off(OrigText *o, int i, long v) {
+    long **c = &o->off[i / OFF_CHUNK];
+    if (!*c) *c = calloc(1, OFF_CHUNK * sizeof(long) + OFF_CHUNK / ROW_CK);
+    (*c)[i % OFF_CHUNK] = v;
 }
-void join_line(Editor *ed, int y) {
-    GapBuf *gb = ed->lines[y];
-    GapBuf *next = ed->lines[y+1];
-    int nlen = gapbuf_length(next);
-    for (int i = 0; i < nlen; ++i)
-        gapbuf_insert(gb, gapbuf_length(gb), gapbuf_get(next, i));
-    delete_line(ed, y+1);
+static void orig_index(OrigText *o) {
+    const char *s = o->data, *end = o->data + o->len;
+    int n = 0;
+    orig_set_off(o, 0, 0);
+    while (s < end && !__atomic_load_n(&o->stop, __ATOMIC_RELAXED)) {
+        const char *nl = memchr(s, '\n', end - s), *e = nl ? nl : end;
+        // the editor reads the flags of indexed lines while this runs
+        unsigned char *w = orig_wide(o, n);
+        if (!__atomic_load_n(w, __ATOMIC_RELAXED) && ascii_run(s, (int)(e - s)) < e - s)
+            __atomic_store_n(w, 1, __ATOMIC_RELAXED);
+        s = nl ? nl + 1 : end + 1;
+        orig_set_off(o, ++n, s - o->data);
+        if ((n & 4095) == 0) __atomic_store_n(&o->lines, n, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&o->lines, n, __ATOMIC_RELEASE);
+    __atomic_store_n(&o->done, 1, __ATOMIC_RELEASE);
 }
-
-void load_file(Editor *ed, const char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) return;
-    char linebuf[LINE_CAP];
-    int lineno = 0;
-    while (fgets(linebuf, LINE_CAP, fp) && lineno < ed->cap_lines) {
-        int len = strlen(linebuf);
-        if (len && linebuf[len-1] == '\n') linebuf[--len] = 0;
-        if (!ed->lines[lineno])
-            ed->lines[lineno] = make_gapbuf(LINE_CAP);
-        for (int i = 0; i < len; ++i)
-            gapbuf_insert(ed->lines[lineno], gapbuf_length(ed->lines[lineno]), linebuf[i]);
-        lineno++;
-        if (lineno < ed->cap_lines) ed->num_lines++;
-    }
-    fclose(fp);
+static void *orig_indexer(void *arg) {
+    orig_index(arg);
+    return NULL;
 }
-void save_file(Editor *ed, const char *filename) {
-    FILE *fp = fopen(filename, "w");
-    if (!fp) return;
-    char tmp[LINE_CAP*2];
-    for (int i = 0; i < ed->num_lines; ++i) {
-        if (!ed->lines[i]) continue;
-        gapbuf_to_cstr(ed->lines[i], tmp, sizeof(tmp));
-        fprintf(fp, "%s\n", tmp);
+static void orig_free(OrigText *o) {
+    if (o->threaded) {
+        __atomic_store_n(&o->stop, 1, __ATOMIC_RELAXED);
+        pthread_join(o->indexer, NULL);
     }
-    fclose(fp);
+    for (int i = 0; i < o->chunks; ++i) free(o->off[i]);
+    free(o->off);
+    if (o->mapped) munmap(o->data, o->len);
+    else free(o->data);
+    memset(o, 0, sizeof(*o));
+}
+int indexing(Editor *ed) {
+    return ed->orig.data && !__atomic_load_n(&ed->orig.done, __ATOMIC_ACQUIRE);
 }
 
-enum { KEY_NULL = 0, KEY_ARROW_LEFT = 1000, KEY_ARROW_RIGHT, KEY_ARROW_UP, KEY_ARROW_DOWN };
+// --- Wrapped rows: every piece knows how many screen rows its lines take ---
 
-int read_key(void) {
-    char c;
-    ssize_t nread;
-    while ((nread = read(STDIN_FILENO, &c, 1)) == 0);
-    if (nread == -1) die("read");
-    if (c == '\x1b') {
-        char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-        if (seq[0] == '[') {
-            switch (seq[1]) {
-                case 'A': return KEY_ARROW_UP;
-                case 'B': return KEY_ARROW_DOWN;
-                case 'C': return KEY_ARROW_RIGHT;
-                case 'D': return KEY_ARROW_LEFT;
-            }
-        }
-        return '\x1b';
+static int line_rows(int len, int w) {
+    return len ? (len + w - 1) / w : 1;
+}
+static unsigned char view_byte(const LineView *lv, int i) {
+    return i < lv->n[0] ? lv->p[0][i] : lv->p[1][i - lv->n[0]];
+}
+// Decodes the character at byte i of lv into *cp and returns its length;
+// one split by the gap is put together first.
+static int view_char(const LineView *lv, int i, unsigned *cp) {
+    if (i >= lv->n[0])
+        return utf8_decode((const unsigned char *)lv->p[1] + i - lv->n[0], lv->n[0] + lv->n[1] - i, cp);
+    if (lv->n[0] - i >= 4 || !lv->n[1])
+        return utf8_decode((const unsigned char *)lv->p[0] + i, lv->n[0] - i, cp);
+    unsigned char b[4];
+    int n = 0;
+    for (; n < 4 && i + n < lv->n[0] + lv->n[1]; ++n) b[n] = view_byte(lv, i + n);
+    return utf8_decode(b, n, cp);
+}
+// Cells taken by the character at byte i of lv, whose length goes to *len.
+// A combining mark that starts a line stands on a blank cell of its own.
+static int view_width(const LineView *lv, int i, int *len) {
+    unsigned cp;
+    *len = view_char(lv, i, &cp);
+    int w = char_width(cp);
+    return w || i ? w : 1;
+}
+// Lays out the characters of lv in [at, to) at width w, going on from
+// wrapped row *row, column *col and leaving there the place after them.
+// A character that would cross the right edge starts the next row and a
+// combining mark stays in the cell before it. Adds the cells taken to
+// *cells unless it is NULL or -1, which it becomes at a character wider
+// than one cell. Returns the byte reached, which is past to when a
+// character straddles it.
+static int view_walk(const LineView *lv, int w, int at, int to, int *row, int *col, int *cells) {
+    while (at < to) {
+        int s = at >= lv->n[0], i = s ? at - lv->n[0] : at, end = s ? lv->n[1] : lv->n[0];
+        int k = ascii_run(lv->p[s] + i, (to - at < end - i ? to - at : end - i));
+        if (k) {
+            // ASCII fills the rows a cell at a time
+            int t = *col + k, r = (t - 1) / w;
+            *row += r;
+            *col = t - r * w;
+            at += k;
+            if (cells && *cells >= 0) *cells += k;
+            continue;
+        }
+        int n, cw = view_width(lv, at, &n);
+        if (cells && *cells >= 0) *cells = cw > 1 ? -1 : *cells + cw;
+        if (*col + cw > w && *col) {
+            ++*row;
+            *col = 0;
+        }
+        *col += cw;
+        at += n;
     }
-    return c;
+    return at;
 }
-
-void get_screen_cursor(Editor *ed, int *out_row, int *out_col, int termwidth) {
-    int row = 0;
-    for (int i = 0; i < ed->cy; ++i) {
-        int linelen = ed->lines[i] ? gapbuf_length(ed->lines[i]) : 0;
-        row += (linelen + termwidth - 1) / termwidth;
-        if (row < 0) row = 0;
+// Moves a place on over cells characters of one cell or none, as
+// view_walk would.
+static void brk_skip(int w, int cells, int *row, int *col) {
+    int t = *col + cells, r = t ? (t - 1) / w : 0;
+    *row += r;
+    *col = t - r * w;
+}
+// Line text changed from byte x on: d bytes went in there, or -d went
+// out, and what followed moved along. The points whose layout may have
+// changed with the bytes before them are dropped; those after the change
+// are moved with their text and laid out again by brk_refresh.
+static void brk_edit(Breaks *bk, int x, int d) {
+    long e = x + (d < 0 ? -(long)d : 0);
+    int m = 0, ok = 0;
+    if (!bk) return;
+    // rows kept from before two edits could not be trusted
+    if (bk->ok < bk->n) bk->n = bk->ok;
+    for (int k = 0; k < bk->n; ++k) {
+        Brk c = bk->b[k];
+        // a character decoded before a point reads at most 3 bytes past it
+        if (c.at == 0 || c.at <= x - 3) ok = m + 1;
+        else if (c.at >= e) c.at += d;
+        else continue;
+        bk->b[m++] = c;
     }
-    int col = ed->cx % termwidth;
-    row += ed->cx / termwidth;
-    *out_row = row;
-    *out_col = col;
+    bk->n = m;
+    bk->ok = ok;
+    if (ok) bk->b[ok - 1].cells = -1;
 }
-void draw(Editor *ed) {
-    int termwidth = get_terminal_width();
-    int termheight = get_terminal_height();
-    char tmp[LINE_CAP*2];
-    write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
-    int screenrow = 0;
-    for (int i = 0; i < ed->num_lines && screenrow < termheight-2; ++i) {
-        if (!ed->lines[i]) {
-            printf("[NULL LINE]\n");
-            screenrow++;
+// Lays out again the points an edit moved. Those that a character now
+// runs over go; past one laid out in the same column as before, the rest
+// are as they were, some rows up or down.
+static void brk_refresh(Breaks *bk, const LineView *lv, int w) {
+    Brk *b = bk->b;
+    int m = bk->ok, k = m, known = 0, cells = 0;
+    int at = b[m - 1].at, row = b[m - 1].row, col = b[m - 1].col;
+    while (k < bk->n) {
+        Brk c = b[k++];
+        if (known) {
+            brk_skip(w, b[m - 1].cells, &row, &col);
+            at = c.at;
+        } else if ((at = view_walk(lv, w, at, c.at, &row, &col, &cells)) != c.at) {
             continue;
+        } else {
+            b[m - 1].cells = cells;
         }
-        gapbuf_to_cstr(ed->lines[i], tmp, sizeof(tmp));
-        int linelen = strlen(tmp);
-        int start = 0;
-        while (start < linelen && screenrow < termheight-2) {
-            int seglen = linelen-start;
-            if (seglen > termwidth)
-                seglen = termwidth;
-            if (ed->mode == MODE_SEARCH && ed->search[0]) {
-                char *found = strstr(tmp+start, ed->search);
-                int offset = found ? (found - (tmp+start)) : -1;
-                if (offset >= 0 && offset < seglen) {
-                    fwrite(tmp+start, 1, offset, stdout);
-                    printf("\x1b[7m");
-                    fwrite(tmp+start+offset, 1, strlen(ed->search), stdout);
-                    printf("\x1b[0m");
-                    fwrite(tmp+start+offset+strlen(ed->search), 1, seglen-offset-strlen(ed->search), stdout);
-                } else {
-                    fwrite(tmp+start, 1, seglen, stdout);
-                }
-            } else {
-                fwrite(tmp+start, 1, seglen, stdout);
+        if (col == c.col) {
+            int dr = row - c.row;
+            for (--k; k < bk->n; ++k) {
+                b[k].row += dr;
+                b[m++] = b[k];
             }
-            if (seglen < termwidth)
-                printf("%*s", termwidth-seglen, "");
-            putchar('\n');
-            start += seglen;
-            screenrow++;
-        }
-        if (linelen == 0 && screenrow < termheight-2) {
-            putchar('\n');
-            screenrow++;
+            break;
         }
+        c.row = row;
+        c.col = col;
+        b[m++] = c;
+        known = c.cells >= 0;
+        cells = 0;
     }
-    const char *mode_str = (ed->mode == MODE_INSERT) ? "INSERT"
-                          : (ed->mode == MODE_COMMAND) ? "COMMAND"
-                          : (ed->mode == MODE_NORMAL) ? "NORMAL"
-                          : "SEARCH";
-    printf("---- %s MODE ----", mode_str);
-    if (ed->mode == MODE_COMMAND) printf(":%s", ed->command);
-    if (ed->mode == MODE_SEARCH) printf("/%s", ed->search);
-    int crow, ccol;
-    get_screen_cursor(ed, &crow, &ccol, termwidth);
-    if (crow >= termheight-1) crow = termheight-2;
-    printf("\x1b[%d;%dH", crow+1, ccol+1);
-    fflush(stdout);
+    bk->n = bk->ok = m;
 }
-
-// --------- CHANGED: c == '\n' to c == '\n' || c == '\r' everywhere ---------
-
-void process_insert(Editor *ed, int c) {
-    if (!ed->lines[ed->cy]) ed->lines[ed->cy] = make_gapbuf(LINE_CAP);
-    int len = gapbuf_length(ed->lines[ed->cy]);
-    if (c == 27) { // ESC
-        ed->mode = MODE_NORMAL;
-        return;
+// The layout cache of lv at width w, ready to be extended; NULL when the
+// line is walked from its start.
+static Breaks *brk_get(const LineView *lv, int w) {
+    Breaks *bk = lv->brk;
+    if (!bk || !lv->wide || w == INT_MAX || lv->n[0] + lv->n[1] <= BRK_CK) return NULL;
+    if (bk->w != w || (bk->key && bk->key != lv->p[0])) {
+        bk->n = bk->ok = 0;
+        bk->w = w;
+        if (bk->key) bk->key = lv->p[0];
     }
-    if (c == KEY_ARROW_LEFT) {
-        if (ed->cx > 0) ed->cx--;
-    } else if (c == KEY_ARROW_RIGHT) {
-        if (ed->cx < len) ed->cx++;
-    } else if (c == KEY_ARROW_DOWN && ed->cy < ed->num_lines-1) {
-        ed->cy++;
-        int nlen = gapbuf_length(ed->lines[ed->cy]);
-        if (ed->cx > nlen) ed->cx = nlen;
-    } else if (c == KEY_ARROW_UP && ed->cy > 0) {
-        ed->cy--;
-        int nlen = gapbuf_length(ed->lines[ed->cy]);
-        if (ed->cx > nlen) ed->cx = nlen;
-    } else if (c == 127 || c == 8) { // Backspace
-        if (ed->cx > 0) {
-            gapbuf_delete(ed->lines[ed->cy], ed->cx);
-            ed->cx--;
-        } else if (ed->cy > 0) {
-            int prevlen = gapbuf_length(ed->lines[ed->cy-1]);
-            join_line(ed, ed->cy-1);
-            ed->cy--;
-            ed->cx = prevlen;
+    if (!bk->n) {
+        if (!bk->cap) {
+            bk->cap = 64;
+            bk->b = malloc(bk->cap * sizeof(Brk));
         }
-    } else if (c == '\n' || c == '\r') {
-        split_line(ed, ed->cy, ed->cx);
-        ed->cy++; ed->cx = 0;
-    } else if (c >= 32 && c < 127) {
-        gapbuf_insert(ed->lines[ed->cy], ed->cx, c);
-        ed->cx++;
+        bk->b[0] = (Brk){ 0, 0, 0, -1 };
+        bk->n = bk->ok = 1;
     }
+    if (bk->ok < bk->n) brk_refresh(bk, lv, w);
+    return bk;
 }
-
-void process_command(Editor *ed, int c) {
-    int clen = strlen(ed->command);
-    if (c == '\n' || c == '\r') {
-        if (strcmp(ed->command, "w") == 0)
-            save_file(ed, ed->filename);
-        else if (strcmp(ed->command, "q") == 0) {
-            disableRawMode();
-            if (ed->lines) {
-                for (int i = 0; i < ed->num_lines; ++i) free_gapbuf(ed->lines[i]);
-                free(ed->lines);
-            }
-            exit(0);
-        } else if (strcmp(ed->command, "wq") == 0) {
-            save_file(ed, ed->filename);
-            disableRawMode();
-            if (ed->lines) {
-                for (int i = 0; i < ed->num_lines; ++i) free_gapbuf(ed->lines[i]);
-                free(ed->lines);
-            }
-            exit(0);
+// Adds points until the last is within BRK_CK bytes of byte x or of the
+// end, and on row row or below.
+static void brk_extend(Breaks *bk, const LineView *lv, int x, int row) {
+    int len = lv->n[0] + lv->n[1];
+    for (;;) {
+        Brk c = bk->b[bk->n - 1];
+        if (c.at + BRK_CK > len || (c.at + BRK_CK > x && c.row >= row)) return;
+        int cells = 0;
+        c.at = view_walk(lv, bk->w, c.at, c.at + BRK_CK, &c.row, &c.col, &cells);
+        bk->b[bk->n - 1].cells = cells;
+        c.cells = -1;
+        if (bk->n == bk->cap) {
+            bk->cap *= 2;
+            bk->b = realloc(bk->b, bk->cap * sizeof(Brk));
         }
-        ed->mode = MODE_INSERT;
-    } else if ((c == 127 || c == 8) && clen > 0) {
-        ed->command[clen-1] = '\0';
-    } else if (c == 27) { // ESC
-        ed->mode = MODE_INSERT;
-    } else if (clen < 120 && c != 27) {
-        ed->command[clen] = c; ed->command[clen+1] = 0;
+        bk->b[bk->n++] = c;
+        bk->ok = bk->n;
     }
 }
-
-void process_normal(Editor *ed, int c) {
-    int len = gapbuf_length(ed->lines[ed->cy]);
-    if (c == 'i') {
-        ed->mode = MODE_INSERT;
-    } else if (c == ':') {
-        ed->mode = MODE_COMMAND; ed->command[0] = 0;
-    } else if (c == '/') {
-        ed->mode = MODE_SEARCH; ed->search[0] = 0; ed->search_found = 0; ed->search_last_y = ed->cy;
-    } else if (c == KEY_ARROW_LEFT) {
-        if (ed->cx > 0) ed->cx--;
-    } else if (c == KEY_ARROW_RIGHT) {
-        if (ed->cx < len) ed->cx++;
-    } else if (c == KEY_ARROW_DOWN && ed->cy < ed->num_lines-1) {
-        ed->cy++;
-        int nlen = gapbuf_length(ed->lines[ed->cy]);
-        if (ed->cx > nlen) ed->cx = nlen;
-    } else if (c == KEY_ARROW_UP && ed->cy > 0) {
-        ed->cy--;
-        int nlen = gapbuf_length(ed->lines[ed->cy]);
-        if (ed->cx > nlen) ed->cx = nlen;
+// The last point at or before byte x, or above row row.
+static Brk brk_find(Breaks *bk, int x, int row) {
+    int lo = 0, hi = bk->n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (bk->b[mid].at <= x && bk->b[mid].row < row) lo = mid;
+        else hi = mid - 1;
     }
+    return bk->b[lo];
 }
-
-void process_search(Editor *ed, int c) {
-    int slen = strlen(ed->search);
-    if (c == '\n' || c == '\r') {
-        int y = ed->cy;
-        for (int i = 0; i < ed->num_lines; ++i) {
-            int lineidx = (y + i) % ed->num_lines;
-            char tmp[LINE_CAP*2];
-            gapbuf_to_cstr(ed->lines[lineidx], tmp, sizeof(tmp));
-            char *found = strstr(tmp, ed->search);
-            if (found) {
-                ed->cy = lineidx;
-                ed->cx = found - tmp;
-                ed->search_found = 1;
-                ed->search_last_y = ed->cy;
-                ed->mode = MODE_NORMAL;
-                return;
-            }
-        }
-        ed->search_found = 0;
-        ed->mode = MODE_NORMAL;
-    } else if ((c == 127 || c == 8) && slen > 0) {
-        ed->search[slen-1] = '\0';
-    } else if (c == 27) { // ESC
-        ed->mode = MODE_NORMAL;
-    } else if (slen < 120 && c != 27) {
-        ed->search[slen] = c; ed->search[slen+1] = 0;
+// Wrapped rows line lv takes at width w.
+static int view_rows(const LineView *lv, int w) {
+    int len = lv->n[0] + lv->n[1], row = 0, col = 0, at = 0;
+    if (!lv->wide) return line_rows(len, w);
+    Breaks *bk = brk_get(lv, w);
+    if (bk) {
+        brk_extend(bk, lv, len, -1);
+        Brk c = bk->b[bk->n - 1];
+        at = c.at, row = c.row, col = c.col;
     }
+    view_walk(lv, w, at, len, &row, &col, NULL);
+    return row + 1;
 }
-
-int main(int argc, char *argv[]) {
-    Editor ed;
-    memset(&ed, 0, sizeof(ed));
-    ed.lines = calloc(MAX_LINES, sizeof(GapBuf*));
-    ed.cap_lines = MAX_LINES;
-    ed.num_lines = 1;
-    ed.lines[0] = make_gapbuf(LINE_CAP);
-    ed.cx = ed.cy = 0;
-    ed.mode = MODE_INSERT;
-    ed.filename[0] = 0;
-    if (argc > 1) {
-        strncpy(ed.filename, argv[1], FILENAME_MAXLEN-1);
-        load_file(&ed, ed.filename);
+// Wrapped row and column of the cursor on byte x of lv.
+static void view_cursor(const LineView *lv, int w, int x, int *row, int *col) {
+    int len = lv->n[0] + lv->n[1];
+    if (!lv->wide) {
+        int last = line_rows(len, w) - 1;
+        *row = x / w < last ? x / w : last;
+        *col = x - *row * w;
     } else {
-        printf("Usage: %s [filename]\n", argc > 0 ? argv[0] : "editor");
+        int n, cw = 1, at = 0;
+        Breaks *bk = brk_get(lv, w);
+        *row = *col = 0;
+        if (bk) {
+            brk_extend(bk, lv, x, -1);
+            Brk c = brk_find(bk, x, INT_MAX);
+            at = c.at, *row = c.row, *col = c.col;
+        }
+        view_walk(lv, w, at, x, row, col, NULL);
+        if (x < len) cw = view_width(lv, x, &n);
+        // the character under the cursor may start the next row
+        if (*col + cw > w && *col && x < len) {
+            ++*row;
+            *col = 0;
+        }
     }
-    enableRawMode();
-
-    while (1) {
-        draw(&ed);
+    if (*col >= w) *col = w - 1;
+}
+// Byte of lv shown at wrapped row row, column col. Past the end of a row
+// that is its last character, past the end of the line the end.
+static int view_at(const LineView *lv, int w, int row, int col) {
+    int len = lv->n[0] + lv->n[1], r = 0, c = 0, at = 0, last = 0;
+    long target = (long)row * w + col;
+    if (!lv->wide) return target < len ? (int)target : len;
+    Breaks *bk = brk_get(lv, w);
+    if (bk && row > 0) {
+        // from the last point on a row above
+        brk_extend(bk, lv, -1, row);
+        Brk k = brk_find(bk, INT_MAX, row);
+        at = k.at, r = k.row, c = k.col;
+    }
+    while (at < len) {
+        int s = at >= lv->n[0], i = s ? at - lv->n[0] : at;
+        int k = ascii_run(lv->p[s] + i, lv->n[s] - i);
+        if (k) {
+            // ASCII takes the cells from (r, c) on in reading order
+            long p = (long)r * w + c;
+            if (target - p < k) return at + (int)(target - p);
+            int t = c + k, d = (t - 1) / w;
+            r += d;
+            c = t - d * w;
+            at += k;
+            last = at - 1;
+            continue;
+        }
+        int n, cw = view_width(lv, at, &n);
+        if (c + cw > w && c) {
+            if (r == row) return last;
+            ++r;
+            c = 0;
+        }
+        if (r == row && c + cw > col) return at;
+        if (cw) last = at;
+        c += cw;
+        at += n;
+    }
+    return len;
+}
+// Display column of byte x of lv, as if the line did not wrap.
+static int view_col(const LineView *lv, int x) {
+    int row = 0, col = 0;
+    if (!lv->wide) return x;
+    view_walk(lv, INT_MAX, 0, x, &row, &col, NULL);
+    return col;
+}
+// Start of the character after the one at x, past the marks over it.
+static int view_next(const LineView *lv, int x) {
+    int len = lv->n[0] + lv->n[1], n;
+    if (!lv->wide) return x < len ? x + 1 : len;
+    if (x < len) {
+        view_width(lv, x, &n);
+        x += n;
+    }
+    while (x < len && !view_width(lv, x, &n)) x += n;
+    return x;
+}
+// Start of the character before x, with the marks over it.
+static int view_prev(const LineView *lv, int x) {
+    int n;
+    unsigned cp;
+    if (!lv->wide) return x > 0 ? x - 1 : 0;
+    while (x > 0) {
+        // back over continuation bytes to a sequence that ends at x
+        int s = x - 1;
+        while (s > 0 && x - s < 4 && (view_byte(lv, s) & 0xC0) == 0x80) --s;
+        if (view_char(lv, s, &cp) != x - s) s = x - 1;
+        x = s;
+        if (view_width(lv, x, &n)) break;
+    }
+    return x;
+}
+// The layout cache loaded lines share, which brk_get keys to the line.
+static Breaks *orig_brk(Editor *ed) {
+    if (!ed->orig_brk.key) ed->orig_brk.key = ed->orig.data;
+    return &ed->orig_brk;
+}
+// Rows taken by loaded line i.
+static int orig_line_rows(Editor *ed, int i) {
+    OrigText *o = &ed->orig;
+    long s = orig_off(o, i);
+    int n = (int)(orig_off(o, i + 1) - s - 1);
+    if (!__atomic_load_n(orig_wide(o, i), __ATOMIC_RELAXED)) return line_rows(n, ed->rows_width);
+    LineView lv = { { o->data + s, "" }, { n, 0 }, 1, orig_brk(ed) };
+    return view_rows(&lv, ed->rows_width);
+}
+// Rows taken by loaded lines [0, i), from the checkpoint every ROW_CK lines.
+static long orig_rows(Editor *ed, int i) {
+    int k = i / ROW_CK;
+    long r = ed->rowck[k];
+    for (int j = k * ROW_CK; j < i; ++j)
+        r += orig_line_rows(ed, j);
+    return r;
+}
+static void extend_rowck(Editor *ed) {
+    int need = ed->loaded / ROW_CK + 1;
+    if (need > ed->rowck_cap) {
+        ed->rowck_cap = need * 2;
+        ed->rowck = realloc(ed->rowck, ed->rowck_cap * sizeof(long));
+    }
+    for (; ed->rowck_n < need; ed->rowck_n++) {
+        int k = ed->rowck_n;
+        ed->rowck[k] = k ? ed->rowck[k - 1] : 0;
+        for (int j = (k - 1) * ROW_CK; k && j < k * ROW_CK; ++j)
+            ed->rowck[k] += orig_line_rows(ed, j);
+    }
+}
+static void piece_set_rows(Editor *ed, Piece *p) {
+    if (!ed->rows_width) p->rows = 0;
+    else if (p->first < 0) {
+        LineView lv;
+        gapbuf_view(&p->gb, &lv);
+        // a wide line whose last non-ASCII byte went is laid out by length
+        // again; a long one keeps its layout cache instead of being scanned
+        if (lv.wide && !lv.brk && ascii_run(lv.p[0], lv.n[0]) == lv.n[0] && ascii_run(lv.p[1], lv.n[1]) == lv.n[1])
+            lv.wide = p->gb.wide = 0;
+        p->rows = view_rows(&lv, ed->rows_width);
+    }
+    else p->rows = orig_rows(ed, p->first + p->count) - orig_rows(ed, p->first);
+}
+
+// --- Piece tree: lines live in a treap keyed by line index ---
+
+static unsigned piece_rand(void) {
+    static unsigned s = 2463534242u;
+    s ^= s << 13; s ^= s >> 17; s ^= s << 5;
+    return s;
+}
+static int piece_total(Piece *p) { return p ? p->total : 0; }
+static long piece_rows(Piece *p) { return p ? p->rows_total : 0; }
+static void piece_update(Piece *p) {
+    p->total = p->count + piece_total(p->left) + piece_total(p->right);
+    p->rows_total = p->rows + piece_rows(p->left) + piece_rows(p->right);
+}
+static Piece *make_piece(Editor *ed, int first, int count) {
+    Piece *p = calloc(1, sizeof(Piece));
+    p->prio = piece_rand();
+    p->first = first;
+    p->count = count;
+    piece_set_rows(ed, p);
+    piece_update(p);
+    return p;
+}
+static Piece *piece_merge(Piece *a, Piece *b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->prio > b->prio) {
+        a->right = piece_merge(a->right, b);
+        piece_update(a);
+        return a;
+    }
+    b->left = piece_merge(a, b->left);
+    piece_update(b);
+    return b;
+}
+// Split so that *l holds the first k lines; a piece straddling k is cut in two.
+static void piece_split(Editor *ed, Piece *t, int k, Piece **l, Piece **r) {
+    if (!t) { *l = *r = NULL; return; }
+    int lt = piece_total(t->left);
+    if (k <= lt) {
+        piece_split(ed, t->left, k, l, &t->left);
+        piece_update(t);
+        *r = t;
+    } else if (k >= lt + t->count) {
+        piece_split(ed, t->right, k - lt - t->count, &t->right, r);
+        piece_update(t);
+        *l = t;
+    } else {
+        int head = k - lt;
+        Piece *tail = make_piece(ed, t->first + head, t->count - head);
+        tail->right = t->right;
+        piece_update(tail);
+        t->right = NULL;
+        t->count = head;
+        piece_set_rows(ed, t);
+        piece_update(t);
+        *l = t;
+        *r = tail;
+    }
+}
+static Piece *piece_find(Piece *t, int y, int *index) {
+    while (t) {
+        int lt = piece_total(t->left);
+        if (y < lt) {
+            t = t->left;
+        } else if (y < lt + t->count) {
+            *index = y - lt;
+            return t;
+        } else {
+            y -= lt + t->count;
+            t = t->right;
+        }
+    }
+    return NULL;
+}
+// Recounts the rows of the piece holding line y after it grew by n lines or
+// its text changed, and fixes the sums on the way back up.
+static void piece_refresh(Editor *ed, Piece *t, int y, int n) {
+    int lt = piece_total(t->left);
+    if (y < lt) {
+        piece_refresh(ed, t->left, y, n);
+    } else if (y >= lt + t->count) {
+        piece_refresh(ed, t->right, y - lt - t->count, n);
+    } else {
+        t->count += n;
+        piece_set_rows(ed, t);
+    }
+    piece_update(t);
+}
+static void syn_reserve(Syntax *h, int n) {
+    if (n <= h->cap) return;
+    h->cap = n + n / 2 + 1024;
+    h->st = realloc(h->st, h->cap);
+}
+// The text of line y changed: its cached lexer state is stale.
+static void syn_changed(Editor *ed, int y) {
+    Syntax *h = &ed->syn;
+    if (y >= h->len) return;
+    h->st[y] |= SYN_STALE;
+    if (y < h->dirty) h->dirty = y;
+}
+// k lines were inserted at line at (removed when k < 0). New lines and the
+// line after them have no valid state yet.
+static void syn_shift(Editor *ed, int at, int k) {
+    Syntax *h = &ed->syn;
+    if (at >= h->len || !k) return;
+    if (k > 0) {
+        syn_reserve(h, h->len + k);
+        memmove(h->st + at + k, h->st + at, h->len - at);
+        memset(h->st + at, SYN_STALE, k);
+        h->len += k;
+        if (at + k < h->len) h->st[at + k] |= SYN_STALE;
+    } else {
+        int end = at - k < h->len ? at - k : h->len;
+        memmove(h->st + at, h->st + end, h->len - end);
+        h->len -= end - at;
+        if (at < h->len) h->st[at] |= SYN_STALE;
+    }
+    if (at < h->dirty) h->dirty = at;
+}
+// Line y changed from byte x on: d bytes went in at x, or -d went out, and
+// the rest of it moved along. x less the old length says none of it stayed.
+void line_changed(Editor *ed, int y, int x, int d) {
+    int j;
+    Piece *p = piece_find(ed->root, y, &j);
+    ed->edits++;
+    if (p && p->first < 0) brk_edit(p->gb.brk, x, d);
+    if (ed->rows_width && ed->root) piece_refresh(ed, ed->root, y, 0);
+    syn_changed(ed, y);
+}
+static void pieces_set_rows(Editor *ed, Piece *t) {
+    if (!t) return;
+    pieces_set_rows(ed, t->left);
+    pieces_set_rows(ed, t->right);
+    piece_set_rows(ed, t);
+    piece_update(t);
+}
+// Row counts are kept for one width; a resize recounts them on first use.
+void ensure_rows(Editor *ed, int width) {
+    if (ed->rows_width == width) return;
+    ed->rows_width = width;
+    ed->rowck_n = 0;
+    extend_rowck(ed);
+    pieces_set_rows(ed, ed->root);
+}
+// Screen rows taken by lines [0, y).
+long rows_before(Editor *ed, int y) {
+    long r = 0;
+    Piece *t = ed->root;
+    while (t) {
+        int lt = piece_total(t->left);
+        if (y < lt) {
+            t = t->left;
+        } else if (y < lt + t->count) {
+            r += piece_rows(t->left);
+            if (t->first >= 0) r += orig_rows(ed, t->first + y - lt) - orig_rows(ed, t->first);
+            return r;
+        } else {
+            r += piece_rows(t->left) + t->rows;
+            y -= lt + t->count;
+            t = t->right;
+        }
+    }
+    return r;
+}
+// Line shown on screen row row (counted from the top of the text), and which
+// of its wrapped rows that is.
+int line_at_row(Editor *ed, long row, int *sub) {
+    int y = 0;
+    Piece *t = ed->root;
+    *sub = 0;
+    while (t) {
+        long rl = piece_rows(t->left);
+        if (row < rl) {
+            t = t->left;
+        } else if (row < rl + t->rows) {
+            row -= rl;
+            y += piece_total(t->left);
+            if (t->first < 0) {
+                *sub = (int)row;
+                return y;
+            }
+            // bisect the checkpoints, then walk at most ROW_CK lines
+            long base = orig_rows(ed, t->first);
+            int lo = t->first, hi = t->first + t->count;
+            int klo = lo / ROW_CK + 1, khi = (hi - 1) / ROW_CK;
+            while (klo <= khi) {
+                int mid = klo + (khi - klo) / 2;
+                if (ed->rowck[mid] - base <= row) {
+                    lo = mid * ROW_CK;
+                    klo = mid + 1;
+                } else {
+                    khi = mid - 1;
+                }
+            }
+            long r = orig_rows(ed, lo) - base;
+            for (;; ++lo) {
+                int h = orig_line_rows(ed, lo);
+                if (row < r + h || lo + 1 >= hi) break;
+                r += h;
+            }
+            *sub = (int)(row - r);
+            return y + lo - t->first;
+        } else {
+            row -= rl + t->rows;
+            y += piece_total(t->left) + t->count;
+            t = t->right;
+        }
+    }
+    return ed->num_lines - 1;
+}
+static void free_pieces(Piece *t) {
+    if (!t) return;
+    free_pieces(t->left);
+    free_pieces(t->right);
+    free_gapbuf(&t->gb);
+    free(t);
+}
+
+// --- Marks: positions that follow the text through edits ---
+
+static void mark_shift(Mark *t, int dy, int dx) {
+    if (!t) return;
+    t->y += dy;
+    t->x += dx;
+    t->dy += dy;
+    t->dx += dx;
+}
+static void mark_push(Mark *t) {
+    if (!t->dy && !t->dx) return;
+    mark_shift(t->left, t->dy, t->dx);
+    mark_shift(t->right, t->dy, t->dx);
+    t->dy = t->dx = 0;
+}
+static void mark_link(Mark *t) {
+    if (t->left) t->left->parent = t;
+    if (t->right) t->right->parent = t;
+}
+static Mark *mark_merge(Mark *a, Mark *b) {
+    if (!a || !b) return a ? a : b;
+    if (a->prio > b->prio) {
+        mark_push(a);
+        a->right = mark_merge(a->right, b);
+        mark_link(a);
+        return a;
+    }
+    mark_push(b);
+    b->left = mark_merge(a, b->left);
+    mark_link(b);
+    return b;
+}
+// Splits t into the positions before (y, x) and the rest.
+static void mark_split(Mark *t, int y, int x, Mark **l, Mark **r) {
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+    mark_push(t);
+    if (t->y < y || (t->y == y && t->x < x)) {
+        mark_split(t->right, y, x, &t->right, r);
+        *l = t;
+    } else {
+        mark_split(t->left, y, x, l, &t->left);
+        *r = t;
+    }
+    mark_link(t);
+}
+static void mark_root(Marks *m, Mark *t) {
+    m->root = t;
+    if (t) t->parent = NULL;
+}
+static void mark_get(const Mark *t, int *y, int *x) {
+    *y = t->y;
+    *x = t->x;
+    for (const Mark *p = t->parent; p; p = p->parent) {
+        *y += p->dy;
+        *x += p->dx;
+    }
+}
+static Mark *mark_add(Marks *m, int y, int x) {
+    Mark *t = calloc(1, sizeof(Mark)), *l, *r;
+    t->prio = piece_rand();
+    t->y = y;
+    t->x = x;
+    mark_split(m->root, y, x, &l, &r);
+    mark_root(m, mark_merge(mark_merge(l, t), r));
+    return t;
+}
+static void mark_push_path(Mark *t) {
+    if (t->parent) mark_push_path(t->parent);
+    mark_push(t);
+}
+static void mark_remove(Marks *m, Mark *t) {
+    Mark *p = t->parent, *c;
+    mark_push_path(t);
+    c = mark_merge(t->left, t->right);
+    if (!p) mark_root(m, c);
+    else {
+        if (p->left == t) p->left = c;
+        else p->right = c;
+        if (c) c->parent = p;
+    }
+    free(t);
+}
+static void mark_collapse(Mark *t, int y, int x) {
+    if (!t) return;
+    t->y = y;
+    t->x = x;
+    t->dy = t->dx = 0;
+    mark_collapse(t->left, y, x);
+    mark_collapse(t->right, y, x);
+}
+// Text inserted at line y, column x now ends at line ey, column ex. The
+// rest of line y moves to ey, and the lines after it down.
+static void marks_insert(Editor *ed, int y, int x, int ey, int ex) {
+    Mark *l, *m, *r;
+    if (!ed->marks.root) return;
+    mark_split(ed->marks.root, y, x, &l, &r);
+    mark_split(r, y + 1, 0, &m, &r);
+    mark_shift(m, ey - y, ex - x);
+    mark_shift(r, ey - y, 0);
+    mark_root(&ed->marks, mark_merge(l, mark_merge(m, r)));
+}
+// The text from line y, column x up to line y1, column x1 was deleted.
+// Positions inside it go to its start; only these are visited one by one.
+static void marks_delete(Editor *ed, int y, int x, int y1, int x1) {
+    Mark *l, *d, *m, *r;
+    if (!ed->marks.root) return;
+    mark_split(ed->marks.root, y, x, &l, &r);
+    mark_split(r, y1, x1, &d, &r);
+    mark_split(r, y1 + 1, 0, &m, &r);
+    mark_collapse(d, y, x);
+    mark_shift(m, y - y1, x - x1);
+    mark_shift(r, y - y1, 0);
+    mark_root(&ed->marks, mark_merge(mark_merge(l, d), mark_merge(m, r)));
+}
+// Notes the cursor as the place a jump leaves from. An older entry on the
+// same line is dropped, and the list walk starts again from its end.
+static void jump_push(Editor *ed) {
+    Marks *m = &ed->marks;
+    int y, x, k = 0;
+    for (int i = 0; i < m->njumps; ++i) {
+        mark_get(m->jumps[i], &y, &x);
+        if (y == ed->cy) mark_remove(m, m->jumps[i]);
+        else m->jumps[k++] = m->jumps[i];
+    }
+    m->njumps = k;
+    if (!m->jumps) m->jumps = malloc(JUMPS * sizeof(Mark *));
+    if (m->njumps == JUMPS) {
+        mark_remove(m, m->jumps[0]);
+        memmove(m->jumps, m->jumps + 1, --m->njumps * sizeof(Mark *));
+    }
+    m->jumps[m->njumps++] = mark_add(m, ed->cy, ed->cx);
+    m->jump_at = m->njumps;
+}
+static void free_marks(Mark *t) {
+    if (!t) return;
+    free_marks(t->left);
+    free_marks(t->right);
+    free(t);
+}
+
+// --- Undo: recording ---
+
+#define UNDO_LIMIT (64L << 20)  // history beyond this is dropped, oldest first
+#define UNDO_BATCH (64L << 10)  // a deletion is recorded this much at a time
+
+// Where text s[0, n) ends when it starts at line y, column x.
+static void text_end(int y, int x, const char *s, long n, int *ey, int *ex) {
+    const char *p = s, *nl;
+    while ((nl = memchr(p, '\n', s + n - p))) {
+        ++y;
+        x = 0;
+        p = nl + 1;
+    }
+    *ey = y;
+    *ex = x + (int)(s + n - p);
+}
+static void undo_append(Undo *u, const char *s, long n) {
+    if (u->text_len + n > u->text_cap) {
+        u->text_cap = (u->text_len + n) * 2;
+        u->text = realloc(u->text, u->text_cap);
+    }
+    memcpy(u->text + u->text_len, s, n);
+    u->text_len += n;
+}
+// Adds text to op, which is always the last op in the arena.
+static void undo_text(Undo *u, UndoOp *op, const char *s, long n) {
+    if (op - u->ops < u->saved_ops) u->saved_ops = (int)(op - u->ops);
+    undo_append(u, s, n);
+    op->len += n;
+    if (op->kind == UNDO_INS) text_end(op->ey, op->ex, s, n, &op->ey, &op->ex);
+}
+static long undo_size(Undo *u) {
+    return u->nops * (long)sizeof(UndoOp) + u->text_len + u->nnodes * (long)sizeof(UndoNode);
+}
+// Points node at child; a node already saved is noted for the next save.
+static void undo_set_child(Undo *u, int node, int child) {
+    u->nodes[node].child = child;
+    if (node >= u->saved_nodes) return;
+    for (int i = 0; i < u->nfix; ++i)
+        if (u->fix[i] == node) return;
+    if (u->nfix == u->fix_cap) {
+        u->fix_cap = u->fix_cap ? u->fix_cap * 2 : 16;
+        u->fix = realloc(u->fix, u->fix_cap * sizeof(int));
+    }
+    u->fix[u->nfix++] = node;
+}
+static int undo_node(Undo *u, int parent) {
+    if (u->nnodes == u->nodes_cap) {
+        u->nodes_cap = u->nodes_cap ? u->nodes_cap * 2 : 64;
+        u->nodes = realloc(u->nodes, u->nodes_cap * sizeof(UndoNode));
+    }
+    UndoNode *nd = &u->nodes[u->nnodes];
+    nd->parent = parent;
+    nd->child = -1;
+    nd->op = u->nops;
+    nd->nops = 0;
+    if (parent >= 0) undo_set_child(u, parent, u->nnodes);
+    return u->nnodes++;
+}
+// Keeps the open group and as many of its ancestors as fit in half the
+// limit; older history and other branches go. Ops on the loaded text stay
+// references to it.
+static void undo_trim(Undo *u) {
+    int n = 0, *chain = malloc(u->nnodes * sizeof(int));
+    long size = 0;
+    for (int i = u->cur; i > 0 && (i == u->cur || size < UNDO_LIMIT / 2); i = u->nodes[i].parent) {
+        UndoNode *nd = &u->nodes[i];
+        chain[n++] = i;
+        size += sizeof(UndoNode) + nd->nops * (long)sizeof(UndoOp);
+        for (int k = 0; k < nd->nops; ++k)
+            if (!u->ops[nd->op + k].orig) size += u->ops[nd->op + k].len;
+    }
+    if (n + 1 == u->nnodes) {
+        // the groups kept are all there is: nothing to copy them for
+        free(chain);
+        return;
+    }
+    Undo t = {0};
+    undo_node(&t, -1);
+    for (int j = n - 1; j >= 0; --j) {
+        UndoNode *nd = &u->nodes[chain[j]];
+        int id = undo_node(&t, t.nnodes - 1);
+        for (int k = 0; k < nd->nops; ++k) {
+            UndoOp *op = &u->ops[nd->op + k];
+            if (t.nops == t.ops_cap) {
+                t.ops_cap = t.ops_cap ? t.ops_cap * 2 : 64;
+                t.ops = realloc(t.ops, t.ops_cap * sizeof(UndoOp));
+            }
+            t.ops[t.nops] = *op;
+            if (op->orig) {
+                t.nops++;
+                continue;
+            }
+            t.ops[t.nops++].at = t.text_len;
+            undo_append(&t, u->text + op->at, op->len);
+        }
+        t.nodes[id].nops = nd->nops;
+    }
+    free(chain);
+    t.cur = t.nnodes - 1;
+    t.open = u->open;
+    free(u->ops);
+    free(u->text);
+    free(u->nodes);
+    free(u->fix);
+    *u = t;     // nothing saved: the next save rewrites the history file
+}
+static void journal_add(Editor *ed, int kind, int y, int x, const char *s, long n);
+void finish_index(Editor *ed);
+
+// Starts a new op in the open group, with no text yet.
+static UndoOp *undo_op(Undo *u, int kind, int y, int x) {
+    if (!u->open) {
+        u->cur = undo_node(u, u->cur);
+        u->open = 1;
+    }
+    if (u->nops == u->ops_cap) {
+        u->ops_cap = u->ops_cap ? u->ops_cap * 2 : 64;
+        u->ops = realloc(u->ops, u->ops_cap * sizeof(UndoOp));
+    }
+    UndoOp *op = &u->ops[u->nops++];
+    op->kind = kind;
+    op->y = op->ey = y;
+    op->x = op->ex = x;
+    op->at = u->text_len;
+    op->len = 0;
+    op->backward = op->orig = 0;
+    u->nodes[u->cur].nops++;
+    if (u->cur < u->saved_nodes) u->saved_nodes = u->cur;
+    return op;
+}
+// Records an edit about to be made. Typing extends the last insertion and
+// backspacing extends the last deletion, so a session stays a handful of ops.
+void undo_record(Editor *ed, int kind, int y, int x, const char *s, long n) {
+    Undo *u = &ed->undo;
+    if (!u->applying) journal_add(ed, kind, y, x, s, n);
+    if (u->applying || n <= 0) return;
+    if (!u->nnodes) undo_node(u, -1);
+    UndoOp *op = u->open && u->nodes[u->cur].nops ? &u->ops[u->nops - 1] : NULL;
+    if (op && op->orig) op = NULL;
+    if (op && kind == UNDO_INS && op->kind == UNDO_INS && y == op->ey && x == op->ex) {
+        undo_text(u, op, s, n);
+    } else if (op && kind == UNDO_DEL && op->kind == UNDO_DEL && n == 1 && (op->backward || op->len == 1) &&
+               (s[0] == '\n' ? y + 1 == op->y && op->x == 0 : y == op->y && x + 1 == op->x)) {
+        op->backward = 1;
+        op->y = y;
+        op->x = x;
+        undo_text(u, op, s, 1);
+    } else if (op && kind == UNDO_DEL && op->kind == UNDO_DEL && !op->backward && y == op->y && x == op->x) {
+        undo_text(u, op, s, n);
+    } else {
+        undo_text(u, undo_op(u, kind, y, x), s, n);
+    }
+    if (undo_size(u) > UNDO_LIMIT && u->nodes[u->cur].parent > 0) undo_trim(u);
+}
+// Records the deletion at line y, column x of whole loaded lines, the n
+// bytes at off in the loaded text, by where they are: that never changes.
+static void undo_record_orig(Editor *ed, int y, int x, long off, long n) {
+    Undo *u = &ed->undo;
+    journal_add(ed, UNDO_DEL, y, x, ed->orig.data + off, n);
+    if (!u->nnodes) undo_node(u, -1);
+    UndoOp *op = undo_op(u, UNDO_DEL, y, x);
+    op->at = off;
+    op->len = n;
+    op->orig = 1;
+}
+// Text of op, wherever it is kept.
+static const char *undo_op_text(Editor *ed, UndoOp *op) {
+    return op->orig ? ed->orig.data + op->at : ed->undo.text + op->at;
+}
+// Ends the current group: the next edit starts a new one.
+void undo_break(Editor *ed) {
+    ed->undo.open = 0;
+}
+
+void get_line(Editor *ed, int y, LineView *lv) {
+    int j = 0;
+    Piece *p = piece_find(ed->root, y, &j);
+    lv->n[0] = lv->n[1] = lv->wide = 0;
+    lv->p[0] = lv->p[1] = "";
+    lv->brk = NULL;
+    if (!p) return;
+    if (p->first < 0) {
+        gapbuf_view(&p->gb, lv);
+    } else {
+        long s = orig_off(&ed->orig, p->first + j);
+        lv->p[0] = ed->orig.data + s;
+        lv->n[0] = (int)(orig_off(&ed->orig, p->first + j + 1) - s - 1);
+        lv->wide = __atomic_load_n(orig_wide(&ed->orig, p->first + j), __ATOMIC_RELAXED);
+        lv->brk = orig_brk(ed);
+    }
+}
+void outbuf_append(OutBuf *b, const char *data, long len) {
+    long end = b->length + len;
+    if (end >= b->alloced) {
+        b->alloced = end + 4096;
+        b->data = realloc(b->data, b->alloced);
+    }
+    memcpy(b->data + b->length, data, len);
+    b->length = end;
+}
+static void view_append(OutBuf *b, const LineView *lv, int start, int len) {
+    for (int s = 0; s < 2 && len > 0; ++s) {
+        if (start >= lv->n[s]) {
+            start -= lv->n[s];
+            continue;
+        }
+        int k = lv->n[s] - start < len ? lv->n[s] - start : len;
+        outbuf_append(b, lv->p[s] + start, k);
+        len -= k;
+        start = 0;
+    }
+}
+int line_length(Editor *ed, int y) {
+    LineView lv;
+    get_line(ed, y, &lv);
+    return lv.n[0] + lv.n[1];
+}
+// Returns the editable buffer of line y, copying it out of the loaded text on
+// first use. Only one line keeps a gap at a time; the previous one is compacted.
+GapBuf *edit_line(Editor *ed, int y) {
+    int j = 0;
+    Piece *p = piece_find(ed->root, y, &j);
+    if (!p) return NULL;
+    if (p->first >= 0) {
+        Piece *a, *c;
+        piece_split(ed, ed->root, y, &a, &p);
+        piece_split(ed, p, 1, &p, &c);
+        long s = orig_off(&ed->orig, p->first);
+        int len = (int)(orig_off(&ed->orig, p->first + 1) - s - 1);
+        gapbuf_init(&p->gb, len + GAP_SIZE);
+        gapbuf_insert_bytes(&p->gb, 0, ed->orig.data + s, len);
+        if (ed->orig_brk.n && ed->orig_brk.key == ed->orig.data + s) {
+            // the layout of the loaded line goes with its text
+            p->gb.brk = malloc(sizeof(Breaks));
+            *p->gb.brk = ed->orig_brk;
+            p->gb.brk->key = NULL;
+            memset(&ed->orig_brk, 0, sizeof(ed->orig_brk));
+        }
+        p->first = -1;
+        piece_set_rows(ed, p);
+        piece_update(p);
+        ed->root = piece_merge(a, piece_merge(p, c));
+    }
+    if (ed->open != p) {
+        if (ed->open) gapbuf_compact(&ed->open->gb);
+        ed->open = p;
+    }
+    return &p->gb;
+}
+
+Piece *insert_line(Editor *ed, int at) {
+    Piece *a, *b, *p = make_piece(ed, -1, 1);
+    piece_split(ed, ed->root, at, &a, &b);
+    ed->root = piece_merge(piece_merge(a, p), b);
+    ed->num_lines++;
+    syn_shift(ed, at, 1);
+    if (at <= ed->load_at) ed->load_at++;
+    if (at <= ed->top) ed->top++;
+    return p;
+}
+void split_line(Editor *ed, int y, int x) {
+    GapBuf *gb = edit_line(ed, y);
+    int len = gapbuf_length(gb);
+    if (x < 0) x = 0;
+    if (x > len) x = len;
+    undo_record(ed, UNDO_INS, y, x, "\n", 1);
+    move_gap(gb, x);
+    Piece *next = insert_line(ed, y+1);
+    gapbuf_insert_bytes(&next->gb, 0, gb->buf + gb->gap_end, len - x);
+    gb->gap_end = gb->buf_size;
+    gapbuf_compact(gb);
+    ed->open = next;
+    line_changed(ed, y, x, x - len);
+    line_changed(ed, y+1, 0, len - x);
+    marks_insert(ed, y, x, y+1, 0);
+}
+void delete_line(Editor *ed, int at) {
+    if (ed->num_lines <= 1) return;
+    Piece *a, *m, *c;
+    piece_split(ed, ed->root, at, &a, &m);
+    piece_split(ed, m, 1, &m, &c);
+    if (ed->open == m) ed->open = NULL;
+    free_pieces(m);
+    ed->root = piece_merge(a, c);
+    --ed->num_lines;
+    syn_shift(ed, at, -1);
+    if (at < ed->load_at) ed->load_at--;
+    if (at < ed->top) ed->top--;
+    else if (at == ed->top) ed->top_sub = 0;
+    if (ed->top >= ed->num_lines) ed->top = ed->num_lines - 1;
+}
+void join_line(Editor *ed, int y) {
+    GapBuf *gb = edit_line(ed, y);
+    LineView lv;
+    int len = gapbuf_length(gb);
+    undo_record(ed, UNDO_DEL, y, len, "\n", 1);
+    get_line(ed, y+1, &lv);
+    for (int s = 0; s < 2; ++s)
+        gapbuf_insert_bytes(gb, gapbuf_length(gb), lv.p[s], lv.n[s]);
+    delete_line(ed, y+1);
+    line_changed(ed, y, len, lv.n[0] + lv.n[1]);
+    marks_delete(ed, y, len, y+1, 0);
+}
+void insert_char(Editor *ed, int y, int x, char c) {
+    undo_record(ed, UNDO_INS, y, x, &c, 1);
+    gapbuf_insert(edit_line(ed, y), x, c);
+    line_changed(ed, y, x, 1);
+    marks_insert(ed, y, x, y, x + 1);
+}
+// Deletes the character before x.
+void delete_char(Editor *ed, int y, int x) {
+    GapBuf *gb = edit_line(ed, y);
+    if (x <= 0 || x > gapbuf_length(gb)) return;
+    char c = gapbuf_get(gb, x - 1);
+    undo_record(ed, UNDO_DEL, y, x - 1, &c, 1);
+    gapbuf_delete(gb, x);
+    line_changed(ed, y, x - 1, -1);
+    marks_delete(ed, y, x - 1, y, x);
+}
+// A piece holding one edited line, sized to its text.
+static Piece *make_line(Editor *ed, const char *s, int n, const char *s2, int n2) {
+    Piece *p = make_piece(ed, -1, 1);
+    if (n + n2) {
+        gapbuf_init(&p->gb, n + n2);
+        gapbuf_insert_bytes(&p->gb, 0, s, n);
+        gapbuf_insert_bytes(&p->gb, n, s2, n2);
+        piece_set_rows(ed, p);
+        piece_update(p);
+    }
+    return p;
+}
+static void piece_fix(Piece *t) {
+    if (!t) return;
+    piece_fix(t->left);
+    piece_fix(t->right);
+    piece_update(t);
+}
+// Builds a treap over pieces v[0, n) in order, in O(n).
+static Piece *piece_build(Piece **v, int n) {
+    Piece **stack = malloc(n * sizeof(Piece *)), *root;
+    int sp = 0;
+    for (int i = 0; i < n; ++i) {
+        Piece *last = NULL;
+        while (sp && stack[sp - 1]->prio < v[i]->prio) last = stack[--sp];
+        v[i]->left = last;
+        if (sp) stack[sp - 1]->right = v[i];
+        stack[sp++] = v[i];
+    }
+    root = sp ? stack[0] : NULL;
+    free(stack);
+    piece_fix(root);
+    return root;
+}
+// Inserts s[0, n), which may span lines, at column x of line y. The new
+// lines are built into a treap of their own and merged in with one split,
+// so a paste costs O(n + log lines).
+void insert_text(Editor *ed, int y, int x, const char *s, long n) {
+    const char *nl = memchr(s, '\n', n);
+    int ey, ex;
+    undo_record(ed, UNDO_INS, y, x, s, n);
+    if (ed->marks.root) {
+        text_end(y, x, s, n, &ey, &ex);
+        marks_insert(ed, y, x, ey, ex);
+    }
+    GapBuf *gb = edit_line(ed, y);
+    if (!nl) {
+        gapbuf_insert_bytes(gb, x, s, (int)n);
+        line_changed(ed, y, x, (int)n);
+        return;
+    }
+    // line y keeps its head and gains the first line of s; its tail moves
+    // to the end of the last
+    int len = gapbuf_length(gb), k = 0;
+    move_gap(gb, x);
+    char *tail = malloc(len - x + 1);
+    memcpy(tail, gb->buf + gb->gap_end, len - x);
+    gb->gap_end = gb->buf_size;
+    gapbuf_insert_bytes(gb, x, s, (int)(nl - s));
+    line_changed(ed, y, x, x - len);
+    for (const char *p = nl; p; p = memchr(p + 1, '\n', s + n - p - 1)) ++k;
+    Piece **v = malloc(k * sizeof(Piece *)), *a, *b;
+    for (int i = 0; i < k; ++i) {
+        const char *p = nl + 1;
+        nl = i + 1 < k ? memchr(p, '\n', s + n - p) : s + n;
+        v[i] = i + 1 < k ? make_line(ed, p, (int)(nl - p), NULL, 0) : make_line(ed, p, (int)(nl - p), tail, len - x);
+    }
+    piece_split(ed, ed->root, y + 1, &a, &b);
+    ed->root = piece_merge(piece_merge(a, piece_build(v, k)), b);
+    ed->num_lines += k;
+    syn_shift(ed, y + 1, k);
+    if (y + 1 <= ed->load_at) ed->load_at += k;
+    if (y + 1 <= ed->top) ed->top += k;
+    free(v);
+    free(tail);
+}
+// Records the deletion of the text from line y, column x up to line y1,
+// column x1, as deletions at (y, x) that follow on from each other. Whole
+// lines of a loaded run are recorded by reference, the rest is gathered a
+// batch at a time, so the text is not copied out in one piece first.
+static void undo_range(Editor *ed, int y, int x, int y1, int x1) {
+    OutBuf b = {0};
+    LineView lv;
+    for (int i = y; i <= y1; ) {
+        int j = 0;
+        Piece *p = piece_find(ed->root, i, &j);
+        int k = p->first >= 0 && i > y ? p->count - j : 0;
+        if (k > y1 - i) k = y1 - i;
+        if (k > 0) {
+            long from = orig_off(&ed->orig, p->first + j);
+            undo_record(ed, UNDO_DEL, y, x, b.data, b.length);
+            b.length = 0;
+            undo_record_orig(ed, y, x, from, orig_off(&ed->orig, p->first + j + k) - from);
+            i += k;
+            continue;
+        }
+        get_line(ed, i, &lv);
+        int start = i == y ? x : 0, end = i == y1 ? x1 : lv.n[0] + lv.n[1];
+        view_append(&b, &lv, start, end - start);
+        if (i < y1) outbuf_append(&b, "\n", 1);
+        if (b.length >= UNDO_BATCH) {
+            undo_record(ed, UNDO_DEL, y, x, b.data, b.length);
+            b.length = 0;
+        }
+        ++i;
+    }
+    undo_record(ed, UNDO_DEL, y, x, b.data, b.length);
+    free(b.data);
+}
+// Deletes from line y, column x up to line y1, column x1.
+void delete_text(Editor *ed, int y, int x, int y1, int x1) {
+    GapBuf *gb = edit_line(ed, y);
+    LineView lv;
+    if (!ed->undo.applying) undo_range(ed, y, x, y1, x1);
+    marks_delete(ed, y, x, y1, x1);
+    if (y1 == y) {
+        move_gap(gb, x);
+        gb->gap_end += x1 - x;
+        line_changed(ed, y, x, x - x1);
+        return;
+    }
+    int len = gapbuf_length(gb);
+    move_gap(gb, x);
+    gb->gap_end = gb->buf_size;
+    get_line(ed, y1, &lv);
+    if (x1 < lv.n[0]) gapbuf_insert_bytes(gb, x, lv.p[0] + x1, lv.n[0] - x1);
+    int skip = x1 > lv.n[0] ? x1 - lv.n[0] : 0;
+    gapbuf_insert_bytes(gb, gapbuf_length(gb), lv.p[1] + skip, lv.n[1] - skip);
+    line_changed(ed, y, x, x - len);
+    Piece *a, *m, *c;
+    int k = y1 - y;
+    piece_split(ed, ed->root, y + 1, &a, &m);
+    piece_split(ed, m, k, &m, &c);
+    free_pieces(m);
+    ed->root = piece_merge(a, c);
+    ed->num_lines -= k;
+    syn_shift(ed, y + 1, -k);
+    if (y + 1 < ed->load_at) ed->load_at -= ed->load_at - (y + 1) < k ? ed->load_at - (y + 1) : k;
+    if (ed->top > y1) ed->top -= k;
+    else if (ed->top > y) {
+        ed->top = y;
+        ed->top_sub = 0;
+    }
+}
+// Replaces the text of line y.
+void replace_line(Editor *ed, int y, const char *s, int n) {
+    GapBuf *gb = edit_line(ed, y);
+    int len = gapbuf_length(gb);
+    if (!ed->undo.applying) {
+        move_gap(gb, gapbuf_length(gb));
+        undo_record(ed, UNDO_DEL, y, 0, gb->buf, gb->gap_start);
+        undo_record(ed, UNDO_INS, y, 0, s, n);
+    }
+    gb->gap_start = 0;
+    gb->gap_end = gb->buf_size;
+    if (n) gapbuf_insert_bytes(gb, 0, s, n);
+    line_changed(ed, y, 0, -len);
+}
+void free_lines(Editor *ed) {
+    free_pieces(ed->root);
+    ed->edits++;
+    ed->root = ed->open = NULL;
+    ed->num_lines = ed->loaded = ed->load_at = 0;
+    free(ed->rowck);
+    ed->rowck = NULL;
+    ed->rowck_n = ed->rowck_cap = ed->rows_width = 0;
+    free(ed->orig_brk.b);
+    memset(&ed->orig_brk, 0, sizeof(ed->orig_brk));
+    free(ed->syn.st);
+    free(ed->syn.cls);
+    ed->syn = (Syntax){ .lang = ed->syn.lang };
+    free_marks(ed->marks.root);
+    free(ed->marks.jumps);
+    memset(&ed->marks, 0, sizeof(ed->marks));
+    orig_free(&ed->orig);
+    free(ed->undo.ops);
+    free(ed->undo.text);
+    free(ed->undo.nodes);
+    free(ed->undo.fix);
+    memset(&ed->undo, 0, sizeof(ed->undo));
+}
+
+// --- Undo: applying ---
+
+static void undo_clear(Undo *u) {
+    free(u->ops);
+    free(u->text);
+    free(u->nodes);
+    free(u->fix);
+    memset(u, 0, sizeof(*u));
+}
+// A history that turns out not to fit the text is dropped rather than
+// applied: it may have come from a file written for other content.
+static int undo_misfit(Editor *ed) {
+    undo_clear(&ed->undo);
+    snprintf(ed->message, sizeof(ed->message), "Undo history does not fit the text; dropped");
+    return 0;
+}
+static int undo_ready(Editor *ed) {
+    Undo *u = &ed->undo;
+    if (!u->need_lines) return 1;
+    finish_index(ed);
+    if (ed->loaded < u->need_lines) return undo_misfit(ed);
+    u->need_lines = 0;
+    return 1;
+}
+// Makes op (inverse: takes it back). Each op costs O(its text + log lines).
+// Returns 0, having changed nothing, if op does not fit the text.
+static int undo_apply(Editor *ed, UndoOp *op, int inverse) {
+    const char *s = undo_op_text(ed, op);
+    char *rev = NULL;
+    int ey, ex, ins = (op->kind == UNDO_INS) != inverse;
+    if (op->y >= ed->num_lines || op->x > line_length(ed, op->y)) return 0;
+    if (op->backward) {
+        rev = malloc(op->len);
+        for (long i = 0; i < op->len; ++i) rev[i] = s[op->len - 1 - i];
+        s = rev;
+    }
+    text_end(op->y, op->x, s, op->len, &ey, &ex);
+    if (!ins && (ey >= ed->num_lines || ex > line_length(ed, ey))) {
+        free(rev);
+        return 0;
+    }
+    journal_add(ed, ins ? UNDO_INS : UNDO_DEL, op->y, op->x, s, op->len);
+    if (ins) insert_text(ed, op->y, op->x, s, op->len);
+    else delete_text(ed, op->y, op->x, ey, ex);
+    free(rev);
+    return 1;
+}
+// Makes the ops of nd, last to first taking them back if inverse. If one
+// does not fit, those already made are taken back too and 0 is returned:
+// a group goes in whole or not at all.
+static int undo_group(Editor *ed, UndoNode *nd, int inverse) {
+    Undo *u = &ed->undo;
+    int step = inverse ? -1 : 1, start = inverse ? nd->nops - 1 : 0, end = inverse ? -1 : nd->nops, i;
+    u->applying = 1;
+    for (i = start; i != end; i += step)
+        if (!undo_apply(ed, &u->ops[nd->op + i], inverse)) break;
+    if (i != end)
+        for (int k = i - step; k != start - step; k -= step)
+            undo_apply(ed, &u->ops[nd->op + k], !inverse);
+    u->applying = 0;
+    return i == end;
+}
+void undo(Editor *ed) {
+    Undo *u = &ed->undo;
+    if (u->cur <= 0) {
+        snprintf(ed->message, sizeof(ed->message), "Already at oldest change");
+        return;
+    }
+    if (!undo_ready(ed)) return;
+    UndoNode *nd = &u->nodes[u->cur];
+    if (!undo_group(ed, nd, 1)) {
+        undo_misfit(ed);
+        return;
+    }
+    ed->cy = u->ops[nd->op].y;
+    ed->cx = u->ops[nd->op].x;
+    undo_set_child(u, nd->parent, u->cur);
+    u->cur = nd->parent;
+    u->open = 0;
+}
+void redo(Editor *ed) {
+    Undo *u = &ed->undo;
+    int next = u->nnodes ? u->nodes[u->cur].child : -1;
+    if (next < 0) {
+        snprintf(ed->message, sizeof(ed->message), "Already at newest change");
+        return;
+    }
+    if (!undo_ready(ed)) return;
+    UndoNode *nd = &u->nodes[next];
+    if (!undo_group(ed, nd, 0)) {
+        undo_misfit(ed);
+        return;
+    }
+    ed->cy = u->ops[nd->op].y;
+    ed->cx = u->ops[nd->op].x;
+    u->cur = next;
+    u->open = 0;
+}
+
+// --- Undo: history file ---
+
+// The last byte is the format version. Ops and nodes are stored as they are
+// in memory, so it goes up whenever UndoOp, UndoNode or UndoBlock change.
+#define UNDO_MAGIC "vi-undo\002"
+
+// A 64-bit content hash taken eight bytes at a time, fed in pieces of any
+// size as the file is written.
+static void hash_add(Hash *h, const char *p, long n) {
+    const unsigned long k = 0x9e3779b97f4a7c15UL;
+    unsigned long w;
+    h->len += n;
+    while (h->ntail && n > 0) {
+        h->tail[h->ntail++] = *p++;
+        --n;
+        if (h->ntail == 8) {
+            memcpy(&w, h->tail, 8);
+            h->h = (h->h ^ w) * k;
+            h->h ^= h->h >> 32;
+            h->ntail = 0;
+        }
+    }
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&w, p, 8);
+        h->h = (h->h ^ w) * k;
+        h->h ^= h->h >> 32;
+    }
+    memcpy(h->tail + h->ntail, p, n);
+    h->ntail += (int)n;
+}
+static unsigned long hash_end(Hash *h) {
+    unsigned long w = 0, x;
+    memcpy(&w, h->tail, h->ntail);
+    x = (h->h ^ w ^ (unsigned long)h->len) * 0xff51afd7ed558ccdUL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53UL;
+    return x ^ (x >> 33);
+}
+
+// The history of dir/name lives in dir/.name.un~
+static void undo_path(const char *filename, char *out, int size) {
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    snprintf(out, size, "%.*s.%s.un~", (int)(base - filename), filename, base);
+}
+static long block_size(const UndoBlock *b) {
+    if (b->first_op < 0 || b->nops < 0 || b->first_node < 0 || b->nnodes < 0 ||
+        b->text_at < 0 || b->text_len < 0 || b->nfix < 0)
+        return -1;
+    return sizeof(*b) + b->nops * (long)sizeof(UndoOp) + b->nnodes * (long)sizeof(UndoNode) +
+           b->nfix * 2L * sizeof(int) + b->text_len;
+}
+// Copies the part of [at, at + n) below limit from p to base.
+static void copy_part(void *base, long limit, long size, const char *p, long at, long n) {
+    if (at < limit) memcpy((char *)base + at * size, p, (at + n < limit ? n : limit - at) * size);
+}
+static long newlines(const char *p, long n) {
+    long k = 0;
+    for (const char *e = p + n; (p = memchr(p, '\n', e - p)); ++p) ++k;
+    return k;
+}
+// Checks a history read from a file throughout before undo trusts it:
+// kinds, arena bounds and tree links, then every op's line against the
+// line counts it meets. Those are followed through the tree from cur, whose
+// text is the loaded file; *lines is how many lines that must have. Columns
+// are checked as each op is made.
+static int undo_valid(Undo *u, int *lines) {
+    if (u->cur < 0 || u->cur >= u->nnodes || u->nodes[0].parent != -1 || u->nodes[0].nops) return 0;
+    for (int i = 0; i < u->nops; ++i) {
+        UndoOp *op = &u->ops[i];
+        if ((op->kind != UNDO_INS && op->kind != UNDO_DEL) || (op->backward && op->kind != UNDO_DEL) ||
+            op->backward < 0 || op->backward > 1 || op->orig || op->y < 0 || op->x < 0 ||
+            op->at < 0 || op->len < 0 || op->at > u->text_len || op->len > u->text_len - op->at)
+            return 0;
+    }
+    for (int i = 1; i < u->nnodes; ++i) {
+        UndoNode *nd = &u->nodes[i];
+        if (nd->parent < 0 || nd->parent >= i || nd->child < -1 || nd->child >= u->nnodes ||
+            (nd->child >= 0 && u->nodes[nd->child].parent != i) ||
+            nd->op < 0 || nd->nops < 1 || nd->op > u->nops || nd->nops > u->nops - nd->op)
+            return 0;
+    }
+    if (u->nodes[0].child < -1 || u->nodes[0].child >= u->nnodes ||
+        (u->nodes[0].child >= 0 && u->nodes[u->nodes[0].child].parent != 0))
+        return 0;
+    // rel[i]: lines at node i less those at cur
+    long *rel = malloc(u->nnodes * sizeof(long)), need = 1, root = 0;
+    for (int i = 1; i < u->nnodes; ++i) {
+        UndoNode *nd = &u->nodes[i];
+        rel[i] = 0;
+        for (int k = nd->op; k < nd->op + nd->nops; ++k) {
+            UndoOp *op = &u->ops[k];
+            long nl = newlines(u->text + op->at, op->len);
+            rel[i] += op->kind == UNDO_INS ? nl : -nl;
+        }
+    }
+    for (int i = u->cur; i > 0; i = u->nodes[i].parent) root -= rel[i];
+    rel[0] = root;
+    for (int i = 1; i < u->nnodes; ++i) {
+        UndoNode *nd = &u->nodes[i];
+        long n = rel[nd->parent];
+        for (int k = nd->op; k < nd->op + nd->nops; ++k) {
+            UndoOp *op = &u->ops[k];
+            long nl = newlines(u->text + op->at, op->len), last = op->y + (op->kind == UNDO_DEL ? nl : 0);
+            if (last + 1 - n > need) need = last + 1 - n;
+            n += op->kind == UNDO_INS ? nl : -nl;
+        }
+        rel[i] += rel[nd->parent];
+        if (1 - rel[i] > need) need = 1 - rel[i];
+    }
+    if (1 - rel[0] > need) need = 1 - rel[0];
+    free(rel);
+    if (need > INT_MAX) return 0;
+    *lines = (int)need;
+    return 1;
+}
+// Picks up the history saved with the file, if it was saved with exactly
+// this content. A different size rules it out at once; a different mtime
+// costs a hash of the text. The file is mapped only to be read: its blocks
+// are copied into the arenas, later ones over earlier, and checked there.
+void undo_load(Editor *ed) {
+    char path[FILENAME_MAXLEN + 8];
+    struct stat st, fs;
+    undo_path(ed->filename, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    if (fstat(fd, &st) < 0 || st.st_size < 8 || stat(ed->filename, &fs) < 0) {
+        close(fd);
+        return;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+    UndoBlock b, last = { 0 };
+    Hash hash = { 0 };
+    long pos = 8, end = -1, n, ops = 0, nodes = 0, text = 0;
+    // a block cut short by a crash ends the file; each block starts within
+    // what the ones before it hold, so that together they leave no gap
+    while (memcmp(map, UNDO_MAGIC, 8) == 0 && pos + (long)sizeof(b) <= st.st_size) {
+        memcpy(&b, map + pos, sizeof(b));
+        if ((n = block_size(&b)) < 0 || pos + n > st.st_size) break;
+        if (b.first_op > ops || b.first_node > nodes || b.text_at > text) {
+            end = -1;
+            break;
+        }
+        if (b.first_op + b.nops > ops) ops = b.first_op + b.nops;
+        if (b.first_node + b.nnodes > nodes) nodes = b.first_node + b.nnodes;
+        if (b.text_at + b.text_len > text) text = b.text_at + b.text_len;
+        last = b;
+        pos += n;
+        end = pos;
+    }
+    int same = end >= 0 && last.size == fs.st_size && last.size == ed->orig.len;
+    if (same && (last.mtime != fs.st_mtim.tv_sec || last.mtime_ns != fs.st_mtim.tv_nsec)) {
+        hash_add(&hash, ed->orig.data, ed->orig.len);
+        same = hash_end(&hash) == last.hash;
+    }
+    if (!same) {
+        munmap(map, st.st_size);
+        return;
+    }
+    // every block overwrites the entries it holds; the last one sets the sizes
+    Undo *u = &ed->undo;
+    u->nops = u->ops_cap = last.first_op + last.nops;
+    u->nnodes = u->nodes_cap = last.first_node + last.nnodes;
+    u->text_len = u->text_cap = last.text_at + last.text_len;
+    u->ops = malloc(u->ops_cap * sizeof(UndoOp) + 1);
+    u->nodes = malloc(u->nodes_cap * sizeof(UndoNode) + 1);
+    u->text = malloc(u->text_cap + 1);
+    for (pos = 8; pos < end; pos += block_size(&b)) {
+        const char *p = map + pos;
+        memcpy(&b, p, sizeof(b));
+        p += sizeof(b);
+        copy_part(u->ops, u->nops, sizeof(UndoOp), p, b.first_op, b.nops);
+        p += b.nops * sizeof(UndoOp);
+        copy_part(u->nodes, u->nnodes, sizeof(UndoNode), p, b.first_node, b.nnodes);
+        p += b.nnodes * sizeof(UndoNode);
+        for (int i = 0; i < b.nfix; ++i) {
+            int fix[2];
+            memcpy(fix, p + i * sizeof(fix), sizeof(fix));
+            if (fix[0] >= 0 && fix[0] < u->nnodes) u->nodes[fix[0]].child = fix[1];
+        }
+        p += b.nfix * 2L * sizeof(int);
+        copy_part(u->text, u->text_len, 1, p, b.text_at, b.text_len);
+    }
+    munmap(map, st.st_size);
+    u->cur = last.cur;
+    u->saved_ops = u->nops;
+    u->saved_nodes = u->nnodes;
+    u->saved_text = u->text_len;
+    // the line count is checked now if the file is indexed, else at the
+    // first undo or redo, so as not to wait for the index here
+    if (!u->nnodes || !undo_valid(u, &u->need_lines)) undo_misfit(ed);
+    else if (!indexing(ed)) undo_ready(ed);
+}
+// Appends what changed since the last save to the history file; hash is
+// that of the file content just written. After a trim, or if the file is
+// gone, the whole history is written afresh.
+void undo_save(Editor *ed, unsigned long hash) {
+    Undo *u = &ed->undo;
+    char path[FILENAME_MAXLEN + 8];
+    struct stat st, fs;
+    if (!u->nnodes || stat(ed->filename, &fs) < 0) return;
+    undo_path(ed->filename, path, sizeof(path));
+    int fresh = !u->saved_ops && !u->saved_nodes && !u->saved_text;
+    int fd = open(path, O_WRONLY | O_CREAT | (fresh ? O_TRUNC : O_APPEND), 0600);
+    if (fd < 0) return;
+    if (!fresh && (fstat(fd, &st) < 0 || st.st_size < 8)) {
+        fresh = 1;
+        if (ftruncate(fd, 0) < 0) fresh = 0;
+    }
+    if (fresh) {
+        u->saved_ops = u->saved_nodes = 0;
+        u->saved_text = 0;
+        u->nfix = 0;
+    }
+    // the file is read with another loaded text: ops on this one take
+    // their text into the arena first
+    for (int i = u->saved_ops; i < u->nops; ++i) {
+        UndoOp *op = &u->ops[i];
+        if (!op->orig) continue;
+        long at = u->text_len;
+        undo_append(u, ed->orig.data + op->at, op->len);
+        op->at = at;
+        op->orig = 0;
+    }
+    UndoBlock b = {
+        u->saved_ops, u->nops - u->saved_ops,
+        u->saved_nodes, u->nnodes - u->saved_nodes,
+        u->saved_text, u->text_len - u->saved_text,
+        u->nfix, u->cur,
+        fs.st_size, fs.st_mtim.tv_sec, fs.st_mtim.tv_nsec, hash
+    };
+    int *fix = malloc(u->nfix * 2 * sizeof(int) + 1);
+    for (int i = 0; i < u->nfix; ++i) {
+        fix[2 * i] = u->fix[i];
+        fix[2 * i + 1] = u->nodes[u->fix[i]].child;
+    }
+    struct iovec iov[6] = {
+        { UNDO_MAGIC, fresh ? 8 : 0 },
+        { &b, sizeof(b) },
+        { u->ops + b.first_op, b.nops * sizeof(UndoOp) },
+        { u->nodes + b.first_node, b.nnodes * sizeof(UndoNode) },
+        { fix, b.nfix * 2 * sizeof(int) },
+        { u->text + b.text_at, b.text_len },
+    };
+    if (writev_all(fd, iov, 6) == 0) {
+        u->saved_ops = u->nops;
+        u->saved_nodes = u->nnodes;
+        u->saved_text = u->text_len;
+        u->nfix = 0;
+    } else {
+        u->saved_ops = u->saved_nodes = 0;
+        u->saved_text = 0;
+    }
+    free(fix);
+    close(fd);
+}
+
+static void count_pieces(Piece *t, long *pieces, long *edited) {
+    if (!t) return;
+    ++*pieces;
+    if (t->first < 0) ++*edited;
+    count_pieces(t->left, pieces, edited);
+    count_pieces(t->right, pieces, edited);
+}
+// :mem - average storage cost per line, all structures included
+void report_memory(Editor *ed) {
+    long pieces = 0, edited = 0;
+    count_pieces(ed->root, &pieces, &edited);
+    long text = ed->orig.len;
+    for (int i = 0; i < ed->orig.chunks; ++i)
+        if (ed->orig.off[i]) text += OFF_CHUNK * (long)sizeof(long);
+    text += ed->rowck_cap * (long)sizeof(long);
+    long nodes = pieces * (long)sizeof(Piece);
+    long total = text + nodes + slab.in_use;
+    snprintf(ed->message, sizeof(ed->message),
+             "%.1f bytes/line: %ld lines, text %ld, pieces %ld (%ld), edited %ld (%ld), undo %ld",
+             (double)total / ed->num_lines, (long)ed->num_lines, text,
+             nodes, pieces, slab.in_use, edited, undo_size(&ed->undo));
+}
+
+// Moves lines published by the indexer into the piece tree.
+int sync_index(Editor *ed) {
+    OrigText *o = &ed->orig;
+    int n = __atomic_load_n(&o->lines, __ATOMIC_ACQUIRE);
+    int old = ed->loaded, j = 0;
+    if (n <= old) return 0;
+    ed->loaded = n;
+    if (ed->rows_width) extend_rowck(ed);
+    Piece *p = ed->load_at > 0 ? piece_find(ed->root, ed->load_at - 1, &j) : NULL;
+    if (p && p->first >= 0 && p->first + p->count == old && j == p->count - 1) {
+        piece_refresh(ed, ed->root, ed->load_at - 1, n - old);
+    } else {
+        Piece *a, *b;
+        piece_split(ed, ed->root, ed->load_at, &a, &b);
+        ed->root = piece_merge(piece_merge(a, make_piece(ed, old, n - old)), b);
+    }
+    if (ed->load_at <= ed->top && ed->top < ed->num_lines) ed->top += n - old;
+    syn_shift(ed, ed->load_at, n - old);
+    marks_insert(ed, ed->load_at, 0, ed->load_at + n - old, 0);
+    ed->num_lines += n - old;
+    ed->load_at += n - old;
+    return 1;
+}
+void finish_index(Editor *ed) {
+    OrigText *o = &ed->orig;
+    if (o->threaded) {
+        pthread_join(o->indexer, NULL);
+        o->threaded = 0;
+    }
+    sync_index(ed);
+}
+
+// --- Swap journal ---
+
+#define JOURNAL_MAGIC "vi-swap\002"
+#define JOURNAL_SYNC_MS 200     // journaled edits reach the disk this soon
+#define JOURNAL_SYNC_KB 64      // or as soon as this much is waiting
+#define JOURNAL_NAMES 16        // .swp down to .swa, as vim names them
+
+// Journal k of dir/name is dir/.name.swp for k = 0, then .swo, .swn...
+static void journal_path(const char *filename, int k, char *out, int size) {
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    snprintf(out, size, "%.*s.%s.sw%c", (int)(base - filename), filename, base, 'p' - k);
+}
+static void journal_write(Editor *ed, const char *s, long n);
+static void journal_add(Editor *ed, int kind, int y, int x, const char *s, long n) {
+    Journal *j = &ed->journal;
+    if (!j->on || j->replaying || n <= 0) return;
+    JournalRec r = { kind, y, x, n };
+    outbuf_append(&j->buf, (const char *)&r, sizeof(r));
+    // a big text is written from where it is rather than copied
+    if (n < JOURNAL_SYNC_KB * 1024L) outbuf_append(&j->buf, s, n);
+    else journal_write(ed, s, n);
+    j->records++;
+}
+static void *journal_syncer(void *arg) {
+    Journal *j = arg;
+    pthread_mutex_lock(&j->lock);
+    while (!j->stop) {
+        double wait = j->due - now();
+        if (!j->dirty) {
+            pthread_cond_wait(&j->cond, &j->lock);
+        } else if (wait > 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            long ns = ts.tv_nsec + (long)(wait * 1e9);
+            ts.tv_sec += ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&j->cond, &j->lock, &ts);
+        } else {
+            j->dirty = 0;
+            j->pending = 0;
+            pthread_mutex_unlock(&j->lock);
+            fdatasync(j->fd);
+            pthread_mutex_lock(&j->lock);
+            j->syncs++;
+        }
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+// Writes the records waiting in buf, then s[0, n), and tells the syncer:
+// the first write after a sync starts the clock, a full batch ends it early.
+static void journal_write(Editor *ed, const char *s, long len) {
+    Journal *j = &ed->journal;
+    struct iovec iov[2] = { { j->buf.data, j->buf.length }, { (char *)s, len } };
+    long n = j->buf.length + len;
+    if (!j->on || !n) return;
+    j->buf.length = 0;
+    if (writev_all(j->fd, iov, 2) < 0) {
+        snprintf(ed->message, sizeof(ed->message), "Swap file write failed: %s", strerror(errno));
+        return;
+    }
+    j->bytes += n;
+    if (!j->threaded) {
+        fdatasync(j->fd);
+        j->syncs++;
+        return;
+    }
+    pthread_mutex_lock(&j->lock);
+    if (!j->dirty) {
+        j->dirty = 1;
+        j->due = now() + JOURNAL_SYNC_MS / 1000.0;
+    }
+    j->pending += n;
+    if (j->pending >= JOURNAL_SYNC_KB * 1024L) j->due = 0;
+    pthread_cond_signal(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+}
+// Writes the records of the last key.
+void journal_flush(Editor *ed) {
+    journal_write(ed, NULL, 0);
+}
+// Starts the journal over for the file as it is on disk now.
+static int journal_head(Editor *ed) {
+    Journal *j = &ed->journal;
+    JournalHead h = { JOURNAL_MAGIC, 0, 0, 0 };
+    struct stat st;
+    if (stat(ed->filename, &st) == 0) {
+        h.size = st.st_size;
+        h.mtime = st.st_mtim.tv_sec;
+        h.mtime_ns = st.st_mtim.tv_nsec;
+    }
+    j->buf.length = 0;
+    if (ftruncate(j->fd, 0) < 0 || write_all(j->fd, (const char *)&h, sizeof(h)) < 0) return -1;
+    fdatasync(j->fd);
+    return 0;
+}
+static int journal_matches(Editor *ed, const JournalHead *h) {
+    struct stat st;
+    if (memcmp(h->magic, JOURNAL_MAGIC, 8)) return 0;
+    if (stat(ed->filename, &st) < 0) return h->size == 0 && h->mtime == 0;
+    return h->size == st.st_size && h->mtime == st.st_mtim.tv_sec && h->mtime_ns == st.st_mtim.tv_nsec;
+}
+// Applies the records in p[0, n) and returns how many bytes of whole,
+// applicable records there were.
+static long journal_replay(Editor *ed, const char *p, long n, long *count) {
+    long pos = 0;
+    JournalRec r;
+    finish_index(ed);
+    while (pos + (long)sizeof(r) <= n) {
+        memcpy(&r, p + pos, sizeof(r));
+        const char *s = p + pos + sizeof(r);
+        int ey, ex;
+        if (r.len <= 0 || r.len > n - pos - (long)sizeof(r) || r.y < 0 || r.y >= ed->num_lines ||
+            r.x < 0 || r.x > line_length(ed, r.y))
+            break;
+        if (r.kind == UNDO_INS) {
+            insert_text(ed, r.y, r.x, s, r.len);
+        } else {
+            text_end(r.y, r.x, s, r.len, &ey, &ex);
+            if (ey >= ed->num_lines || ex > line_length(ed, ey)) break;
+            delete_text(ed, r.y, r.x, ey, ex);
+        }
+        pos += sizeof(r) + r.len;
+        ++*count;
+    }
+    return pos;
+}
+static void journal_start(Journal *j) {
+    j->on = 1;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+    j->threaded = pthread_create(&j->syncer, NULL, journal_syncer, j) == 0;
+}
+// Starts a journal under the first name that holds no edits, leaving those
+// of crashed sessions alone. Returns -1 if there is none to be had.
+static int journal_create(Editor *ed) {
+    Journal *j = &ed->journal;
+    struct stat st;
+    for (int k = 0; k < JOURNAL_NAMES; ++k) {
+        journal_path(ed->filename, k, j->path, sizeof(j->path));
+        if ((j->fd = open(j->path, O_RDWR | O_CREAT | O_APPEND, 0600)) < 0) return -1;
+        if (fstat(j->fd, &st) == 0 && st.st_size <= (long)sizeof(JournalHead)) {
+            if (journal_head(ed) < 0) break;
+            journal_start(j);
+            return k;
+        }
+        close(j->fd);
+        j->fd = -1;
+    }
+    if (j->fd >= 0) close(j->fd);
+    return -1;
+}
+// Opens the journal of the file being edited. An existing one with edits
+// in it is a crashed session: with recover, the first that fits the file
+// is replayed, as one undo group, and kept going. Others are left alone,
+// and the session journals under the next free name.
+void journal_open(Editor *ed, int recover) {
+    Journal *j = &ed->journal;
+    struct stat st;
+    JournalHead h;
+    int found = 0;
+    for (int k = 0; k < JOURNAL_NAMES; ++k) {
+        journal_path(ed->filename, k, j->path, sizeof(j->path));
+        if ((j->fd = open(j->path, O_RDWR | O_APPEND)) < 0) continue;
+        if (fstat(j->fd, &st) < 0 || st.st_size <= (long)sizeof(h)) {
+            close(j->fd);
+            continue;
+        }
+        found = 1;
+        char *map = recover ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, j->fd, 0) : MAP_FAILED;
+        if (map == MAP_FAILED || (memcpy(&h, map, sizeof(h)), !journal_matches(ed, &h))) {
+            if (map != MAP_FAILED) munmap(map, st.st_size);
+            close(j->fd);
+            continue;
+        }
+        long count = 0, used;
+        j->replaying = 1;
+        used = journal_replay(ed, map + sizeof(h), st.st_size - sizeof(h), &count);
+        j->replaying = 0;
+        undo_break(ed);
+        munmap(map, st.st_size);
+        // a record cut short by the crash goes
+        if (ftruncate(j->fd, sizeof(h) + used) < 0) {}
+        snprintf(ed->message, sizeof(ed->message), "Recovered %ld edits from the swap file", count);
+        journal_start(j);
+        return;
+    }
+    int k = journal_create(ed);
+    if (k < 0)
+        snprintf(ed->message, sizeof(ed->message), "No swap file could be made: edits are not journaled");
+    else if (found)
+        snprintf(ed->message, sizeof(ed->message), recover ? "No swap file matches %.60s; journaling to .sw%c"
+                 : "Found a swap file: vi -r %.60s recovers it; journaling to .sw%c", ed->filename, 'p' - k);
+}
+// The file on disk now holds every edit: start an empty journal for it.
+// This is also where a journal left alone at startup is given up.
+void journal_reset(Editor *ed) {
+    Journal *j = &ed->journal;
+    if (!j->on) {
+        if (ed->filename[0]) journal_create(ed);
+        return;
+    }
+    pthread_mutex_lock(&j->lock);
+    j->dirty = 0;
+    j->pending = 0;
+    if (journal_head(ed) < 0)
+        snprintf(ed->message, sizeof(ed->message), "Swap file write failed: %s", strerror(errno));
+    pthread_mutex_unlock(&j->lock);
+}
+static void journal_stop(Journal *j) {
+    if (!j->threaded) return;
+    pthread_mutex_lock(&j->lock);
+    j->stop = 1;
+    pthread_cond_signal(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+    pthread_join(j->syncer, NULL);
+    j->threaded = 0;
+}
+void journal_close(Editor *ed, int remove_file) {
+    Journal *j = &ed->journal;
+    if (!j->on) return;
+    journal_stop(j);
+    close(j->fd);
+    if (remove_file) unlink(j->path);
+    free(j->buf.data);
+    memset(j, 0, sizeof(*j));
+}
+
+void load_text(Editor *ed);
+static int syn_lang(const char *path);
+
+void load_file(Editor *ed, const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    ed->syn.lang = syn_lang(filename);
+    if (fd < 0) return;
+    OrigText *o = &ed->orig;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    o->len = st.st_size;
+    if (S_ISREG(st.st_mode) && o->len >= LAZY_MIN) {
+        o->data = mmap(NULL, o->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (o->data == MAP_FAILED) o->data = NULL;
+        else o->mapped = 1;
+    }
+    if (!o->mapped) {
+        long got = 0, r = 0;
+        o->data = malloc(o->len);
+        while (o->data && got < o->len && (r = read(fd, o->data + got, o->len - got)) > 0)
+            got += r;
+        if (got != o->len) {
+            free(o->data);
+            memset(o, 0, sizeof(*o));
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+    load_text(ed);
+}
+// Indexes ed->orig, in the background if it is mapped, and starts the
+// piece tree on it.
+void load_text(Editor *ed) {
+    OrigText *o = &ed->orig;
+    o->chunks = (int)((o->len + 1) / OFF_CHUNK + 2);
+    o->off = calloc(o->chunks, sizeof(long *));
+    if (o->mapped) {
+        madvise(o->data, o->len, MADV_SEQUENTIAL);
+        o->threaded = pthread_create(&o->indexer, NULL, orig_indexer, o) == 0;
+    }
+    if (!o->threaded) orig_index(o);
+    // the first screen only needs a few lines, not the whole index
+    while (!__atomic_load_n(&o->lines, __ATOMIC_ACQUIRE) && indexing(ed))
+        usleep(1000);
+    free_pieces(ed->root);
+    ed->edits++;
+    ed->root = ed->open = NULL;
+    ed->num_lines = ed->loaded = ed->load_at = 0;
+    sync_index(ed);
+}
+static void save_put(SaveOut *o, const char *p, long n) {
+    if (n <= 0) return;
+    hash_add(&o->hash, p, n);
+    o->iov[o->n].iov_base = (char *)p;
+    o->iov[o->n].iov_len = n;
+    o->bytes += n;
+    if (++o->n == SAVE_IOV) {
+        if (writev_all(o->fd, o->iov, o->n) < 0 && !o->err) o->err = errno;
+        o->n = 0;
+    }
+}
+// Queues the lines of t in order. A run of loaded lines is already laid
+// out with its newlines, so it goes as one segment however long it is.
+static void save_pieces(Editor *ed, SaveOut *o, Piece *t) {
+    if (!t) return;
+    save_pieces(ed, o, t->left);
+    if (t->first < 0) {
+        GapBuf *gb = &t->gb;
+        save_put(o, gb->buf, gb->gap_start);
+        save_put(o, gb->buf + gb->gap_end, gb->buf_size - gb->gap_end);
+    } else {
+        long from = orig_off(&ed->orig, t->first);
+        save_put(o, ed->orig.data + from, orig_off(&ed->orig, t->first + t->count) - 1 - from);
+    }
+    save_put(o, "\n", 1);
+    save_pieces(ed, o, t->right);
+}
+// A file with other hard links is written in place, so that they all see
+// the new text. The loaded text may be a mapping of it, so that is copied
+// to memory first: truncating a mapped file would pull the pages away.
+static int save_in_place(Editor *ed, int from, const char *path) {
+    OrigText *o = &ed->orig;
+    char buf[65536];
+    ssize_t n;
+    if (o->mapped) {
+        char *copy = malloc(o->len);
+        if (!copy) return ENOMEM;
+        memcpy(copy, o->data, o->len);
+        munmap(o->data, o->len);
+        o->data = copy;
+        o->mapped = 0;
+    }
+    int fd = open(path, O_WRONLY | O_TRUNC), err = 0;
+    if (fd < 0) return errno;
+    if (lseek(from, 0, SEEK_SET) < 0) err = errno;
+    while (!err && (n = read(from, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 || write_all(fd, buf, n) < 0) err = errno;
+    }
+    if (fsync(fd) < 0 && !err) err = errno;
+    if (close(fd) < 0 && !err) err = errno;
+    return err;
+}
+// Streams the text into a temporary file next to filename, straight from
+// the line buffers and the loaded text, then fsyncs and renames it over
+// filename, so a crash leaves either the old file or the new one. A
+// symlink is followed, and the new file gets the old one's mode and owner.
+void save_file(Editor *ed, const char *filename) {
+    char path[PATH_MAX], tmp[PATH_MAX + 16];
+    const char *slash;
+    struct stat st;
+    SaveOut o = { 0 };
+    double t = now();
+    int kept = 0;
+    finish_index(ed);
+    if (!realpath(filename, path)) snprintf(path, sizeof(path), "%s", filename);
+    int exists = stat(path, &st) == 0;
+    slash = strrchr(path, '/');
+    snprintf(tmp, sizeof(tmp), "%.*s.%s.XXXXXX", slash ? (int)(slash - path) + 1 : 0, path, slash ? slash + 1 : path);
+    o.fd = mkstemp(tmp);
+    if (o.fd < 0) {
+        snprintf(ed->message, sizeof(ed->message), "Cannot write %.64s: %s", tmp, strerror(errno));
+        return;
+    }
+    if (exists) {
+        if (fchown(o.fd, st.st_uid, st.st_gid) < 0 && errno != EPERM) o.err = errno;
+        if (fchmod(o.fd, st.st_mode & 07777) < 0 && !o.err) o.err = errno;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        if (fchmod(o.fd, 0666 & ~mask) < 0) o.err = errno;
+    }
+    save_pieces(ed, &o, ed->root);
+    if (o.n && writev_all(o.fd, o.iov, o.n) < 0 && !o.err) o.err = errno;
+    if (fsync(o.fd) < 0 && !o.err) o.err = errno;
+    if (!o.err && exists && st.st_nlink > 1) {
+        // the temporary file stays as a copy if this fails
+        if ((o.err = save_in_place(ed, o.fd, path)) == 0) unlink(tmp);
+        else kept = 1;
+        close(o.fd);
+    } else {
+        if (close(o.fd) < 0 && !o.err) o.err = errno;
+        if (!o.err && rename(tmp, path) < 0) o.err = errno;
+        if (o.err) unlink(tmp);
+    }
+    if (o.err) {
+        snprintf(ed->message, sizeof(ed->message), "Cannot write %.40s: %s%s%.40s", filename, strerror(o.err),
+                 kept ? ", the text is in " : "", kept ? tmp : "");
+        return;
+    }
+    // make the rename itself durable
+    slash = strrchr(path, '/');
+    snprintf(tmp, sizeof(tmp), "%.*s", slash ? (int)(slash - path) + 1 : 1, slash ? path : ".");
+    int dfd = open(tmp, O_RDONLY);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+    undo_save(ed, hash_end(&o.hash));
+    journal_reset(ed);
+    t = now() - t;
+    snprintf(ed->message, sizeof(ed->message), "%d lines, %ld bytes written in %.3f s (%.0f MB/s)",
+             ed->num_lines, o.bytes, t, t > 0 ? o.bytes / 1e6 / t : 0.0);
+}
+
+// --- Input: terminal bytes are read in bulk and decoded here ---
+
+enum { KEY_EOF = -1, KEY_NULL = 0, KEY_ARROW_LEFT = 1000, KEY_ARROW_RIGHT, KEY_ARROW_UP, KEY_ARROW_DOWN,
+       KEY_HOME, KEY_END, KEY_PAGE_UP, KEY_PAGE_DOWN, KEY_DELETE, KEY_MOUSE, KEY_PASTE };
+
+enum { IN_GROUND, IN_ESC, IN_CSI, IN_SS3, IN_PASTE };
+
+#define INPUT_BUF 65536
+#define ESC_TIMEOUT_MS 25       // an ESC followed by nothing for this long is the ESC key
+
+static struct {
+    unsigned char buf[INPUT_BUF];
+    int pos, len;
+    int state;
+    int param[4], nparam;
+    int lead;           // private marker of a CSI sequence, '<' for SGR mouse
+    OutBuf paste;       // text of the last bracketed paste
+    int mouse_button, mouse_x, mouse_y, mouse_press;
+    double read_at;     // when the last bytes came in
+} input;
+
+// Reads whatever the terminal has, waiting up to timeout ms (-1: for ever).
+static int input_fill(int timeout) {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    if (input.pos == input.len) input.pos = input.len = 0;
+    if (input.len == INPUT_BUF) {
+        memmove(input.buf, input.buf + input.pos, input.len - input.pos);
+        input.len -= input.pos;
+        input.pos = 0;
+    }
+    if (headless.trace) {
+        long n = headless.trace_len - headless.trace_pos;
+        if (n > INPUT_BUF - input.len) n = INPUT_BUF - input.len;
+        if (n <= 0) return 0;
+        memcpy(input.buf + input.len, headless.trace + headless.trace_pos, n);
+        headless.trace_pos += n;
+        input.len += n;
+        input.read_at = now();
+        return 1;
+    }
+    for (;;) {
+        int r = poll(&pfd, 1, timeout);
+        if (r == 0) return 0;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            die("poll");
+        }
+        ssize_t n = read(STDIN_FILENO, input.buf + input.len, INPUT_BUF - input.len);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (n < 0) die("read");
+        if (n == 0) exit(1);    // hung up; the swap file keeps the edits
+        input.len += n;
+        input.read_at = now();
+        return 1;
+    }
+}
+// Keys or partial sequences already read, so the terminal need not be polled.
+int input_pending(void) {
+    return input.pos < input.len || input.state != IN_GROUND;
+}
+// Whether a key is waiting, here or in the terminal, after up to timeout ms.
+int input_wait(int timeout) {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    return input_pending() || poll(&pfd, 1, timeout) > 0;
+}
+static int csi_key(int final) {
+    int *p = input.param;
+    if (input.lead == '<' && (final == 'M' || final == 'm') && input.nparam == 3) {
+        input.mouse_button = p[0];
+        input.mouse_x = p[1] - 1;
+        input.mouse_y = p[2] - 1;
+        input.mouse_press = final == 'M';
+        return KEY_MOUSE;
+    }
+    if (input.lead) return KEY_NULL;
+    switch (final) {
+        case 'A': return KEY_ARROW_UP;
+        case 'B': return KEY_ARROW_DOWN;
+        case 'C': return KEY_ARROW_RIGHT;
+        case 'D': return KEY_ARROW_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+        case '~':
+            switch (p[0]) {
+                case 1: case 7: return KEY_HOME;
+                case 4: case 8: return KEY_END;
+                case 3: return KEY_DELETE;
+                case 5: return KEY_PAGE_UP;
+                case 6: return KEY_PAGE_DOWN;
+            }
+    }
+    return KEY_NULL;
+}
+// Decodes the next key from the bytes read so far, or returns KEY_NULL
+// when it needs more. Sequences it does not know are dropped whole.
+static int input_decode(void) {
+    if (input.state == IN_PASTE) {
+        // everything up to ESC [ 201 ~ is text; hold back what may be the
+        // start of that marker until the rest of it arrives
+        unsigned char *from = input.buf + input.pos, *end = memmem(from, input.len - input.pos, "\x1b[201~", 6);
+        long n = end ? end - from : input.len - input.pos > 5 ? input.len - input.pos - 5 : 0;
+        outbuf_append(&input.paste, (const char *)from, n);
+        input.pos += n;
+        if (!end) return KEY_NULL;
+        input.pos += 6;
+        input.state = IN_GROUND;
+        return KEY_PASTE;
+    }
+    while (input.pos < input.len) {
+        int c = input.buf[input.pos++], k;
+        switch (input.state) {
+        case IN_GROUND:
+            if (c != 27) {
+                if (c) return c;
+                break;
+            }
+            input.state = IN_ESC;
+            break;
+        case IN_ESC:
+            if (c == '[' || c == 'O') {
+                input.state = c == '[' ? IN_CSI : IN_SS3;
+                input.nparam = input.param[0] = input.lead = 0;
+                break;
+            }
+            // ESC and then a key: the ESC counts on its own
+            input.state = IN_GROUND;
+            input.pos--;
+            return 27;
+        case IN_SS3:
+            input.state = IN_GROUND;
+            if ((k = csi_key(c))) return k;
+            break;
+        case IN_CSI:
+            if (c >= '0' && c <= '9') {
+                if (!input.nparam) input.nparam = 1;
+                int *p = &input.param[input.nparam - 1];
+                if (*p < 100000) *p = *p * 10 + c - '0';
+            } else if (c == ';') {
+                if (!input.nparam) input.nparam = 1;
+                if (input.nparam < 4) input.param[input.nparam++] = 0;
+            } else if (c >= '<' && c <= '?') {
+                input.lead = c;
+            } else if (c >= '@' && c <= '~') {
+                input.state = IN_GROUND;
+                if (c == '~' && !input.lead && input.param[0] == 200) {
+                    input.state = IN_PASTE;
+                    input.paste.length = 0;
+                    return input_decode();
+                }
+                if ((k = csi_key(c))) return k;
+            } else if (c < ' ' || c > '~') {
+                input.state = IN_GROUND;
+            }
+            break;
+        }
+    }
+    return KEY_NULL;
+}
+int read_key(void) {
+    for (;;) {
+        int k = input_decode();
+        if (k != KEY_NULL) return k;
+        if (input_fill(input.state == IN_ESC || input.state == IN_CSI || input.state == IN_SS3 ? ESC_TIMEOUT_MS : -1))
+            continue;
+        // nothing more came: a lone ESC is the key, a cut-off sequence goes
+        k = input.state == IN_ESC ? 27 : KEY_NULL;
+        if (input.state == IN_GROUND || input.state == IN_PASTE) return KEY_EOF;   // end of a trace
+        input.state = IN_GROUND;
+        if (k) return k;
+    }
+}
+
+// Cursor position in screen rows from the top of the text; O(log n).
+void get_screen_cursor(Editor *ed, long *out_row, int *out_col, int termwidth) {
+    LineView lv;
+    int sub;
+    ensure_rows(ed, termwidth);
+    get_line(ed, ed->cy, &lv);
+    view_cursor(&lv, termwidth, ed->cx, &sub, out_col);
+    *out_row = rows_before(ed, ed->cy) + sub;
+}
+// --- Search: Two-Way matching over line views, both sides of a gap in place ---
+
+static int critical_factorization(const unsigned char *x, int m, int *period) {
+    int ms = -1, j = 0, k = 1, p = 1, ms_rev;
+    while (j + k < m) {
+        unsigned char a = x[j + k], b = x[ms + k];
+        if (a < b) { j += k; k = 1; p = j - ms; }
+        else if (a == b) { if (k != p) ++k; else { j += p; k = 1; } }
+        else { ms = j++; k = p = 1; }
+    }
+    *period = p;
+    ms_rev = -1; j = 0; k = p = 1;
+    while (j + k < m) {
+        unsigned char a = x[j + k], b = x[ms_rev + k];
+        if (b < a) { j += k; k = 1; p = j - ms_rev; }
+        else if (a == b) { if (k != p) ++k; else { j += p; k = 1; } }
+        else { ms_rev = j++; k = p = 1; }
+    }
+    if (ms_rev < ms) return ms + 1;
+    *period = p;
+    return ms_rev + 1;
+}
+void finder_init(Finder *f, const char *pat) {
+    f->m = strlen(pat);
+    if (f->m > (int)sizeof(f->pat)) f->m = sizeof(f->pat);
+    memcpy(f->pat, pat, f->m);
+    f->suffix = f->period = 0;
+    f->periodic = 0;
+    if (f->m < 2) return;
+    f->suffix = critical_factorization(f->pat, f->m, &f->period);
+    f->periodic = f->suffix <= f->m - f->period &&
+                  memcmp(f->pat, f->pat + f->period, f->suffix) == 0;
+    if (!f->periodic)
+        f->period = (f->suffix > f->m - f->suffix ? f->suffix : f->m - f->suffix) + 1;
+}
+// First j >= from where h[j] and h[j+m-1] match the first and last pattern
+// bytes; every match passes this filter, so Two-Way may jump straight there.
+static long prefilter(const Finder *f, const unsigned char *h, long n, long from) {
+    long last = n - f->m;
+    unsigned char c0 = f->pat[0], c1 = f->pat[f->m - 1];
+#ifdef __SSE2__
+    __m128i v0 = _mm_set1_epi8((char)c0), v1 = _mm_set1_epi8((char)c1);
+    while (from + 16 <= last + 1) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(h + from));
+        __m128i b = _mm_loadu_si128((const __m128i *)(h + from + f->m - 1));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, v0), _mm_cmpeq_epi8(b, v1)));
+        if (mask) return from + __builtin_ctz(mask);
+        from += 16;
+    }
+#endif
+    while (from <= last) {
+        const unsigned char *p = memchr(h + from, c0, last - from + 1);
+        if (!p) return -1;
+        from = p - h;
+        if (h[from + f->m - 1] == c1) return from;
+        from++;
+    }
+    return -1;
+}
+// First match in h[from, n), or -1.
+long finder_find(const Finder *f, const char *hay, long n, long from) {
+    const unsigned char *h = (const unsigned char *)hay, *x = f->pat;
+    int m = f->m;
+    if (from < 0) from = 0;
+    if (m == 0) return from <= n ? from : -1;
+    if (n - from < m) return -1;
+    if (m == 1) {
+        const unsigned char *p = memchr(h + from, x[0], n - from);
+        return p ? p - h : -1;
+    }
+    long j = from;
+    int memory = 0;
+    while ((j = prefilter(f, h, n, j)) >= 0) {
+        if (j != from) memory = 0;
+        int i = f->suffix > memory ? f->suffix : memory;
+        while (i < m && x[i] == h[i + j]) i++;
+        if (i < m) {
+            from = j = j + i - f->suffix + 1;
+            memory = 0;
+            continue;
+        }
+        i = f->suffix - 1;
+        while (i >= memory && x[i] == h[i + j]) --i;
+        if (i < memory) return j;
+        from = j = j + f->period;
+        memory = f->periodic ? m - f->period : 0;
+    }
+    return -1;
+}
+// First match at or after column from in a line, including matches that
+// straddle the gap.
+int line_find(const Finder *f, const LineView *lv, int from) {
+    int n0 = lv->n[0], n1 = lv->n[1], m = f->m;
+    long r;
+    if (from < n0 && (r = finder_find(f, lv->p[0], n0, from)) >= 0) return (int)r;
+    if (m > 1 && n1 > 0 && n0 > 0 && from < n0) {
+        char tmp[2 * sizeof(f->pat)];
+        int a = n0 < m - 1 ? n0 : m - 1, b = n1 < m - 1 ? n1 : m - 1;
+        memcpy(tmp, lv->p[0] + n0 - a, a);
+        memcpy(tmp + a, lv->p[1], b);
+        long start = from - (n0 - a);
+        if ((r = finder_find(f, tmp, a + b, start > 0 ? start : 0)) >= 0 && r < a)
+            return (int)(n0 - a + r);
+    }
+    if ((r = finder_find(f, lv->p[1], n1, from > n0 ? from - n0 : 0)) >= 0) return (int)(n0 + r);
+    return -1;
+}
+
+// --- Regex: compiled to an NFA, run as a lazily built DFA with bounded memory ---
+//
+// Syntax: . [] [^] * + ? | () ^ $ and \d \w \s (\D \W \S negated); \ before
+// any other character takes it literally. Matches are leftmost-longest. The
+// forward DFA keeps threads grouped by start position and drops later starts
+// once an earlier one has matched, so the last match it sees is the end of
+// the leftmost-longest match; an anchored reverse DFA walks back from there
+// to its start. States are built on demand, and the whole cache is dropped
+// when it outgrows RE_CACHE, so no pattern can make a scan more than linear.
+
+#define RE_CACHE (1L << 20)
+
+enum { RN_SET, RN_EMPTY, RN_CAT, RN_ALT, RN_STAR, RN_PLUS, RN_QUEST, RN_BOL, RN_EOL };
+enum { RS_MATCH = 1, RS_ENDMATCH = 2, RS_MATCHED = 4, RS_DEAD = 8 };
+
+typedef struct {
+    const char *p;
+    Regex *re;
+    int (*node)[3];     // op, a, b
+    int n;
+    const char *err;
+} ReParser;
+
+static void set_range(unsigned char *set, int lo, int hi) {
+    for (int c = lo; c <= hi; ++c) set[c >> 3] |= 1 << (c & 7);
+}
+// Adds the bytes of \d, \w, \s or their negation to set; 0 for other letters.
+static int re_class_escape(unsigned char *set, int c) {
+    unsigned char t[32] = {0};
+    switch (c | 0x20) {
+    case 'd': set_range(t, '0', '9'); break;
+    case 'w': set_range(t, '0', '9'); set_range(t, 'a', 'z'); set_range(t, 'A', 'Z'); set_range(t, '_', '_'); break;
+    case 's': set_range(t, ' ', ' '); set_range(t, '\t', '\r'); break;
+    default: return 0;
+    }
+    for (int i = 0; i < 32; ++i) set[i] |= c & 0x20 ? t[i] : (unsigned char)~t[i];
+    return 1;
+}
+static int re_node(ReParser *ps, int op, int a, int b) {
+    ps->node[ps->n][0] = op;
+    ps->node[ps->n][1] = a;
+    ps->node[ps->n][2] = b;
+    return ps->n++;
+}
+static int re_set_node(ReParser *ps, const unsigned char *set) {
+    Regex *re = ps->re;
+    re->sets = realloc(re->sets, (re->nsets + 1) * sizeof(*re->sets));
+    memcpy(re->sets[re->nsets], set, 32);
+    return re_node(ps, RN_SET, re->nsets++, 0);
+}
+static int re_parse_class(ReParser *ps) {
+    unsigned char set[32] = {0};
+    int neg = *ps->p == '^';
+    if (neg) ps->p++;
+    const char *first = ps->p;
+    while (*ps->p && (*ps->p != ']' || ps->p == first)) {
+        int lo = (unsigned char)*ps->p++, hi;
+        if (lo == '\\' && *ps->p) {
+            lo = (unsigned char)*ps->p++;
+            if (re_class_escape(set, lo)) continue;
+            if (lo == 't') lo = '\t';
+        }
+        hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (hi == '\\' && *ps->p) hi = (unsigned char)*ps->p++;
+        }
+        if (lo <= hi) set_range(set, lo, hi);
+    }
+    if (*ps->p != ']') {
+        ps->err = "Unterminated [";
+        return -1;
+    }
+    ps->p++;
+    if (neg)
+        for (int i = 0; i < 32; ++i) set[i] = ~set[i];
+    return re_set_node(ps, set);
+}
+static int re_parse_alt(ReParser *ps);
+static int re_parse_atom(ReParser *ps) {
+    unsigned char set[32] = {0};
+    int c = (unsigned char)*ps->p++, n;
+    switch (c) {
+    case '(':
+        n = re_parse_alt(ps);
+        if (n < 0) return -1;
+        if (*ps->p != ')') {
+            ps->err = "Unmatched (";
+            return -1;
+        }
+        ps->p++;
+        return n;
+    case '^': return re_node(ps, RN_BOL, 0, 0);
+    case '$': return re_node(ps, RN_EOL, 0, 0);
+    case '[': return re_parse_class(ps);
+    case '.':
+        set_range(set, 0, 255);
+        return re_set_node(ps, set);
+    case '\\':
+        if (!*ps->p) {
+            ps->err = "Trailing \\";
+            return -1;
+        }
+        c = (unsigned char)*ps->p++;
+        if (re_class_escape(set, c)) return re_set_node(ps, set);
+        if (c == 't') c = '\t';
+        break;
+    }
+    set_range(set, c, c);
+    return re_set_node(ps, set);
+}
+static int re_parse_repeat(ReParser *ps) {
+    int n = re_parse_atom(ps);
+    while (n >= 0 && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')) {
+        int op = *ps->p == '*' ? RN_STAR : *ps->p == '+' ? RN_PLUS : RN_QUEST;
+        ps->p++;
+        n = re_node(ps, op, n, 0);
+    }
+    return n;
+}
+// A * + or ? with nothing before it is taken literally, as vi does.
+static int re_parse_cat(ReParser *ps) {
+    int n = -1;
+    while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+        int m = re_parse_repeat(ps);
+        if (m < 0) return -1;
+        n = n < 0 ? m : re_node(ps, RN_CAT, n, m);
+    }
+    return n < 0 ? re_node(ps, RN_EMPTY, 0, 0) : n;
+}
+static int re_parse_alt(ReParser *ps) {
+    int n = re_parse_cat(ps);
+    while (n >= 0 && *ps->p == '|') {
+        ps->p++;
+        int m = re_parse_cat(ps);
+        if (m < 0) return -1;
+        n = re_node(ps, RN_ALT, n, m);
+    }
+    return n;
+}
+
+// Thompson construction; rev emits the program for the reversed language.
+static int re_emit(int (*node)[3], int i, ReInst *prog, int pc, int rev) {
+    int a = node[i][1], b = node[i][2], l = pc, j;
+    switch (node[i][0]) {
+    case RN_SET:
+        prog[pc].op = RE_SET;
+        prog[pc].x = a;
+        return pc + 1;
+    case RN_EMPTY:
+        return pc;
+    case RN_CAT:
+        pc = re_emit(node, rev ? b : a, prog, pc, rev);
+        return re_emit(node, rev ? a : b, prog, pc, rev);
+    case RN_ALT:
+        j = re_emit(node, a, prog, l + 1, rev);
+        pc = re_emit(node, b, prog, j + 1, rev);
+        prog[l].op = RE_SPLIT;
+        prog[l].x = l + 1;
+        prog[l].y = j + 1;
+        prog[j].op = RE_JMP;
+        prog[j].x = pc;
+        return pc;
+    case RN_STAR:
+        pc = re_emit(node, a, prog, l + 1, rev);
+        prog[l].op = RE_SPLIT;
+        prog[l].x = l + 1;
+        prog[l].y = pc + 1;
+        prog[pc].op = RE_JMP;
+        prog[pc].x = l;
+        return pc + 1;
+    case RN_PLUS:
+        pc = re_emit(node, a, prog, l, rev);
+        prog[pc].op = RE_SPLIT;
+        prog[pc].x = l;
+        prog[pc].y = pc + 1;
+        return pc + 1;
+    case RN_QUEST:
+        pc = re_emit(node, a, prog, l + 1, rev);
+        prog[l].op = RE_SPLIT;
+        prog[l].x = l + 1;
+        prog[l].y = pc;
+        return pc;
+    }
+    prog[pc].op = (node[i][0] == RN_BOL) != rev ? RE_BOL : RE_EOL;
+    return pc + 1;
+}
+
+// Splits the bytes into classes no pattern set tells apart.
+static void re_classes(Regex *re) {
+    short map[512];
+    memset(re->cls, 0, sizeof(re->cls));
+    re->nclass = 1;
+    for (int s = 0; s < re->nsets; ++s) {
+        int n = 0;
+        memset(map, -1, sizeof(map));
+        for (int c = 0; c < 256; ++c) {
+            int k = re->cls[c] * 2 + (re->sets[s][c >> 3] >> (c & 7) & 1);
+            if (map[k] < 0) map[k] = n++;
+            re->cls[c] = map[k];
+        }
+        re->nclass = n;
+    }
+}
+
+static void re_dfa_init(ReDfa *d, ReInst *prog, int len, int unanchored) {
+    memset(d, 0, sizeof(*d));
+    d->prog = prog;
+    d->len = len;
+    d->unanchored = unanchored;
+    d->start[0] = d->start[1] = -1;
+    d->mark = calloc(len, sizeof(int));
+    d->stack = malloc((2 * len + 2) * sizeof(int));
+    d->work = malloc((2 * len + 2) * sizeof(int));
+    d->tmp = malloc((2 * len + 2) * sizeof(int));
+}
+static void re_dfa_free(ReDfa *d) {
+    free(d->prog);
+    free(d->trans);
+    free(d->flags);
+    free(d->set_at);
+    free(d->set_len);
+    free(d->pool);
+    free(d->table);
+    free(d->mark);
+    free(d->stack);
+    free(d->work);
+    free(d->tmp);
+}
+void re_free(Regex *re) {
+    re_dfa_free(&re->fwd);
+    re_dfa_free(&re->rev);
+    free(re->sets);
+    memset(re, 0, sizeof(*re));
+}
+
+// Appends to out the threads reachable from pc without consuming a byte;
+// bol and eol tell whether ^ and $ hold here. A $ that does not hold yet
+// stays in the list, since the end of the line may still come.
+static int re_closure(ReDfa *d, int pc, int bol, int eol, int *out, int n) {
+    int sp = 0;
+    d->stack[sp++] = pc;
+    while (sp) {
+        pc = d->stack[--sp];
+        if (d->mark[pc] == d->gen) continue;
+        d->mark[pc] = d->gen;
+        ReInst *in = &d->prog[pc];
+        switch (in->op) {
+        case RE_SPLIT: d->stack[sp++] = in->y; d->stack[sp++] = in->x; break;
+        case RE_JMP: d->stack[sp++] = in->x; break;
+        case RE_BOL: if (bol) d->stack[sp++] = pc + 1; break;
+        case RE_EOL: if (eol) d->stack[sp++] = pc + 1; else out[n++] = pc; break;
+        default: out[n++] = pc;
+        }
+    }
+    return n;
+}
+static int cmp_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+// Sorts the group in d->work[g, n) and closes it; returns 1 if it matches.
+static int re_group(ReDfa *d, int g, int *n) {
+    int match = 0;
+    qsort(d->work + g, *n - g, sizeof(int), cmp_int);
+    for (int i = g; i < *n; ++i) match |= d->prog[d->work[i]].op == RE_MATCH;
+    d->work[(*n)++] = -1;
+    return match;
+}
+static void re_flush(ReDfa *d) {
+    d->nstates = d->pool_len = 0;
+    memset(d->table, -1, d->table_cap * sizeof(int));
+    d->start[0] = d->start[1] = -1;
+    d->flushed = 1;
+    d->flushes++;
+}
+// Returns the state for the thread list in d->work[0, n), adding it if new.
+static int re_state(Regex *re, ReDfa *d, int n, int flags, int bol) {
+    const int *set = d->work;
+    for (int i = 0; i < n; ++i) {
+        int op = set[i] < 0 ? -1 : d->prog[set[i]].op;
+        if (op == RE_MATCH) flags |= RS_MATCH;
+        if (op == RE_MATCH || op == RE_EOL) {
+            ++d->gen;
+            int k = re_closure(d, set[i], bol, 1, d->tmp, 0);
+            while (k-- > 0)
+                if (d->prog[d->tmp[k]].op == RE_MATCH) flags |= RS_ENDMATCH;
+        }
+    }
+    if (!n) flags |= RS_DEAD;
+    unsigned h = 2166136261u ^ flags;
+    for (int i = 0; i < n; ++i) h = (h ^ (unsigned)set[i]) * 16777619u;
+    for (unsigned i = h & (d->table_cap - 1); d->table_cap && d->table[i] >= 0; i = (i + 1) & (d->table_cap - 1)) {
+        int s = d->table[i];
+        if (d->flags[s] == flags && d->set_len[s] == n &&
+            memcmp(d->pool + d->set_at[s], set, n * sizeof(int)) == 0)
+            return s;
+    }
+    long bytes = (long)d->nstates * (re->nclass + 3) * sizeof(int) + d->pool_len * (long)sizeof(int);
+    if (bytes + (n + re->nclass) * (long)sizeof(int) > RE_CACHE) re_flush(d);
+    if (d->nstates == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 64;
+        d->trans = realloc(d->trans, (long)d->cap * re->nclass * sizeof(int));
+        d->flags = realloc(d->flags, d->cap);
+        d->set_at = realloc(d->set_at, d->cap * sizeof(int));
+        d->set_len = realloc(d->set_len, d->cap * sizeof(int));
+    }
+    if (d->pool_len + n > d->pool_cap) {
+        d->pool_cap = (d->pool_len + n) * 2;
+        d->pool = realloc(d->pool, d->pool_cap * sizeof(int));
+    }
+    int s = d->nstates++;
+    memset(d->trans + (long)s * re->nclass, -1, re->nclass * sizeof(int));
+    d->flags[s] = flags;
+    d->set_at[s] = d->pool_len;
+    d->set_len[s] = n;
+    memcpy(d->pool + d->pool_len, set, n * sizeof(int));
+    d->pool_len += n;
+    if (d->nstates * 2 > d->table_cap) {
+        d->table_cap = d->table_cap ? d->table_cap * 2 : 128;
+        d->table = realloc(d->table, d->table_cap * sizeof(int));
+        memset(d->table, -1, d->table_cap * sizeof(int));
+        for (int t = 0; t < d->nstates; ++t) {
+            unsigned g = 2166136261u ^ d->flags[t];
+            for (int i = 0; i < d->set_len[t]; ++i) g = (g ^ (unsigned)d->pool[d->set_at[t] + i]) * 16777619u;
+            while (d->table[g & (d->table_cap - 1)] >= 0) ++g;
+            d->table[g & (d->table_cap - 1)] = t;
+        }
+    } else {
+        while (d->table[h & (d->table_cap - 1)] >= 0) ++h;
+        d->table[h & (d->table_cap - 1)] = s;
+    }
+    return s;
+}
+static int re_start(Regex *re, ReDfa *d, int bol) {
+    if (d->start[bol] < 0) {
+        int n = 0;
+        ++d->gen;
+        n = re_closure(d, 0, bol, 0, d->work, n);
+        re_group(d, 0, &n);
+        d->start[bol] = re_state(re, d, n, 0, bol);
+    }
+    return d->start[bol];
+}
+// Builds the transition of state s on byte c.
+static int re_next(Regex *re, ReDfa *d, int s, int c) {
+    const int *set = d->pool + d->set_at[s];
+    int n = d->set_len[s], k = 0, hit = 0;
+    int matched = d->flags[s] & (RS_MATCH | RS_MATCHED);
+    ++d->gen;
+    for (int i = 0; i < n; ++i) {
+        int g = k;
+        for (; set[i] >= 0; ++i) {
+            ReInst *in = &d->prog[set[i]];
+            if (in->op == RE_SET && re->sets[in->x][c >> 3] >> (c & 7) & 1)
+                k = re_closure(d, set[i] + 1, 0, 0, d->work, k);
+        }
+        // threads that started later cannot beat a match
+        if (k > g && (hit = re_group(d, g, &k))) break;
+    }
+    if (d->unanchored && !matched && !hit) {
+        int g = k;
+        k = re_closure(d, 0, 0, 0, d->work, k);
+        if (k > g) re_group(d, g, &k);
+    }
+    d->flushed = 0;
+    int t = re_state(re, d, k, matched ? RS_MATCHED : 0, 0);
+    if (!d->flushed) d->trans[(long)s * re->nclass + re->cls[c]] = t;
+    return t;
+}
+// Runs the forward DFA over h[i, n) from state s, setting *end after each
+// match. Returns the state reached, or -1 once no match can follow.
+static int re_scan(Regex *re, ReDfa *d, int s, const unsigned char *h, int i, int n, int base, int *end) {
+    for (; i < n; ++i) {
+        if (s == d->start[0] && re->first >= 0) {
+            // only the first byte of a match can leave the start state
+            const unsigned char *q = memchr(h + i, re->first, n - i);
+            if (!q) break;
+            i = q - h;
+        }
+        int t = d->trans[(long)s * re->nclass + re->cls[h[i]]];
+        s = t >= 0 ? t : re_next(re, d, s, h[i]);
+        if (d->flags[s] & (RS_MATCH | RS_DEAD)) {
+            if (d->flags[s] & RS_DEAD) return -1;
+            *end = base + i + 1;
+        }
+    }
+    return s;
+}
+// Runs the reverse DFA over h[lo, hi) backwards, setting *start at each match.
+static int re_rscan(Regex *re, ReDfa *d, int s, const unsigned char *h, int lo, int hi, int base, int *start) {
+    for (int i = hi - 1; i >= lo; --i) {
+        int t = d->trans[(long)s * re->nclass + re->cls[h[i]]];
+        s = t >= 0 ? t : re_next(re, d, s, h[i]);
+        if (d->flags[s] & (RS_MATCH | RS_DEAD)) {
+            if (d->flags[s] & RS_DEAD) return -1;
+            *start = base + i;
+        }
+    }
+    return s;
+}
+
+// Returns NULL, or what is wrong with pat.
+const char *re_compile(Regex *re, const char *pat) {
+    ReParser ps;
+    int len = strlen(pat), root;
+    memset(re, 0, sizeof(*re));
+    ps.p = pat;
+    ps.re = re;
+    ps.node = malloc((3 * len + 4) * sizeof(*ps.node));
+    ps.n = 0;
+    ps.err = NULL;
+    root = re_parse_alt(&ps);
+    if (root >= 0 && *ps.p) ps.err = "Unmatched )";
+    if (ps.err) {
+        free(ps.node);
+        re_free(re);
+        return ps.err;
+    }
+    re_classes(re);
+    for (int rev = 0; rev < 2; ++rev) {
+        ReInst *prog = calloc(2 * ps.n + 2, sizeof(ReInst));
+        int n = re_emit(ps.node, root, prog, 0, rev);
+        prog[n].op = RE_MATCH;
+        re_dfa_init(rev ? &re->rev : &re->fwd, prog, n + 1, !rev);
+    }
+    free(ps.node);
+    // a single byte starts every match: scan for it with memchr
+    ReDfa *d = &re->fwd;
+    int n = 0;
+    ++d->gen;
+    n = re_closure(d, 0, 0, 0, d->work, n);
+    re->first = -1;
+    for (int i = 0; i < n; ++i) {
+        ReInst *in = &d->prog[d->work[i]];
+        int c = -1, k = 0;
+        for (int b = 0; in->op == RE_SET && b < 256; ++b)
+            if (re->sets[in->x][b >> 3] >> (b & 7) & 1) c = b, ++k;
+        if (k != 1 || (i > 0 && c != re->first)) {
+            re->first = -1;
+            break;
+        }
+        re->first = c;
+    }
+    // patterns without operators go to the Two-Way finder
+    char lit[128];
+    int m = 0;
+    re->literal = 1;
+    for (const char *p = pat; *p && re->literal; ++p) {
+        if (*p == '\\' && p[1] && !strchr("dDwWsSt", p[1])) ++p;
+        else if (strchr(".[*+?|()^$\\", *p)) re->literal = 0;
+        if (m < (int)sizeof(lit) - 1) lit[m++] = *p;
+    }
+    lit[m] = 0;
+    if (re->literal) finder_init(&re->lit, lit);
+    return NULL;
+}
+
+// First match at or after column from: returns its start and sets *len.
+// Only the first to bytes of the line are looked at, so a match running
+// past them is cut short or missed, and $ matches only at the real end.
+int re_find_to(Regex *re, const LineView *lv, int from, int to, int *len) {
+    int n0 = lv->n[0], n = n0 + lv->n[1], end = -1, start = -1, s, eol = to >= n;
+    LineView v = *lv;
+    if (!eol) {
+        v.n[0] = n0 = to < n0 ? to : n0;
+        v.n[1] = to - n0;
+        n = to;
+    }
+    const unsigned char *p0 = (const unsigned char *)v.p[0], *p1 = (const unsigned char *)v.p[1];
+    if (re->literal) {
+        *len = re->lit.m;
+        return line_find(&re->lit, &v, from);
+    }
+    if (from > n) return -1;
+    ReDfa *d = &re->fwd;
+    if (re->first >= 0) re_start(re, d, 0);
+    s = re_start(re, d, from == 0);
+    if (d->flags[s] & RS_MATCH) end = from;
+    if (from < n0) s = re_scan(re, d, s, p0, from, n0, 0, &end);
+    if (s >= 0) s = re_scan(re, d, s, p1, from > n0 ? from - n0 : 0, v.n[1], n0, &end);
+    if (eol && s >= 0 && d->flags[s] & RS_ENDMATCH) end = n;
+    if (end < 0) return -1;
+    d = &re->rev;
+    s = re_start(re, d, eol && end == n);
+    if (d->flags[s] & RS_MATCH) start = end;
+    if (end > n0) s = re_rscan(re, d, s, p1, from > n0 ? from - n0 : 0, end - n0, n0, &start);
+    if (s >= 0 && from < n0) s = re_rscan(re, d, s, p0, from, end < n0 ? end : n0, 0, &start);
+    if (s >= 0 && from == 0 && d->flags[s] & RS_ENDMATCH) start = 0;
+    if (start < 0) return -1;
+    *len = end - start;
+    return start;
+}
+int re_find(Regex *re, const LineView *lv, int from, int *len) {
+    return re_find_to(re, lv, from, INT_MAX, len);
+}
+// Last match starting before column before, or -1.
+int re_rfind(Regex *re, const LineView *lv, int before, int *len) {
+    int last = -1, l, r = re_find(re, lv, 0, &l);
+    while (r >= 0 && r < before) {
+        last = r;
+        *len = l;
+        r = re_find(re, lv, r + 1, &l);
+    }
+    return last;
+}
+
+// --- Background search: a worker scans a snapshot, the editor keeps running ---
+
+static void snap_add(Snapshot *s, Piece *t) {
+    if (!t) return;
+    snap_add(s, t->left);
+    if (s->nruns == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 64;
+        s->runs = realloc(s->runs, s->cap * sizeof(SnapRun));
+    }
+    SnapRun *r = &s->runs[s->nruns++];
+    r->line = s->lines;
+    r->first = t->first;
+    r->count = t->count;
+    r->gb = &t->gb;
+    s->lines += t->count;
+    snap_add(s, t->right);
+}
+static void snap_free(Snapshot *s) {
+    free(s->runs);
+    memset(s, 0, sizeof(*s));
+}
+static void snap_line(Snapshot *s, int y, LineView *lv) {
+    SnapRun *r = &s->runs[s->hint];
+    if (y < r->line || y >= r->line + r->count) {
+        int lo = 0, hi = s->nruns - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (s->runs[mid].line <= y) lo = mid;
+            else hi = mid - 1;
+        }
+        s->hint = lo;
+        r = &s->runs[lo];
+    }
+    lv->p[1] = "";
+    lv->n[1] = 0;
+    lv->wide = 1;   // not tracked here; anything is laid out right as wide
+    lv->brk = NULL;
+    if (r->first < 0) {
+        // gapbuf_view would make the layout cache, which is the editor's
+        const GapBuf *gb = r->gb;
+        lv->p[0] = gb->buf ? gb->buf : "";
+        lv->n[0] = gb->gap_start;
+        lv->p[1] = gb->buf ? gb->buf + gb->gap_end : "";
+        lv->n[1] = gb->buf_size - gb->gap_end;
+    } else {
+        long a = orig_off(s->orig, r->first + y - r->line);
+        lv->p[0] = s->orig->data + a;
+        lv->n[0] = (int)(orig_off(s->orig, r->first + y - r->line + 1) - a - 1);
+    }
+}
+
+static void search_wake(SearchJob *j) {
+    if (write(j->wake[1], "", 1) < 0) {}
+}
+// Finds the match to move to, wrapping around the ends of the text, then
+// counts all matches in text order so the editor can show "N of M".
+static void *search_worker(void *arg) {
+    SearchJob *j = arg;
+    Snapshot *s = &j->snap;
+    Regex re;
+    LineView lv;
+    int n = s->lines, len, ty = -1, tx = -1;
+    re_compile(&re, j->pat);
+    for (int i = 0; i <= n && ty < 0; ++i) {
+        if (__atomic_load_n(&j->stop, __ATOMIC_RELAXED)) goto out;
+        int y = j->dir > 0 ? (j->cy + i) % n : ((j->cy - i) % n + n) % n, x;
+        snap_line(s, y, &lv);
+        if (j->dir > 0) x = re_find(&re, &lv, i == 0 ? j->cx + 1 : 0, &len);
+        else x = re_rfind(&re, &lv, i == 0 ? j->cx : lv.n[0] + lv.n[1] + 1, &len);
+        if (x >= 0 && (i < n || (j->dir > 0 ? x <= j->cx : x >= j->cx))) {
+            ty = y;
+            tx = x;
+        }
+    }
+    j->ty = ty;
+    j->tx = tx;
+    __atomic_store_n(&j->found, ty >= 0 ? 1 : -1, __ATOMIC_RELEASE);
+    search_wake(j);
+    double last = now();
+    long total = 0, before = 0;
+    for (int y = 0; y < n && ty >= 0; ++y) {
+        if (__atomic_load_n(&j->stop, __ATOMIC_RELAXED)) goto out;
+        snap_line(s, y, &lv);
+        for (int x = re_find(&re, &lv, 0, &len); x >= 0; x = re_find(&re, &lv, x + (len ? len : 1), &len)) {
+            total++;
+            if (y < ty || (y == ty && x < tx)) before++;
+        }
+        if ((y & 1023) == 0 && now() - last > 0.05) {
+            __atomic_store_n(&j->before, before, __ATOMIC_RELAXED);
+            __atomic_store_n(&j->total, total, __ATOMIC_RELAXED);
+            search_wake(j);
+            last = now();
+        }
+    }
+    __atomic_store_n(&j->before, before, __ATOMIC_RELAXED);
+    __atomic_store_n(&j->total, total, __ATOMIC_RELAXED);
+out:
+    re_free(&re);
+    __atomic_store_n(&j->done, 1, __ATOMIC_RELEASE);
+    search_wake(j);
+    return NULL;
+}
+static void search_join(SearchJob *j) {
+    if (j->threaded) pthread_join(j->thread, NULL);
+    j->active = j->threaded = 0;
+}
+// Stops a running search and forgets its results.
+void search_cancel(Editor *ed) {
+    SearchJob *j = &ed->job;
+    if (j->active) {
+        __atomic_store_n(&j->stop, 1, __ATOMIC_RELAXED);
+        search_join(j);
+    }
+    j->found = j->applied = 0;
+}
+// Acts on what the worker has published: moves to the match once it is
+// known and reaps the thread when it is done. Returns 1 if anything changed.
+int search_poll(Editor *ed) {
+    SearchJob *j = &ed->job;
+    char buf[64];
+    while (read(j->wake[0], buf, sizeof(buf)) > 0);
+    if (!j->active) return 0;
+    int found = __atomic_load_n(&j->found, __ATOMIC_ACQUIRE);
+    if (found && !j->applied) {
+        j->applied = 1;
+        ed->search_found = found > 0;
+        if (found > 0) {
+            jump_push(ed);
+            ed->cy = j->ty >= j->load_at ? j->ty + ed->loaded - j->loaded : j->ty;
+            ed->cx = j->tx;
+        } else {
+            snprintf(ed->message, sizeof(ed->message), "Pattern not found");
+        }
+    }
+    if (__atomic_load_n(&j->done, __ATOMIC_ACQUIRE)) search_join(j);
+    return 1;
+}
+// Starts looking for the next (dir > 0) or previous match of ed->re. The
+// editor waits briefly so a nearby match lands in the next frame.
+void search_start(Editor *ed, int dir) {
+    SearchJob *j = &ed->job;
+    search_cancel(ed);
+    if (!ed->re.fwd.prog) return;
+    if (!j->wake[1]) {
+        if (pipe(j->wake) < 0) die("pipe");
+        fcntl(j->wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(j->wake[1], F_SETFL, O_NONBLOCK);
+    }
+    // n and N over text that has not changed look at the same lines
+    if (!j->snap.runs || j->edits != ed->edits || j->snap.lines != ed->num_lines) {
+        snap_free(&j->snap);
+        j->snap.orig = &ed->orig;
+        snap_add(&j->snap, ed->root);
+        j->edits = ed->edits;
+    }
+    j->dir = dir;
+    j->cy = ed->cy;
+    j->cx = ed->cx;
+    j->load_at = ed->load_at;
+    j->loaded = ed->loaded;
+    strcpy(j->pat, ed->pattern);
+    j->stop = j->done = 0;
+    j->before = j->total = 0;
+    j->active = 1;
+    j->threaded = pthread_create(&j->thread, NULL, search_worker, j) == 0;
+    if (!j->threaded) search_worker(j);
+    struct pollfd pfd = { j->wake[0], POLLIN, 0 };
+    poll(&pfd, 1, 20);
+    search_poll(ed);
+}
+
+// --- Syntax: per-line lexers whose end states are cached between frames ---
+
+enum { LANG_NONE, LANG_C, LANG_MAKE, LANG_ASM };
+enum { SYN_TEXT, SYN_COMMENT, SYN_STRING, SYN_NUMBER, SYN_KEYWORD, SYN_TYPE, SYN_PREPROC, SYN_LABEL, SYN_VAR };
+static const unsigned char syn_sgr[] = { 0, 36, 31, 35, 33, 32, 35, 34, 32 };
+
+#define SYN_FAR 20000   // a line this far past the cache is lexed from
+#define SYN_BACK 200    // this many lines above it, starting afresh
+#define SYN_MAXCOL 3000 // as vim's synmaxcol: longer lines are lexed this far
+
+static int syn_lang(const char *path) {
+    const char *base = strrchr(path, '/'), *dot;
+    base = base ? base + 1 : path;
+    dot = strrchr(base, '.');
+    if (!strcmp(base, "Makefile") || !strcmp(base, "makefile") || !strcmp(base, "GNUmakefile") ||
+        (dot && !strcmp(dot, ".mk")))
+        return LANG_MAKE;
+    if (!dot) return LANG_NONE;
+    if (!strcmp(dot, ".c") || !strcmp(dot, ".h") || !strcmp(dot, ".cc") || !strcmp(dot, ".cpp")) return LANG_C;
+    if (!strcmp(dot, ".s") || !strcmp(dot, ".S") || !strcmp(dot, ".asm")) return LANG_ASM;
+    return LANG_NONE;
+}
+static int syn_alpha(int c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+static int syn_digit(int c) { return c >= '0' && c <= '9'; }
+static int syn_word(int c) { return syn_alpha(c) || syn_digit(c); }
+static int syn_find(const char *const *list, const char *s, int n) {
+    for (int i = 0; list[i]; ++i)
+        if ((int)strlen(list[i]) == n && !memcmp(list[i], s, n)) return i;
+    return -1;
+}
+static void syn_mark(unsigned char *cls, int from, int to, int k) {
+    if (cls && to > from) memset(cls + from, k, to - from);
+}
+// End of the quoted run opened at s[i], or -1 if the line ends inside it.
+static int syn_quote(const char *s, int n, int i) {
+    char q = s[i++];
+    while (i < n && s[i] != q) i += s[i] == '\\' ? 2 : 1;
+    return i < n ? i + 1 : -1;
+}
+static int syn_number(const char *s, int n, int i) {
+    while (i < n && (syn_word(s[i]) || s[i] == '.')) ++i;
+    return i;
+}
+// Marks the rest of a /* */ comment from s[i]; returns where it ends, n if
+// it goes on past the line.
+static int syn_block(const char *s, int n, int i, unsigned char *cls, int *open) {
+    const char *e = i < n ? memmem(s + i, n - i, "*/", 2) : NULL;
+    int j = e ? (int)(e - s) + 2 : n;
+    syn_mark(cls, i, j, SYN_COMMENT);
+    *open = !e;
+    return j;
+}
+
+#define C_COMMENT 1     // inside /* */
+#define C_STRING 2      // in a string continued with a backslash
+#define C_LINE 3        // in a // comment continued with a backslash
+
+static const char *const c_keywords[] = {
+    "auto", "break", "case", "const", "continue", "default", "do", "else", "extern", "for", "goto", "if",
+    "inline", "register", "restrict", "return", "sizeof", "static", "switch", "typedef", "volatile", "while", NULL
+};
+static const char *const c_types[] = {
+    "_Bool", "bool", "char", "double", "enum", "float", "int", "long", "off_t", "short", "signed", "size_t",
+    "ssize_t", "struct", "union", "unsigned", "void", NULL
+};
+
+static int lex_c(const char *s, int n, int st, unsigned char *cls) {
+    int i = 0, first = 1, open = 0, cont = n > 0 && s[n - 1] == '\\';
+    if (st == C_LINE) {
+        syn_mark(cls, 0, n, SYN_COMMENT);
+        return cont ? C_LINE : 0;
+    }
+    if (st == C_STRING) {
+        while (i < n && s[i] != '"') i += s[i] == '\\' ? 2 : 1;
+        if (i >= n) {
+            syn_mark(cls, 0, n, SYN_STRING);
+            return cont ? C_STRING : 0;
+        }
+        syn_mark(cls, 0, ++i, SYN_STRING);
+    } else if (st == C_COMMENT) {
+        i = syn_block(s, n, 0, cls, &open);
+        if (open) return C_COMMENT;
+    }
+    while (i < n) {
+        int c = s[i], j = i + 1;
+        if (c == '/' && j < n && s[j] == '*') {
+            syn_mark(cls, i, i + 2, SYN_COMMENT);
+            i = syn_block(s, n, i + 2, cls, &open);
+            if (open) return C_COMMENT;
+            first = 0;
+            continue;
+        }
+        if (c == '/' && j < n && s[j] == '/') {
+            syn_mark(cls, i, n, SYN_COMMENT);
+            return cont ? C_LINE : 0;
+        }
+        if (c == '"' || c == '\'') {
+            j = syn_quote(s, n, i);
+            if (j < 0) {
+                syn_mark(cls, i, n, SYN_STRING);
+                return c == '"' && cont ? C_STRING : 0;
+            }
+            syn_mark(cls, i, j, SYN_STRING);
+        } else if (c == '#' && first) {
+            int w;
+            while (j < n && (s[j] == ' ' || s[j] == '\t')) ++j;
+            for (w = j; j < n && syn_word(s[j]); ++j) {}
+            syn_mark(cls, i, j, SYN_PREPROC);
+            if (j - w == 7 && !memcmp(s + w, "include", 7)) {
+                while (j < n && s[j] == ' ') ++j;
+                if (j < n && s[j] == '<') {
+                    const char *e = memchr(s + j, '>', n - j);
+                    int k = e ? (int)(e - s) + 1 : n;
+                    syn_mark(cls, j, k, SYN_STRING);
+                    j = k;
+                }
+            }
+        } else if (syn_digit(c) || (c == '.' && j < n && syn_digit(s[j]))) {
+            j = syn_number(s, n, j);
+            syn_mark(cls, i, j, SYN_NUMBER);
+        } else if (syn_alpha(c)) {
+            while (j < n && syn_word(s[j])) ++j;
+            if (cls && syn_find(c_keywords, s + i, j - i) >= 0) syn_mark(cls, i, j, SYN_KEYWORD);
+            else if (cls && syn_find(c_types, s + i, j - i) >= 0) syn_mark(cls, i, j, SYN_TYPE);
+        }
+        if (c != ' ' && c != '\t') first = 0;
+        i = j;
+    }
+    return 0;
+}
+
+#define MK_CONT 1       // a line continued with a backslash
+#define MK_COMMENT 2    // a comment continued with a backslash
+#define MK_RECIPE 3     // a recipe line continued with a backslash
+#define MK_DEFINE 4     // flag: between define and endef
+
+static const char *const mk_directives[] = {
+    "include", "-include", "sinclude", "ifeq", "ifneq", "ifdef", "ifndef", "else", "endif", "vpath",
+    "define", "endef", "export", "unexport", "override", "private", NULL
+};
+
+// Marks the reference $(...), ${...} or $c at s[i]; returns its end.
+static int mk_ref(const char *s, int n, int i, unsigned char *cls) {
+    int j = i + 1, depth = 0;
+    if (j < n && (s[j] == '(' || s[j] == '{')) {
+        for (; j < n; ++j) {
+            if (s[j] == '(' || s[j] == '{') depth++;
+            else if ((s[j] == ')' || s[j] == '}') && --depth == 0) break;
+        }
+    }
+    j = j < n ? j + 1 : n;
+    syn_mark(cls, i, j, SYN_VAR);
+    return j;
+}
+static int mk_is(const char *s, int n, const char *word) {
+    return (int)strlen(word) == n && !memcmp(s, word, n);
+}
+
+static int lex_make(const char *s, int n, int st, unsigned char *cls) {
+    int define = st & MK_DEFINE, kind = st & 3, i = 0, cont = n > 0 && s[n - 1] == '\\';
+    if (kind == MK_COMMENT) {
+        syn_mark(cls, 0, n, SYN_COMMENT);
+        return define | (cont ? MK_COMMENT : 0);
+    }
+    int recipe = kind == MK_RECIPE || (!kind && n > 0 && s[0] == '\t'), head = !kind && !recipe && !define;
+    if (!kind) {
+        // a directive opens the line
+        int w;
+        while (i < n && (s[i] == ' ' || s[i] == '\t')) ++i;
+        for (w = i; w < n && (syn_word(s[w]) || s[w] == '-'); ++w) {}
+        if (define && mk_is(s + i, w - i, "endef")) {
+            syn_mark(cls, i, w, SYN_KEYWORD);
+            define = 0;
+            i = w;
+        } else if (head && syn_find(mk_directives, s + i, w - i) >= 0) {
+            syn_mark(cls, i, w, SYN_KEYWORD);
+            if (mk_is(s + i, w - i, "define")) define = MK_DEFINE;
+            // only these may be followed by an assignment
+            head = define || mk_is(s + i, w - i, "export") || mk_is(s + i, w - i, "override") ||
+                   mk_is(s + i, w - i, "private");
+            i = w;
+        }
+        if (define && !head) recipe = 1;
+    }
+    if (head) {
+        // the target of a rule or the variable of an assignment
+        int j, end;
+        while (i < n && (s[i] == ' ' || s[i] == '\t')) ++i;
+        j = i;
+        while (j < n && s[j] != ':' && s[j] != '=' && s[j] != '#') j = s[j] == '$' ? mk_ref(s, n, j, NULL) : j + 1;
+        for (end = j; end > i && s[end - 1] && strchr(" \t?+!", s[end - 1]); --end) {}
+        if (define) syn_mark(cls, i, n, SYN_VAR);
+        else if (j < n && s[j] == ':' && (j + 1 >= n || s[j + 1] != '=') && (j + 2 >= n || s[j + 1] != ':' || s[j + 2] != '='))
+            syn_mark(cls, i, end, SYN_LABEL);
+        else if (j < n && s[j] != '#')
+            syn_mark(cls, i, end, SYN_VAR);
+    }
+    while (i < n) {
+        if (s[i] == '$') {
+            i = i + 1 < n && s[i + 1] == '$' ? i + 2 : mk_ref(s, n, i, cls);
+        } else if (s[i] == '#' && !recipe && (i == 0 || s[i - 1] != '\\')) {
+            syn_mark(cls, i, n, SYN_COMMENT);
+            return define | (cont ? MK_COMMENT : 0);
+        } else {
+            ++i;
+        }
+    }
+    return define | (cont ? (recipe ? MK_RECIPE : MK_CONT) : 0);
+}
+
+#define ASM_COMMENT 1   // inside /* */
+
+static const char *const asm_registers[] = { "fp", "gp", "lr", "pc", "ra", "sp", "tp", "zero", NULL };
+
+// Register names of the ARM, MIPS and RISC-V assemblers in this tree.
+static int asm_register(const char *s, int n) {
+    if (syn_find(asm_registers, s, n) >= 0) return 1;
+    if (n < 2 || n > 3 || !strchr("rxwatsv", s[0])) return 0;
+    for (int i = 1; i < n; ++i)
+        if (!syn_digit(s[i])) return 0;
+    return 1;
+}
+
+static int lex_asm(const char *s, int n, int st, unsigned char *cls) {
+    int i = 0, open = 0, first = 1, mnemonic = 1;
+    if (st == ASM_COMMENT) {
+        i = syn_block(s, n, 0, cls, &open);
+        if (open) return ASM_COMMENT;
+    }
+    while (i < n) {
+        int c = s[i], j = i + 1;
+        if (c == '/' && j < n && s[j] == '*') {
+            syn_mark(cls, i, i + 2, SYN_COMMENT);
+            i = syn_block(s, n, i + 2, cls, &open);
+            if (open) return ASM_COMMENT;
+            continue;
+        }
+        if (c == '#' && j < n && (syn_digit(s[j]) || s[j] == '-')) {
+            // an ARM immediate
+            j = syn_number(s, n, j + 1);
+            syn_mark(cls, i, j, SYN_NUMBER);
+        } else if (c == '#' && first && j < n && syn_alpha(s[j])) {
+            // the C preprocessor, in .S files
+            while (j < n && syn_word(s[j])) ++j;
+            syn_mark(cls, i, j, SYN_PREPROC);
+        } else if ((c == '/' && j < n && s[j] == '/') || c == '#' || c == ';' ||
+                   (c == '@' && (j == n || s[j] == ' ' || s[j] == '\t'))) {
+            syn_mark(cls, i, n, SYN_COMMENT);
+            return 0;
+        } else if (c == '"' || c == '\'') {
+            j = syn_quote(s, n, i);
+            if (j < 0) j = n;
+            syn_mark(cls, i, j, SYN_STRING);
+        } else if ((c == '$' || c == '%') && j < n && syn_word(s[j])) {
+            // x86 registers, MIPS registers and immediates
+            int k = syn_digit(s[j]) && c == '$' ? SYN_NUMBER : SYN_VAR;
+            while (j < n && syn_word(s[j])) ++j;
+            syn_mark(cls, i, j, k);
+        } else if (syn_digit(c) || (c == '-' && j < n && syn_digit(s[j]))) {
+            j = syn_number(s, n, j);
+            if (j < n && s[j] == ':') syn_mark(cls, i, ++j, SYN_LABEL);
+            else syn_mark(cls, i, j, SYN_NUMBER);
+        } else if (syn_alpha(c) || c == '.') {
+            while (j < n && (syn_word(s[j]) || s[j] == '.' || s[j] == '$')) ++j;
+            if (j < n && s[j] == ':') {
+                syn_mark(cls, i, ++j, SYN_LABEL);
+            } else if (c == '.' || mnemonic) {
+                syn_mark(cls, i, j, c == '.' ? SYN_PREPROC : SYN_KEYWORD);
+                mnemonic = 0;
+            } else if (asm_register(s + i, j - i)) {
+                syn_mark(cls, i, j, SYN_VAR);
+            }
+        }
+        if (c != ' ' && c != '\t') first = 0;
+        i = j;
+    }
+    return 0;
+}
+
+// Lexes line y from state st and returns its end state; cls, if given, gets
+// the class of every byte. Only the first SYN_MAXCOL bytes count, so that a
+// line of megabytes costs no more than a screenful.
+static int syn_line(Editor *ed, int y, int st, unsigned char *cls) {
+    LineView lv;
+    char *join = NULL;
+    get_line(ed, y, &lv);
+    const char *s = lv.p[0];
+    int n = lv.n[0] + lv.n[1] < SYN_MAXCOL ? lv.n[0] + lv.n[1] : SYN_MAXCOL;
+    if (n > lv.n[0]) {
+        // only the line being edited has a gap
+        s = join = malloc(n);
+        memcpy(join, lv.p[0], lv.n[0]);
+        memcpy(join + lv.n[0], lv.p[1], n - lv.n[0]);
+    }
+    syn_mark(cls, 0, n, SYN_TEXT);
+    switch (ed->syn.lang) {
+    case LANG_C: st = lex_c(s, n, st, cls); break;
+    case LANG_MAKE: st = lex_make(s, n, st, cls); break;
+    case LANG_ASM: st = lex_asm(s, n, st, cls); break;
+    }
+    free(join);
+    return st;
+}
+// Records the end state e of line i. If it differs from the cached one, the
+// next line was lexed from a state that is gone.
+static void syn_set(Syntax *h, int i, int e) {
+    if (e != (h->st[i] & SYN_STATE) && i + 1 < h->len) h->st[i + 1] |= SYN_STALE;
+    h->st[i] = e;
+}
+// The lexer state at the start of line y. Only stale lines are lexed again;
+// once one ends as it did before, the lines after it stay current.
+static int syn_state(Editor *ed, int y) {
+    Syntax *h = &ed->syn;
+    int i, st;
+    if (y <= 0) return 0;
+    if (y > h->len + SYN_FAR) {
+        // like vim's syncing: assume a fresh state a little way above
+        st = 0;
+        for (i = y - SYN_BACK; i < y; ++i) st = syn_line(ed, i, st, NULL);
+        return st;
+    }
+    if (y > h->len) {
+        syn_reserve(h, y);
+        memset(h->st + h->len, SYN_STALE, y - h->len);
+        if (h->dirty > h->len) h->dirty = h->len;
+        h->len = y;
+    }
+    for (i = h->dirty; i < y; ++i)
+        if (h->st[i] & SYN_STALE) syn_set(h, i, syn_line(ed, i, i ? h->st[i - 1] & SYN_STATE : 0, NULL));
+    if (h->dirty < y) h->dirty = y;
+    return h->st[y - 1] & SYN_STATE;
+}
+// Colours the visible part [from, to) of line y, which starts at screen row
+// top, and returns the line's end state.
+static int syn_paint(Editor *ed, Screen *scr, int y, int st, int top, int from, int to, const int *map) {
+    Syntax *h = &ed->syn;
+    int n = line_length(ed, y), w = scr->cols;
+    if (n > SYN_MAXCOL) n = SYN_MAXCOL;
+    if (to > n) to = n;
+    if (n > h->cls_cap) {
+        h->cls_cap = n + 256;
+        h->cls = realloc(h->cls, h->cls_cap);
+    }
+    st = syn_line(ed, y, st, h->cls);
+    // lines are drawn in order from one whose state was current
+    if (y < h->len) {
+        syn_set(h, y, st);
+    } else if (y == h->len) {
+        syn_reserve(h, ++h->len);
+        h->st[y] = st;
+    }
+    if (y == h->dirty) h->dirty++;
+    for (int k = from; k < to; ++k) {
+        int c = map ? map[k - from] : k;
+        if (h->cls[k]) scr->cur[(top + c / w) * w + c % w].attr = ATTR_FG(syn_sgr[h->cls[k]] - 29);
+    }
+    return st;
+}
+
+// --- Screen: frames are built in a cell grid and only the damage is sent ---
+
+static void out(Screen *s, const char *p, int n) {
+    outbuf_append(&s->ob, p, n);
+}
+static void outf(Screen *s, const char *fmt, ...) {
+    char tmp[64];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    out(s, tmp, n);
+}
+static void clear_cells(Cell *c, int n) {
+    for (int i = 0; i < n; ++i) {
+        c[i].ch = ' ';
+        c[i].mark = 0;
+        c[i].attr = 0;
+    }
+}
+// Puts cp, w cells wide, in cell c of a row of cols cells. A wide one also
+// takes the cell after it, unless it is alone in a one-cell row.
+static void cell_put(Cell *row, int c, int cols, unsigned cp, int w, unsigned char attr) {
+    row[c].ch = glyph_of(cp);
+    row[c].mark = 0;
+    row[c].attr = attr;
+    if (w == 2 && c + 1 < cols) {
+        row[c + 1].ch = row[c + 1].mark = 0;
+        row[c + 1].attr = 0;
+    }
+}
+void screen_begin(Screen *s, int rows, int cols, int text_rows) {
+    if (rows != s->rows || cols != s->cols) {
+        free(s->cur);
+        free(s->prev);
+        s->rows = rows;
+        s->cols = cols;
+        s->cur = malloc(rows * cols * sizeof(Cell));
+        s->prev = malloc(rows * cols * sizeof(Cell));
+        s->valid = 0;
+    }
+    s->text_rows = text_rows;
+    clear_cells(s->cur, rows * cols);
+}
+// Puts the UTF-8 text p[0, n) on row r from column c, as much as fits.
+void screen_put(Screen *s, int r, int c, const char *p, int n, unsigned char attr) {
+    if (r < 0 || r >= s->rows) return;
+    Cell *row = s->cur + r * s->cols;
+    for (int i = 0, k, last = -1; i < n && c < s->cols; i += k) {
+        unsigned cp = (unsigned char)p[i];
+        if (cp < 0x80) {
+            row[c].ch = glyph_of(cp);
+            row[c].mark = 0;
+            row[c].attr = attr;
+            last = c++;
+            k = 1;
+            continue;
+        }
+        k = utf8_decode((const unsigned char *)p + i, n - i, &cp);
+        int w = char_width(cp);
+        if (!w && last >= 0) {
+            if (!row[last].mark) row[last].mark = cp;
+            continue;
+        }
+        if (c + w > s->cols && c) break;
+        if (!w) {
+            // a mark with nothing before it stands on a blank
+            cell_put(row, c, s->cols, ' ', 1, attr);
+            row[c].mark = cp;
+            w = 1;
+        } else {
+            cell_put(row, c, s->cols, cp, w, attr);
+        }
+        last = c;
+        c += w;
+    }
+}
+static void put_view(Screen *s, int r, const LineView *lv, int start, int len) {
+    int c = 0;
+    for (int k = 0; k < 2 && len > 0; ++k) {
+        if (start >= lv->n[k]) {
+            start -= lv->n[k];
+            continue;
+        }
+        int n = lv->n[k] - start < len ? lv->n[k] - start : len;
+        screen_put(s, r, c, lv->p[k] + start, n, 0);
+        c += n;
+        len -= n;
+        start = 0;
+    }
+}
+// Draws wide line lv from byte start, the first of its wrapped row row, on
+// screen rows r on while they last. s->map gets the cell of every byte
+// drawn, counted from the top of the line, and *rows the screen rows used;
+// returns the byte after the last one drawn.
+static int put_wide(Screen *s, int r, const LineView *lv, int start, int row, int *rows) {
+    int len = lv->n[0] + lv->n[1], w = s->cols, col = 0, at = start, top = r - row, cell = 0;
+    *rows = 0;
+    while (at < len) {
+        unsigned cp;
+        int n = view_char(lv, at, &cp), cw = char_width(cp);
+        if (at + n - start > s->map_cap) {
+            s->map_cap = (at + n - start) * 2 + 256;
+            s->map = realloc(s->map, s->map_cap * sizeof(int));
+        }
+        if (cw || !at) {
+            if (col + (cw ? cw : 1) > w && col) {
+                ++row;
+                col = 0;
+            }
+            if (top + row >= s->text_rows) break;
+            Cell *line = s->cur + (top + row) * w;
+            if (cw) {
+                cell_put(line, col, w, cp, cw, 0);
+            } else {
+                // a mark that starts the line stands on a blank
+                cell_put(line, col, w, ' ', 1, 0);
+                line[col].mark = cp;
+                cw = 1;
+            }
+            cell = row * w + col;
+            col += cw;
+            *rows = top + row - r + 1;
+        } else {
+            Cell *base = s->cur + top * w + cell;
+            if (!base->mark) base->mark = cp;
+        }
+        for (int k = 0; k < n; ++k) s->map[at - start + k] = cell;
+        at += n;
+    }
+    return at;
+}
+static unsigned long row_hash(Cell *c, int n) {
+    unsigned long h = 14695981039346656037UL;
+    for (int i = 0; i < n; ++i)
+        h = (h ^ (c[i].ch | (unsigned long)c[i].attr << 21 | (unsigned long)c[i].mark << 32)) * 1099511628211UL;
+    return h;
+}
+// If the text area moved up or down as a block, let the terminal scroll it.
+static void screen_scroll(Screen *s) {
+    int n = s->text_rows, w = s->cols, best = 0, best_hits = 0;
+    unsigned long hc[n], hp[n], blank;
+    Cell empty[w];
+    if (n < 3) return;
+    for (int i = 0; i < n; ++i) {
+        hc[i] = row_hash(s->cur + i * w, w);
+        hp[i] = row_hash(s->prev + i * w, w);
+    }
+    clear_cells(empty, w);
+    blank = row_hash(empty, w);
+    for (int i = 0; i < n; ++i)
+        if (hc[i] == hp[i] && hc[i] != blank) best_hits++;
+    for (int k = 1 - n; k < n; ++k) {
+        int hits = 0;
+        if (k == 0) continue;
+        for (int i = 0; i < n; ++i)
+            if (i + k >= 0 && i + k < n && hc[i] == hp[i + k] && hc[i] != blank) hits++;
+        if (hits > best_hits + 1) {
+            best_hits = hits;
+            best = k;
+        }
+    }
+    if (!best) return;
+    if (s->attr) { out(s, "\x1b[0m", 4); s->attr = 0; }
+    outf(s, "\x1b[1;%dr\x1b[%d%c\x1b[r", n, best > 0 ? best : -best, best > 0 ? 'S' : 'T');
+    s->crow = -1;
+    if (best > 0) {
+        memmove(s->prev, s->prev + best * w, (n - best) * w * sizeof(Cell));
+        clear_cells(s->prev + (n - best) * w, best * w);
+    } else {
+        memmove(s->prev - best * w, s->prev, (n + best) * w * sizeof(Cell));
+        clear_cells(s->prev, -best * w);
+    }
+}
+static int cell_eq(Cell a, Cell b) { return a.ch == b.ch && a.mark == b.mark && a.attr == b.attr; }
+// Sends the cells that differ from the previous frame, then parks the cursor.
+void screen_flush(Screen *s, int crow, int ccol) {
+    static const char sync_begin[] = "\x1b[?2026h", sync_end[] = "\x1b[?2026l";
+    int w = s->cols;
+    s->ob.length = 0;
+    out(s, sync_begin, sizeof(sync_begin) - 1);
+    if (!s->valid) {
+        out(s, "\x1b[0m\x1b[H\x1b[2J", 11);
+        clear_cells(s->prev, s->rows * w);
+        s->attr = 0;
+        s->crow = s->ccol = 0;
+        s->valid = 1;
+    } else {
+        screen_scroll(s);
+    }
+    for (int r = 0; r < s->rows; ++r) {
+        Cell *cur = s->cur + r * w, *prev = s->prev + r * w;
+        int c = 0;
+        if (!memcmp(cur, prev, w * sizeof(Cell))) continue;
+        while (c < w) {
+            if (cell_eq(cur[c], prev[c])) { c++; continue; }
+            // extend the run over short stretches of unchanged cells
+            int end = c + 1, last = c;
+            while (end < w && end - last <= 4) {
+                if (!cell_eq(cur[end], prev[end])) last = end;
+                end++;
+            }
+            if (s->crow != r || s->ccol != c) outf(s, "\x1b[%d;%dH", r + 1, c + 1);
+            for (int i = c; i <= last; ++i) {
+                // the right half of a wide character went out with it
+                if (!cur[i].ch) continue;
+                if (cur[i].attr != s->attr) {
+                    int fg = cur[i].attr >> 4;
+                    if (!cur[i].attr) out(s, "\x1b[0m", 4);
+                    else if (cur[i].attr == ATTR_REVERSE && !s->attr) out(s, "\x1b[7m", 4);
+                    else if (fg) outf(s, "\x1b[0;%s%dm", cur[i].attr & ATTR_REVERSE ? "7;" : "", 29 + fg);
+                    else out(s, "\x1b[0;7m", 6);
+                    s->attr = cur[i].attr;
+                }
+                char u[8];
+                int k = utf8_encode(cur[i].ch, u);
+                if (cur[i].mark) k += utf8_encode(cur[i].mark, u + k);
+                out(s, u, k);
+            }
+            end = last + 1 < w && !cur[last + 1].ch ? last + 2 : last + 1;
+            s->crow = end < w ? r : -1;
+            s->ccol = end;
+            c = last + 1;
+        }
+    }
+    if (s->crow != crow || s->ccol != ccol) outf(s, "\x1b[%d;%dH", crow + 1, ccol + 1);
+    s->crow = crow;
+    s->ccol = ccol;
+    // the terminal presents the frame at once; an unchanged frame sends nothing
+    s->frame_bytes = 0;
+    if (s->ob.length > (long)sizeof(sync_begin) - 1) {
+        out(s, sync_end, sizeof(sync_end) - 1);
+        if (headless.sink) outbuf_append(headless.sink, s->ob.data, s->ob.length);
+        else write_all(STDOUT_FILENO, s->ob.data, s->ob.length);
+        s->frame_bytes = s->ob.length;
+    }
+    Cell *t = s->prev;
+    s->prev = s->cur;
+    s->cur = t;
+    s->total_bytes += s->frame_bytes;
+    s->frames++;
+}
+
+// Screen row of the top of the viewport, after clamping it to the text.
+long view_row(Editor *ed) {
+    if (ed->top >= ed->num_lines) ed->top = ed->num_lines - 1;
+    if (ed->top < 0) ed->top = 0;
+    LineView lv;
+    get_line(ed, ed->top, &lv);
+    int rows = view_rows(&lv, ed->rows_width);
+    if (ed->top_sub >= rows) ed->top_sub = rows - 1;
+    if (ed->top_sub < 0) ed->top_sub = 0;
+    return rows_before(ed, ed->top) + ed->top_sub;
+}
+// Moves the viewport by delta rows and pulls the cursor along if it left it.
+void scroll_view(Editor *ed, long delta) {
+    int w = get_terminal_width(), textrows = get_terminal_height() - 2;
+    if (textrows < 1) textrows = 1;
+    ensure_rows(ed, w);
+    long toprow = view_row(ed) + delta, total = piece_rows(ed->root);
+    if (toprow > total - 1) toprow = total - 1;
+    if (toprow < 0) toprow = 0;
+    ed->top = line_at_row(ed, toprow, &ed->top_sub);
+    long crow;
+    int ccol, sub;
+    LineView lv;
+    get_screen_cursor(ed, &crow, &ccol, w);
+    if (crow < toprow) {
+        ed->cy = ed->top;
+        get_line(ed, ed->cy, &lv);
+        ed->cx = view_at(&lv, w, ed->top_sub, 0);
+    } else if (crow >= toprow + textrows) {
+        ed->cy = line_at_row(ed, toprow + textrows - 1, &sub);
+        get_line(ed, ed->cy, &lv);
+        ed->cx = view_at(&lv, w, sub, 0);
+    }
+}
+
+// --- Latency: key-to-paint times ---
+
+static double lat_bound(int b) {
+    return 16e-6 * (1L << b);
+}
+void latency_key(Latency *l, double at) {
+    int i = l->npending - 1;
+    if (i < 0 || (l->pending[i] != at && i + 1 < LAT_PENDING)) {
+        l->pending[++i] = at;
+        l->count[i] = 0;
+        l->npending = i + 1;
+    }
+    l->count[i]++;
+}
+// The frame painted at t shows every key handled since the last one.
+void latency_paint(Latency *l, double t) {
+    for (int i = 0; i < l->npending; ++i) {
+        double d = t - l->pending[i];
+        int b = 0;
+        while (b < LAT_BUCKETS - 1 && d >= lat_bound(b)) ++b;
+        l->hist[b] += l->count[i];
+        l->keys += l->count[i];
+        if (d > l->max) l->max = d;
+    }
+    if (l->npending) l->frames++;
+    l->npending = 0;
+}
+// Upper bound of the bucket holding the q-th quantile.
+static double latency_quantile(Latency *l, double q) {
+    long want = (long)(q * l->keys), seen = 0;
+    for (int b = 0; b < LAT_BUCKETS; ++b)
+        if ((seen += l->hist[b]) > want) return lat_bound(b) < l->max ? lat_bound(b) : l->max;
+    return l->max;
+}
+// :latency - the histogram, shown over the text
+void show_latency(Editor *ed) {
+    Latency *l = &ed->lat;
+    OutBuf *o = &ed->overlay;
+    char line[128];
+    long most = 1;
+    int lo = LAT_BUCKETS, hi = 0;
+    for (int b = 0; b < LAT_BUCKETS; ++b) {
+        if (!l->hist[b]) continue;
+        if (l->hist[b] > most) most = l->hist[b];
+        if (b < lo) lo = b;
+        hi = b;
+    }
+    o->length = 0;
+    int n = snprintf(line, sizeof(line), "key-to-paint latency: %ld keys in %ld frames\n", l->keys, l->frames);
+    outbuf_append(o, line, n);
+    for (int b = lo; b <= hi; ++b) {
+        n = snprintf(line, sizeof(line), "  < %9.3f ms %8ld ", lat_bound(b) * 1e3, l->hist[b]);
+        int bar = (int)(l->hist[b] * 40 / most);
+        memset(line + n, '#', bar);
+        line[n + bar] = '\n';
+        outbuf_append(o, line, n + bar + 1);
+    }
+    n = snprintf(line, sizeof(line), "p50 <= %.3f ms  p90 <= %.3f ms  p99 <= %.3f ms  max %.3f ms\n",
+                 latency_quantile(l, 0.5) * 1e3, latency_quantile(l, 0.9) * 1e3,
+                 latency_quantile(l, 0.99) * 1e3, l->max * 1e3);
+    outbuf_append(o, line, n);
+}
+
+#define HL_BACK 1024    // a regex match starting further above the screen is not shown
+
+void draw(Editor *ed) {
+    int termwidth = get_terminal_width();
+    int termheight = get_terminal_height();
+    Screen *scr = &ed->scr;
+    Regex live, *hl = NULL;
+    long crow;
+    int ccol, sub;
+    if (termheight < 3) termheight = 3;
+    screen_begin(scr, termheight, termwidth, termheight-2);
+    get_screen_cursor(ed, &crow, &ccol, termwidth);
+    long toprow = view_row(ed);
+    // scroll just enough to keep the cursor on screen
+    if (crow < toprow) {
+        toprow = crow;
+        ed->top = line_at_row(ed, toprow, &ed->top_sub);
+    } else if (crow >= toprow + termheight-2) {
+        toprow = crow - (termheight-2) + 1;
+        ed->top = line_at_row(ed, toprow, &ed->top_sub);
+    }
+    if (ed->mode == MODE_SEARCH && ed->search[0]) {
+        if (!re_compile(&live, ed->search)) hl = &live;
+    } else if (ed->mode == MODE_NORMAL && ed->search_found) {
+        hl = &ed->re;
+    }
+    int first = ed->top, syn = ed->syn.lang ? syn_state(ed, first) : 0;
+    sub = ed->top_sub;
+    int screenrow = 0;
+    for (int i = first; i < ed->num_lines && screenrow < termheight-2; ++i) {
+        LineView lv;
+        get_line(ed, i, &lv);
+        int linelen = lv.n[0] + lv.n[1], row = i == first ? sub : 0, top = screenrow - row;
+        int start = row * termwidth, vis = start, used;
+        const int *map = NULL;
+        if (lv.wide) {
+            // laid out a character at a time; map takes bytes to cells
+            vis = row ? view_at(&lv, termwidth, row, 0) : 0;
+            start = put_wide(scr, screenrow, &lv, vis, row, &used);
+            screenrow += used;
+            map = scr->map;
+        }
+        while (!map && start < linelen && screenrow < termheight-2) {
+            int seglen = linelen-start;
+            if (seglen > termwidth)
+                seglen = termwidth;
+            put_view(scr, screenrow, &lv, start, seglen);
+            start += seglen;
+            screenrow++;
+        }
+        if (ed->syn.lang) syn = syn_paint(ed, scr, i, syn, top, vis, start, map);
+        if (hl) {
+            // reverse the matches on the visible rows of this line, looking
+            // back a little for one that runs into them; a match starting
+            // on them is looked for no further than it could reach
+            int span = hl->literal ? hl->lit.m - 1 : HL_BACK;
+            int len, from = vis - span, to = start + span;
+            if (from < 0) from = 0;
+            for (int f = re_find_to(hl, &lv, from, to, &len); f >= 0 && f < start; f = re_find_to(hl, &lv, f + (len ? len : 1), to, &len)) {
+                for (int k = f; k < f + len; ++k) {
+                    if (map && (k < vis || k >= start)) continue;
+                    int c = map ? map[k - vis] : k, r = top + c / termwidth;
+                    if (r >= 0 && r < termheight-2)
+                        scr->cur[r * termwidth + c % termwidth].attr |= ATTR_REVERSE;
+                }
+            }
+        }
+        if (linelen == 0 && screenrow < termheight-2) {
+            screenrow++;
+        }
+    }
+    // a report such as :latency covers the text until the next key
+    for (long i = 0, r = 0; i < ed->overlay.length && r < termheight-2; ++r) {
+        const char *p = ed->overlay.data + i, *nl = memchr(p, '\n', ed->overlay.length - i);
+        int len = nl ? (int)(nl - p) : (int)(ed->overlay.length - i);
+        clear_cells(scr->cur + r * termwidth, termwidth);
+        screen_put(scr, r, 0, p, len, 0);
+        i += len + 1;
+    }
+    const char *mode_str = (ed->mode == MODE_INSERT) ? "INSERT"
+                          : (ed->mode == MODE_COMMAND) ? "COMMAND"
+                          : (ed->mode == MODE_NORMAL) ? "NORMAL"
+                          : "SEARCH";
+    char status[512];
+    int n = snprintf(status, sizeof(status), "---- %s MODE ----", mode_str);
+    if (ed->mode == MODE_COMMAND) n += snprintf(status+n, sizeof(status)-n, ":%s", ed->command);
+    if (ed->mode == MODE_SEARCH) n += snprintf(status+n, sizeof(status)-n, "/%s", ed->search);
+    if (indexing(ed)) n += snprintf(status+n, sizeof(status)-n, "  [%d lines...]", ed->num_lines);
+    if (ed->job.applied && ed->search_found)
+        n += snprintf(status+n, sizeof(status)-n, "  [%ld of %ld%s]",
+                      __atomic_load_n(&ed->job.before, __ATOMIC_RELAXED) + 1,
+                      __atomic_load_n(&ed->job.total, __ATOMIC_RELAXED), ed->job.active ? "..." : "");
+    else if (ed->job.active)
+        n += snprintf(status+n, sizeof(status)-n, "  [searching...]");
+    if (ed->message[0]) n += snprintf(status+n, sizeof(status)-n, "  %s", ed->message);
+    screen_put(scr, termheight-2, 0, status, n, 0);
+    screen_flush(scr, (int)(crow - toprow), ccol);
+    if (hl == &live) re_free(&live);
+}
+
+// --------- CHANGED: c == '\n' to c == '\n' || c == '\r' everywhere ---------
+
+// The arrows, Home, End, the page keys and Delete, the same in insert and
+// normal mode. Left, right and Delete take whole characters; up and down
+// keep the display column.
+static int edit_key(Editor *ed, int c) {
+    LineView lv;
+    get_line(ed, ed->cy, &lv);
+    int len = lv.n[0] + lv.n[1];
+    int page = get_terminal_height() - 4;
+    if (page < 1) page = 1;
+    if (c == KEY_ARROW_LEFT) {
+        ed->cx = view_prev(&lv, ed->cx);
+    } else if (c == KEY_ARROW_RIGHT) {
+        ed->cx = view_next(&lv, ed->cx);
+    } else if (c == KEY_ARROW_DOWN || c == KEY_ARROW_UP) {
+        int y = ed->cy + (c == KEY_ARROW_DOWN ? 1 : -1), col = view_col(&lv, ed->cx);
+        if (y < 0 || y >= ed->num_lines) return 1;
+        ed->cy = y;
+        get_line(ed, y, &lv);
+        ed->cx = view_at(&lv, INT_MAX, 0, col);
+    } else if (c == KEY_HOME) {
+        ed->cx = 0;
+    } else if (c == KEY_END) {
+        ed->cx = len;
+    } else if (c == KEY_PAGE_UP || c == KEY_PAGE_DOWN) {
+        scroll_view(ed, c == KEY_PAGE_DOWN ? page : -page);
+    } else if (c == KEY_DELETE) {
+        if (ed->cx < len)
+            for (int k = view_next(&lv, ed->cx) - ed->cx; k > 0; --k) delete_char(ed, ed->cy, ed->cx + 1);
+        else if (ed->cy + 1 < ed->num_lines) join_line(ed, ed->cy);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+// A bracketed paste arrives as one key and goes in as one edit. Terminals
+// send line ends as CR; they become newlines.
+void process_paste(Editor *ed) {
+    OutBuf *p = &input.paste;
+    long n = 0;
+    for (long i = 0; i < p->length; ++i) {
+        if (p->data[i] == '\r') {
+            p->data[n++] = '\n';
+            if (i + 1 < p->length && p->data[i + 1] == '\n') ++i;
+        } else {
+            p->data[n++] = p->data[i];
+        }
+    }
+    if (ed->mode == MODE_COMMAND || ed->mode == MODE_SEARCH) {
+        char *line = ed->mode == MODE_COMMAND ? ed->command : ed->search;
+        int len = strlen(line);
+        for (long i = 0; i < n && len < 120; ++i)
+            if (p->data[i] >= 32 && p->data[i] < 127) line[len++] = p->data[i];
+        line[len] = 0;
+        return;
+    }
+    if (!n) return;
+    insert_text(ed, ed->cy, ed->cx, p->data, n);
+    text_end(ed->cy, ed->cx, p->data, n, &ed->cy, &ed->cx);
+}
+// A click puts the cursor where it points; the wheel scrolls.
+void process_mouse(Editor *ed) {
+    int w = get_terminal_width(), sub;
+    if (ed->mode != MODE_INSERT && ed->mode != MODE_NORMAL) return;
+    if (input.mouse_button == 64 || input.mouse_button == 65) {
+        scroll_view(ed, input.mouse_button == 64 ? -3 : 3);
+    } else if (input.mouse_button == 0 && input.mouse_press && input.mouse_y < get_terminal_height() - 2) {
+        ensure_rows(ed, w);
+        long row = view_row(ed) + input.mouse_y;
+        if (row >= piece_rows(ed->root)) return;
+        LineView lv;
+        ed->cy = line_at_row(ed, row, &sub);
+        get_line(ed, ed->cy, &lv);
+        ed->cx = view_at(&lv, w, sub, input.mouse_x);
+    }
+}
+// Keys come a byte at a time, so a UTF-8 character goes in as its bytes.
+void process_insert(Editor *ed, int c) {
+    if (c == 27) { // ESC
+        ed->mode = MODE_NORMAL;
+        return;
+    }
+    if (edit_key(ed, c)) return;
+    if (c == 127 || c == 8) { // Backspace
+        if (ed->cx > 0) {
+            LineView lv;
+            get_line(ed, ed->cy, &lv);
+            for (int to = view_prev(&lv, ed->cx); ed->cx > to; ed->cx--)
+                delete_char(ed, ed->cy, ed->cx);
+        } else if (ed->cy > 0) {
+            int prevlen = line_length(ed, ed->cy-1);
+            join_line(ed, ed->cy-1);
+            ed->cy--;
+            ed->cx = prevlen;
+        }
+    } else if (c == '\n' || c == '\r') {
+        split_line(ed, ed->cy, ed->cx);
+        ed->cy++; ed->cx = 0;
+    } else if ((c >= 32 && c < 127) || (c >= 128 && c < 256)) {
+        insert_char(ed, ed->cy, ed->cx, c);
+        ed->cx++;
+    }
+}
+
+// --- :s ---
+
+// Makes pat the search pattern; on error the old one stays.
+int set_search(Editor *ed, const char *pat) {
+    Regex re;
+    const char *err = re_compile(&re, pat);
+    if (err) {
+        snprintf(ed->message, sizeof(ed->message), "%s: %s", err, pat);
+        return 0;
+    }
+    re_free(&ed->re);
+    ed->re = re;
+    snprintf(ed->pattern, sizeof(ed->pattern), "%s", pat);
+    return 1;
+}
+// A line address: a number, ., $ or '{a-z} for the line of a mark.
+static const char *parse_addr(Editor *ed, const char *p, int *y) {
+    if (*p == '.') {
+        *y = ed->cy;
+        return p + 1;
+    }
+    if (*p == '$') {
+        finish_index(ed);
+        *y = ed->num_lines - 1;
+        return p + 1;
+    }
+    if (*p >= '0' && *p <= '9') {
+        char *end;
+        *y = (int)strtol(p, &end, 10) - 1;
+        return end;
+    }
+    if (*p == '\'' && p[1] >= 'a' && p[1] <= 'z' && ed->marks.named[p[1] - 'a']) {
+        int x;
+        mark_get(ed->marks.named[p[1] - 'a'], y, &x);
+        return p + 2;
+    }
+    return p;
+}
+// % for every line, or one or two addresses. Without either p is returned
+// as it is, and the range is the cursor line.
+static const char *parse_range(Editor *ed, const char *p, int *y0, int *y1) {
+    *y0 = *y1 = ed->cy;
+    if (*p == '%') {
+        finish_index(ed);
+        *y0 = 0;
+        *y1 = ed->num_lines - 1;
+        return p + 1;
+    }
+    const char *q = parse_addr(ed, p, y0);
+    if (q == p) return p;
+    *y1 = *y0;
+    return *q == ',' ? parse_addr(ed, q + 1, y1) : q;
+}
+#define SUBST_CHUNK 8192        // fewest lines a worker takes at a time
+#define SUBST_THREADS 64
+
+// Worker threads for :s, 0 for one per online CPU.
+static int subst_threads;
+
+// Consecutive changed lines found by a worker, and their new text with the
+// lines joined by newlines.
+typedef struct {
+    int y, count;
+    long new_at, new_len;
+} SubstRun;
+
+typedef struct {
+    int y0, y1;         // lines [y0, y1) of the snapshot
+    OutBuf text;
+    SubstRun *runs;
+    int nruns, cap;
+    Piece **pieces;     // one for each changed line, in order
+    Slab slab;          // their text
+    long subs;
+    int lines;
+} SubstChunk;
+
+// A substitute over a snapshot of the range. Workers take chunks in turn
+// and only ever write to their own.
+typedef struct {
+    Snapshot snap;
+    const char *pat, *rep;
+    int global;
+    int width;          // ed->rows_width, for the rows of new pieces
+    SubstChunk *chunks;
+    int nchunks;
+    int next;           // first chunk nobody has taken
+} SubstJob;
+
+// Substitutes in one line, appending its new text to out. Returns how many
+// substitutions were made.
+static int subst_line(Regex *re, const LineView *lv, const char *rep, int global, OutBuf *out) {
+    int n = lv->n[0] + lv->n[1], len, x, k = 0, from = 0, done = 0, prev = -1;
+    while (from <= n && (x = re_find(re, lv, from, &len)) >= 0) {
+        // no empty match right where the previous one ended
+        if (len == 0 && x == prev) {
+            from = x + 1;
+            continue;
+        }
+        view_append(out, lv, done, x - done);
+        for (const char *r = rep; *r; ++r) {
+            if (*r == '&') {
+                view_append(out, lv, x, len);
+                continue;
+            }
+            if (*r == '\\' && r[1]) ++r;
+            outbuf_append(out, r, 1);
+        }
+        done = prev = x + len;
+        ++k;
+        if (!global) break;
+        from = len ? x + len : x + 1;
+    }
+    if (k) view_append(out, lv, done, n - done);
+    return k;
+}
+// Chunk buffers can hold much of the file: they grow by half rather than by
+// outbuf_append's fixed step.
+static void subst_reserve(OutBuf *b, long n) {
+    if (b->length + n < b->alloced) return;
+    b->alloced = (b->length + n) * 3 / 2 + 4096;
+    b->data = realloc(b->data, b->alloced);
+}
+// A piece for a changed line, made on a worker from its own slab. It gets
+// its priority when it is spliced in, as piece_rand is not thread safe.
+static Piece *subst_piece(Slab *sl, const char *s, int n, int width) {
+    Piece *p = calloc(1, sizeof(Piece));
+    p->first = -1;
+    p->count = 1;
+    if (n) {
+        p->gb.buf = slab_take(sl, n);
+        p->gb.buf_size = p->gb.gap_end = slab_round(n);
+        memcpy(p->gb.buf, s, n);
+        p->gb.gap_start = n;
+        p->gb.wide = ascii_run(s, n) < n;
+    }
+    LineView lv = { { s, "" }, { n, 0 }, p->gb.wide, NULL };
+    p->rows = width ? view_rows(&lv, width) : 0;
+    piece_update(p);
+    return p;
+}
+static void *subst_worker(void *arg) {
+    SubstJob *j = arg;
+    Snapshot s = j->snap;       // shares the runs but not the lookup hint
+    Regex re;
+    LineView lv;
+    int c;
+    re_compile(&re, j->pat);
+    while ((c = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->nchunks) {
+        SubstChunk *ch = &j->chunks[c];
+        int r = -1;
+        for (int y = ch->y0; y < ch->y1; ++y) {
+            long at = ch->text.length;
+            snap_line(&s, y, &lv);
+            subst_reserve(&ch->text, 2L * (lv.n[0] + lv.n[1]) + 64);
+            if (r >= 0) outbuf_append(&ch->text, "\n", 1);
+            long from = ch->text.length;
+            int k = subst_line(&re, &lv, j->rep, j->global, &ch->text);
+            if (!k) {
+                ch->text.length = at;
+                r = -1;
+                continue;
+            }
+            if (r < 0) {
+                if (ch->nruns == ch->cap) {
+                    ch->cap = ch->cap ? ch->cap * 2 : 64;
+                    ch->runs = realloc(ch->runs, ch->cap * sizeof(SubstRun));
+                }
+                r = ch->nruns++;
+                ch->runs[r] = (SubstRun){ .y = y, .new_at = at };
+            }
+            if (ch->lines % 1024 == 0) ch->pieces = realloc(ch->pieces, (ch->lines + 1024) * sizeof(Piece *));
+            ch->pieces[ch->lines] = subst_piece(&ch->slab, ch->text.data + from, (int)(ch->text.length - from), j->width);
+            SubstRun *run = &ch->runs[r];
+            run->count++;
+            run->new_len = ch->text.length - run->new_at;
+            ch->subs += k;
+            ch->lines++;
+        }
+    }
+    re_free(&re);
+    return NULL;
+}
+// The old text of a run: in place if it is consecutive loaded lines, else
+// joined into buf.
+static const char *subst_old(Snapshot *s, SubstRun *run, OutBuf *buf, long *n) {
+    LineView lv;
+    snap_line(s, run->y, &lv);
+    SnapRun *sr = &s->runs[s->hint];
+    if (sr->first >= 0 && run->y + run->count <= sr->line + sr->count) {
+        long a = orig_off(s->orig, sr->first + run->y - sr->line);
+        *n = orig_off(s->orig, sr->first + run->y + run->count - sr->line) - a - 1;
+        return s->orig->data + a;
+    }
+    buf->length = 0;
+    for (int y = run->y; y < run->y + run->count; ++y) {
+        snap_line(s, y, &lv);
+        subst_reserve(buf, lv.n[0] + lv.n[1] + 1);
+        if (y > run->y) outbuf_append(buf, "\n", 1);
+        view_append(buf, &lv, 0, lv.n[0] + lv.n[1]);
+    }
+    *n = buf->length;
+    return buf->data;
+}
+static void piece_list(Piece *t, Piece ***v, int *n, int *cap) {
+    if (!t) return;
+    piece_list(t->left, v, n, cap);
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *v = realloc(*v, *cap * sizeof(Piece *));
+    }
+    (*v)[(*n)++] = t;
+    piece_list(t->right, v, n, cap);
+}
+// Appends p, at line y, to the pieces of a spliced range. A changed line
+// that reads as the loaded line the run before it would go on with (one
+// substitute undone by another, say) becomes that loaded line again, and
+// consecutive loaded lines are kept as one run.
+static void subst_push(Editor *ed, Piece **v, int *n, Piece *p, int y) {
+    Piece *q = *n ? v[*n - 1] : NULL;
+    if (p->first < 0) {
+        int g = q && q->first >= 0 ? q->first + q->count : y;
+        GapBuf *gb = &p->gb;
+        int n0 = gb->gap_start, n1 = gb->buf_size - gb->gap_end;
+        if (g < ed->loaded) {
+            const char *s = ed->orig.data + orig_off(&ed->orig, g);
+            if (orig_off(&ed->orig, g + 1) - orig_off(&ed->orig, g) - 1 == n0 + n1 &&
+                !memcmp(gb->buf, s, n0) && !memcmp(gb->buf + gb->gap_end, s + n0, n1)) {
+                free_gapbuf(gb);
+                p->first = g;
+                if (ed->open == p) ed->open = NULL;
+            }
+        }
+    }
+    if (q && q->first >= 0 && p->first >= 0 && q->first + q->count == p->first) {
+        q->count += p->count;
+        q->rows += p->rows;
+        free(p);
+        return;
+    }
+    v[(*n)++] = p;
+}
+// Rebuilds the pieces of the range around the pieces the workers made, in
+// O(pieces): unchanged runs of loaded lines stay references to the loaded
+// text.
+static Piece *subst_splice(Editor *ed, Piece *m, int y0, SubstJob *j) {
+    Piece **old = NULL, **v = NULL;
+    int nold = 0, cap = 0, n = 0, line = 0;
+    piece_list(m, &old, &nold, &cap);
+    ed->edits++;
+    cap = nold + 1;
+    v = malloc(cap * sizeof(Piece *));
+    // the next changed line, y, is line i of run r of chunk c, and its
+    // piece is that chunk's at
+    int c = 0, r = 0, i = 0, at = 0, y = INT_MAX;
+    for (; c < j->nchunks && !j->chunks[c].nruns; ++c) {}
+    if (c < j->nchunks) y = j->chunks[c].runs[0].y;
+    for (int k = 0; k < nold; ++k) {
+        Piece *t = old[k];
+        int end = line + t->count, u = line;
+        t->left = t->right = NULL;
+        if (n + 1 >= cap) v = realloc(v, (cap *= 2) * sizeof(Piece *));
+        if (y >= end) {
+            subst_push(ed, v, &n, t, y0 + line);
+            line = end;
+            continue;
+        }
+        while (y < end) {
+            SubstChunk *ch = &j->chunks[c];
+            if (n + 2 >= cap) v = realloc(v, (cap *= 2) * sizeof(Piece *));
+            if (t->first >= 0 && y > u) subst_push(ed, v, &n, make_piece(ed, t->first + u - line, y - u), y0 + u);
+            ch->pieces[at]->prio = piece_rand();
+            subst_push(ed, v, &n, ch->pieces[at++], y0 + y);
+            syn_changed(ed, y0 + y);
+            u = y + 1;
+            if (++i < ch->runs[r].count) {
+                y++;
+                continue;
+            }
+            i = 0;
+            if (++r == ch->nruns) {
+                r = at = 0;
+                for (++c; c < j->nchunks && !j->chunks[c].nruns; ++c) {}
+            }
+            y = c < j->nchunks ? j->chunks[c].runs[r].y : INT_MAX;
+        }
+        if (t->first >= 0 && u < end) {
+            if (n + 1 >= cap) v = realloc(v, (cap *= 2) * sizeof(Piece *));
+            subst_push(ed, v, &n, make_piece(ed, t->first + u - line, end - u), y0 + u);
+        }
+        // t has been cut up, or replaced if it was an edited line
+        if (ed->open == t) ed->open = NULL;
+        if (t->first < 0) free_gapbuf(&t->gb);
+        free(t);
+        line = end;
+    }
+    m = piece_build(v, n);
+    free(old);
+    free(v);
+    return m;
+}
+// :[range]s/pat/rep/[g] - & in rep is the matched text, and an empty pat
+// reuses the last search. Returns 0 if cmd is not a substitute command.
+int substitute(Editor *ed, const char *cmd) {
+    int y0, y1, global = 0;
+    const char *p = parse_range(ed, cmd, &y0, &y1);
+    char delim = p[0] == 's' ? p[1] : 0;
+    if (!delim || delim == ' ' || delim == '\\' || (delim >= '0' && delim <= '9') ||
+        ((delim | 0x20) >= 'a' && (delim | 0x20) <= 'z'))
+        return 0;
+    char pat[128], rep[128];
+    int n = 0;
+    for (p += 2; *p && *p != delim; pat[n++] = *p++)
+        if (*p == '\\' && p[1]) {
+            // \delim is the delimiter itself, other escapes belong to the regex
+            if (p[1] == delim) p++;
+            else pat[n++] = *p++;
+        }
+    pat[n] = 0;
+    n = 0;
+    if (*p) p++;
+    for (; *p && *p != delim; rep[n++] = *p++)
+        if (*p == '\\' && p[1]) {
+            if (p[1] == delim) p++;
+            else rep[n++] = *p++;
+        }
+    rep[n] = 0;
+    if (*p) p++;
+    for (; *p; ++p) {
+        if (*p != 'g') {
+            snprintf(ed->message, sizeof(ed->message), "Trailing characters: %s", p);
+            return 1;
+        }
+        global = 1;
+    }
+    if (y0 > y1) {
+        int t = y0;
+        y0 = y1;
+        y1 = t;
+    }
+    if (y0 < 0 || y1 >= ed->num_lines) {
+        snprintf(ed->message, sizeof(ed->message), "Invalid range");
+        return 1;
+    }
+    if (pat[0] && !set_search(ed, pat)) return 1;
+    if (!ed->re.fwd.prog) {
+        snprintf(ed->message, sizeof(ed->message), "No previous pattern");
+        return 1;
+    }
+    // the range is split out of the tree, worked on by every thread from a
+    // snapshot, and spliced back in one step
+    int count = y1 + 1 - y0, threads = subst_threads ? subst_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > SUBST_THREADS) threads = SUBST_THREADS;
+    int size = count / (threads * 4) > SUBST_CHUNK ? count / (threads * 4) : SUBST_CHUNK;
+    Piece *a, *m, *c;
+    piece_split(ed, ed->root, y0, &a, &m);
+    piece_split(ed, m, count, &m, &c);
+    SubstJob j = { .pat = ed->pattern, .rep = rep, .global = global, .width = ed->rows_width };
+    j.snap.orig = &ed->orig;
+    snap_add(&j.snap, m);
+    j.nchunks = (count + size - 1) / size;
+    j.chunks = calloc(j.nchunks, sizeof(SubstChunk));
+    for (int k = 0; k < j.nchunks; ++k) {
+        j.chunks[k].y0 = k * size;
+        j.chunks[k].y1 = k * size + size < count ? k * size + size : count;
+    }
+    if (threads > j.nchunks) threads = j.nchunks;
+    pthread_t tid[SUBST_THREADS];
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&tid[started], NULL, subst_worker, &j) == 0) started++;
+    subst_worker(&j);
+    for (int k = 0; k < started; ++k) pthread_join(tid[k], NULL);
+    // one undo group, in which each run of changed lines is replaced whole
+    OutBuf old = {0};
+    long subs = 0;
+    int lines = 0, last = -1;
+    for (int k = 0; k < j.nchunks; ++k) {
+        SubstChunk *ch = &j.chunks[k];
+        for (int r = 0; r < ch->nruns; ++r) {
+            SubstRun *run = &ch->runs[r];
+            long n;
+            const char *s = subst_old(&j.snap, run, &old, &n);
+            undo_record(ed, UNDO_DEL, y0 + run->y, 0, s, n);
+            undo_record(ed, UNDO_INS, y0 + run->y, 0, ch->text.data + run->new_at, run->new_len);
+            last = y0 + run->y + run->count - 1;
+        }
+        free(ch->text.data);
+        slab_merge(&ch->slab);
+        subs += ch->subs;
+        lines += ch->lines;
+    }
+    free(old.data);
+    snap_free(&j.snap);
+    if (lines) m = subst_splice(ed, m, y0, &j);
+    ed->root = piece_merge(a, piece_merge(m, c));
+    for (int k = 0; k < j.nchunks; ++k) {
+        free(j.chunks[k].runs);
+        free(j.chunks[k].pieces);
+    }
+    free(j.chunks);
+    if (last < 0) {
+        snprintf(ed->message, sizeof(ed->message), "Pattern not found");
+        return 1;
+    }
+    jump_push(ed);
+    ed->cy = last;
+    ed->cx = 0;
+    snprintf(ed->message, sizeof(ed->message), "%ld substitutions on %d lines", subs, lines);
+    return 1;
+}
+
+// --- :! and :r ! : text streamed through a shell command ---
+
+#define FILTER_PIPE (1 << 20)   // pipe size asked for, each way
+
+// Feeds the lines of a range to a command from a thread of its own, while
+// the editor reads what comes back, so neither side of the pipes can fill
+// up and stall the other. The range is split out of the tree meanwhile and
+// nothing else touches it.
+typedef struct {
+    int fd;             // the command's stdin
+    OrigText *orig;
+    Piece *range;
+    struct iovec iov[SAVE_IOV];
+    int n;
+    int err;
+} FilterFeed;
+
+static void feed_flush(FilterFeed *f) {
+    if (f->n && !f->err && writev_all(f->fd, f->iov, f->n) < 0) f->err = errno;
+    f->n = 0;
+}
+static void feed_put(FilterFeed *f, const char *p, long n) {
+    if (n <= 0) return;
+    f->iov[f->n].iov_base = (char *)p;
+    f->iov[f->n].iov_len = n;
+    if (++f->n == SAVE_IOV) feed_flush(f);
+}
+// The loaded text never changes, so the pipe can take references to its
+// pages rather than a copy; where vmsplice is missing it is written.
+static void feed_splice(FilterFeed *f, const char *p, long n) {
+    feed_flush(f);
+#ifdef __linux__
+    while (n > 0 && !f->err) {
+        struct iovec v = { (char *)p, n };
+        ssize_t k = vmsplice(f->fd, &v, 1, 0);
+        if (k < 0 && errno == EINTR) continue;
+        if (k < 0) {
+            if (errno == EPIPE) f->err = errno;
+            break;
+        }
+        p += k;
+        n -= k;
+    }
+#endif
+    if (n > 0 && !f->err && write_all(f->fd, p, n) < 0) f->err = errno;
+}
+// Like save_pieces: a run of loaded lines goes as one segment.
+static void feed_pieces(FilterFeed *f, Piece *t) {
+    if (!t || f->err) return;
+    feed_pieces(f, t->left);
+    if (t->first < 0) {
+        GapBuf *gb = &t->gb;
+        feed_put(f, gb->buf, gb->gap_start);
+        feed_put(f, gb->buf + gb->gap_end, gb->buf_size - gb->gap_end);
+    } else {
+        long from = orig_off(f->orig, t->first);
+        feed_splice(f, f->orig->data + from, orig_off(f->orig, t->first + t->count) - 1 - from);
+    }
+    feed_put(f, "\n", 1);
+    feed_pieces(f, t->right);
+}
+static void *filter_feeder(void *arg) {
+    FilterFeed *f = arg;
+    sigset_t set;
+    // a command that stops reading gives EPIPE here, not a signal
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    feed_pieces(f, f->range);
+    feed_flush(f);
+    close(f->fd);
+    return NULL;
+}
+// Runs cmd with sh, its stdin the lines of range (NULL: /dev/null), and
+// collects its stdout and stderr in out. Ctrl-C stops it. Returns its exit
+// status, or -1 with ed->message set.
+static int filter_run(Editor *ed, const char *cmd, Piece *range, OutBuf *out) {
+    int in[2] = { -1, -1 }, from[2], status = 0, stopped = 0, err;
+    pid_t pid;
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t at;
+    sigset_t def;
+    char *argv[] = { "sh", "-c", (char *)cmd, NULL };
+    FilterFeed *f = NULL;
+    pthread_t feeder;
+    if (pipe2(from, O_CLOEXEC) < 0) {
+        snprintf(ed->message, sizeof(ed->message), "pipe: %s", strerror(errno));
+        return -1;
+    }
+    if (range && pipe2(in, O_CLOEXEC) < 0) {
+        snprintf(ed->message, sizeof(ed->message), "pipe: %s", strerror(errno));
+        close(from[0]);
+        close(from[1]);
+        return -1;
+    }
+#ifdef F_SETPIPE_SZ
+    // fewer, larger transfers each way
+    fcntl(from[0], F_SETPIPE_SZ, FILTER_PIPE);
+    if (range) fcntl(in[1], F_SETPIPE_SZ, FILTER_PIPE);
+#endif
+    posix_spawn_file_actions_init(&fa);
+    if (range) posix_spawn_file_actions_adddup2(&fa, in[0], 0);
+    else posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&fa, from[1], 1);
+    posix_spawn_file_actions_adddup2(&fa, from[1], 2);
+    // its own process group, so that Ctrl-C reaches a whole pipeline
+    posix_spawnattr_init(&at);
+    sigemptyset(&def);
+    sigaddset(&def, SIGPIPE);
+    posix_spawnattr_setsigdefault(&at, &def);
+    posix_spawnattr_setpgroup(&at, 0);
+    posix_spawnattr_setflags(&at, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+    err = posix_spawn(&pid, "/bin/sh", &fa, &at, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&at);
+    close(from[1]);
+    if (range) close(in[0]);
+    if (err) {
+        snprintf(ed->message, sizeof(ed->message), "Cannot run sh: %s", strerror(err));
+        close(from[0]);
+        if (range) close(in[1]);
+        return -1;
+    }
+    if (range) {
+        f = calloc(1, sizeof(FilterFeed));
+        f->fd = in[1];
+        f->orig = &ed->orig;
+        f->range = range;
+        if (pthread_create(&feeder, NULL, filter_feeder, f) != 0) {
+            close(in[1]);
+            free(f);
+            f = NULL;
+            kill(-pid, SIGTERM);
+            stopped = 1;
+        }
+    }
+    for (;;) {
+        struct pollfd pfd[2] = { { from[0], POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 } };
+        int r = poll(pfd, headless.trace || stopped ? 1 : 2, -1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) break;
+        if (pfd[0].revents) {
+            subst_reserve(out, FILTER_PIPE);
+            ssize_t n = read(from[0], out->data + out->length, out->alloced - out->length);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            out->length += n;
+        }
+        // keys typed meanwhile stay queued; a Ctrl-C among them stops it
+        unsigned char *q;
+        if (!stopped && pfd[1].revents && input_fill(0) && (q = memchr(input.buf + input.pos, 3, input.len - input.pos))) {
+            memmove(q, q + 1, input.buf + --input.len - q);
+            kill(-pid, SIGINT);
+            stopped = 1;
+        }
+    }
+    close(from[0]);
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    if (f) {
+        pthread_join(feeder, NULL);
+        free(f);
+    }
+    if (stopped) {
+        snprintf(ed->message, sizeof(ed->message), "Interrupted");
+        return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+// Inserts the first n bytes of out at the start of line y and frees out.
+// The history takes its copy first and the lines are made from that one,
+// so that the text is not held three times over.
+static void filter_insert(Editor *ed, int y, OutBuf *out, long n) {
+    Undo *u = &ed->undo;
+    undo_record(ed, UNDO_INS, y, 0, out->data, n);
+    free(out->data);
+    out->data = NULL;
+    u->applying = 1;
+    insert_text(ed, y, 0, u->text + u->text_len - n, n);
+    u->applying = 0;
+}
+// :[range]!cmd puts what cmd prints, given the lines, in their place.
+// :[line]r !cmd puts what it prints below the line (the cursor line if none
+// is given), and :!cmd only shows it. A command that fails changes nothing
+// and has its output shown instead. Returns 0 if cmd is none of these.
+int filter(Editor *ed, const char *cmd) {
+    int y0, y1, below = 0;
+    const char *p = parse_range(ed, cmd, &y0, &y1);
+    if (p[0] == 'r' && (p[1] == ' ' || p[1] == '!')) {
+        for (++p; *p == ' '; ++p) {}
+        below = 1;
+    }
+    int ranged = p != cmd && !below;
+    if (*p != '!') return 0;
+    for (++p; *p == ' '; ++p) {}
+    if (!*p) {
+        snprintf(ed->message, sizeof(ed->message), "Argument required");
+        return 1;
+    }
+    if (y0 > y1) {
+        int t = y0;
+        y0 = y1;
+        y1 = t;
+    }
+    if (y0 < 0 || y1 >= ed->num_lines) {
+        snprintf(ed->message, sizeof(ed->message), "Invalid range");
+        return 1;
+    }
+    OutBuf out = {0};
+    Piece *a = NULL, *m = NULL, *c = NULL;
+    double t = now();
+    if (ranged) {
+        piece_split(ed, ed->root, y0, &a, &m);
+        piece_split(ed, m, y1 + 1 - y0, &m, &c);
+    }
+    int status = filter_run(ed, p, m, &out);
+    if (ranged) ed->root = piece_merge(a, piece_merge(m, c));
+    if (status < 0) {
+        free(out.data);
+        return 1;
+    }
+    if (status || (!ranged && !below)) {
+        outbuf_append(&ed->overlay, out.data, out.length);
+        if (status) snprintf(ed->message, sizeof(ed->message), "shell returned %d", status);
+        free(out.data);
+        return 1;
+    }
+    long n = out.length;
+    if (n && out.data[n - 1] == '\n') n--;
+    if (below) {
+        // on lines of their own below line y1
+        if (out.length) {
+            insert_text(ed, y1, line_length(ed, y1), "\n", 1);
+            if (n) filter_insert(ed, y1 + 1, &out, n);
+            ed->cy = y1 + 1;
+            ed->cx = 0;
+        }
+        free(out.data);
+        return 1;
+    }
+    // one undo group: the lines go, and the output takes their place
+    int last = line_length(ed, y1);
+    if (!out.length) {
+        if (y1 + 1 < ed->num_lines) delete_text(ed, y0, 0, y1 + 1, 0);
+        else if (y0 > 0) delete_text(ed, y0 - 1, line_length(ed, y0 - 1), y1, last);
+        else if (y1 > y0 || last) delete_text(ed, 0, 0, y1, last);
+    } else {
+        if (y1 > y0 || last) delete_text(ed, y0, 0, y1, last);
+        if (n) filter_insert(ed, y0, &out, n);
+    }
+    ed->cy = y0 < ed->num_lines ? y0 : ed->num_lines - 1;
+    ed->cx = 0;
+    t = now() - t;
+    snprintf(ed->message, sizeof(ed->message), "%d lines filtered, %ld bytes back in %.3f s",
+             y1 + 1 - y0, out.length, t);
+    free(out.data);
+    return 1;
+}
+
+void process_command(Editor *ed, int c) {
+    int clen = strlen(ed->command);
+    if (c == '\n' || c == '\r') {
+        if (strcmp(ed->command, "w") == 0)
+            save_file(ed, ed->filename);
+        else if (strcmp(ed->command, "mem") == 0)
+            report_memory(ed);
+        else if (strcmp(ed->command, "latency") == 0)
+            show_latency(ed);
+        else if (strcmp(ed->command, "stats") == 0)
+            snprintf(ed->message, sizeof(ed->message), "%.1f bytes/key over %ld keys, last frame %ld bytes",
+                     ed->keys ? (double)ed->scr.total_bytes / ed->keys : 0.0, ed->keys, ed->scr.frame_bytes);
+        else if (strcmp(ed->command, "q") == 0) {
+            disableRawMode();
+            journal_close(ed, 1);
+            free_lines(ed);
+            exit(0);
+        } else if (strcmp(ed->command, "wq") == 0) {
+            save_file(ed, ed->filename);
+            disableRawMode();
+            journal_close(ed, 1);
+            free_lines(ed);
+            exit(0);
+        } else if (ed->command[0] && !substitute(ed, ed->command) && !filter(ed, ed->command)) {
+            snprintf(ed->message, sizeof(ed->message), "Not an editor command: %.100s", ed->command);
+        }
+        ed->mode = MODE_INSERT;
+    } else if ((c == 127 || c == 8) && clen > 0) {
+        ed->command[clen-1] = '\0';
+    } else if (c == 27) { // ESC
+        ed->mode = MODE_INSERT;
+    } else if (clen < 120 && c != 27) {
+        ed->command[clen] = c; ed->command[clen+1] = 0;
+    }
+}
+
+// m{a-z} sets a mark at the cursor, '{a-z} goes to the first non-blank of
+// its line and `{a-z} to the mark itself.
+static void mark_key(Editor *ed, int cmd, int c) {
+    Marks *m = &ed->marks;
+    LineView lv;
+    int y, x;
+    if (c < 'a' || c > 'z') return;
+    Mark **t = &m->named[c - 'a'];
+    if (cmd == 'm') {
+        if (*t) mark_remove(m, *t);
+        *t = mark_add(m, ed->cy, ed->cx);
+        return;
+    }
+    if (!*t) {
+        snprintf(ed->message, sizeof(ed->message), "Mark not set");
+        return;
+    }
+    mark_get(*t, &y, &x);
+    jump_push(ed);
+    ed->cy = y < ed->num_lines ? y : ed->num_lines - 1;
+    ed->cx = x;
+    if (cmd == '\'') {
+        get_line(ed, ed->cy, &lv);
+        for (x = 0; x < lv.n[0] + lv.n[1] && (view_byte(&lv, x) == ' ' || view_byte(&lv, x) == '\t'); ++x) {}
+        ed->cx = x;
+    }
+}
+// Ctrl-O (dir < 0) and Ctrl-I step through the jump list. Stepping back from
+// its end first notes the cursor, so that Ctrl-I can return to it.
+static void jump_go(Editor *ed, int dir) {
+    Marks *m = &ed->marks;
+    if (dir < 0 && m->jump_at == m->njumps) {
+        jump_push(ed);
+        m->jump_at--;
+    }
+    int to = m->jump_at + dir;
+    if (to < 0 || to >= m->njumps) return;
+    m->jump_at = to;
+    mark_get(m->jumps[to], &ed->cy, &ed->cx);
+}
+void process_normal(Editor *ed, int c) {
+    if (ed->pending) {
+        mark_key(ed, ed->pending, c);
+        ed->pending = 0;
+        return;
+    }
+    if (edit_key(ed, c)) return;
+    if (c == 'i') {
+        ed->mode = MODE_INSERT;
+    } else if (c == ':') {
+        ed->mode = MODE_COMMAND; ed->command[0] = 0;
+    } else if (c == '/') {
+        ed->mode = MODE_SEARCH; ed->search[0] = 0; ed->search_found = 0;
+    } else if (c == 'n' || c == 'N') {
+        search_start(ed, c == 'n' ? 1 : -1);
+    } else if (c == 'u') {
+        undo(ed);
+    } else if (c == 18) { // Ctrl-R
+        redo(ed);
+    } else if (c == 6 || c == 2) { // Ctrl-F / Ctrl-B: page down / up
+        int page = get_terminal_height() - 4;
+        scroll_view(ed, c == 6 ? (page > 1 ? page : 1) : -(page > 1 ? page : 1));
+    } else if (c == 5 || c == 25) { // Ctrl-E / Ctrl-Y: one row
+        scroll_view(ed, c == 5 ? 1 : -1);
+    } else if (c == 'm' || c == '\'' || c == '`') {
+        ed->pending = c;
+    } else if (c == 15 || c == 9) { // Ctrl-O / Ctrl-I: back and forth along the jump list
+        jump_go(ed, c == 15 ? -1 : 1);
+    }
+}
+
+void process_search(Editor *ed, int c) {
+    int slen = strlen(ed->search);
+    if (c == '\n' || c == '\r') {
+        ed->mode = MODE_NORMAL;
+        // an empty pattern repeats the last search
+        if (ed->search[0] && !set_search(ed, ed->search)) return;
+        search_start(ed, 1);
+    } else if ((c == 127 || c == 8) && slen > 0) {
+        ed->search[slen-1] = '\0';
+    } else if (c == 27) { // ESC
+        ed->mode = MODE_NORMAL;
+    } else if (slen < 120 && c != 27) {
+        ed->search[slen] = c; ed->search[slen+1] = 0;
+    }
+}
+
+// vi --bench-search file pattern... : lines matched and scan speed of each
+// pattern with the regex DFA, and with the Two-Way finder when it is literal.
+int bench_search(int argc, char *argv[]) {
+    Editor ed;
+    memset(&ed, 0, sizeof(ed));
+    ed.root = make_piece(&ed, -1, 1);
+    ed.num_lines = 1;
+    load_file(&ed, argv[0]);
+    finish_index(&ed);
+    if (!ed.orig.len) {
+        fprintf(stderr, "cannot read %s\n", argv[0]);
+        return 1;
+    }
+    printf("%s: %d lines, %.1f MB\n", argv[0], ed.num_lines, ed.orig.len / 1e6);
+    for (int i = 1; i < argc; ++i) {
+        Regex re;
+        const char *err = re_compile(&re, argv[i]);
+        if (err) {
+            printf("%-24s %s\n", argv[i], err);
+            continue;
+        }
+        for (int literal = re.literal; literal >= 0; --literal) {
+            long hits = 0;
+            int len;
+            re.literal = literal;
+            double t = now();
+            for (int y = 0; y < ed.num_lines; ++y) {
+                LineView lv;
+                get_line(&ed, y, &lv);
+                if (re_find(&re, &lv, 0, &len) >= 0) hits++;
+            }
+            t = now() - t;
+            printf("%-24s %-7s %10ld lines %8.3f s %8.0f MB/s", argv[i], literal ? "literal" : "dfa",
+                   hits, t, ed.orig.len / 1e6 / t);
+            if (!literal) printf("  %d+%d states, %ld flushes", re.fwd.nstates, re.rev.nstates,
+                                 re.fwd.flushes + re.rev.flushes);
+            printf("\n");
+        }
+        re_free(&re);
+    }
+    free_lines(&ed);
+    return 0;
+}
+
+// vi --bench-subst FILE CMD [THREADS...]: times :CMD on FILE, loaded afresh
+// for each number of worker threads (1, 2, 4... up to the CPUs unless
+// given), and checks that every run leaves the same text.
+int bench_subst(int argc, char *argv[]) {
+    int counts[32], n = 0, cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned long first = 0;
+    double base = 0;
+    for (int i = 2; i < argc && n < 32; ++i) counts[n++] = atoi(argv[i]);
+    for (int t = 1; !n || (counts[n - 1] < cpus && argc <= 2); t *= 2) counts[n++] = t < cpus ? t : cpus;
+    for (int i = 0; i < n; ++i) {
+        Editor ed;
+        memset(&ed, 0, sizeof(ed));
+        ed.root = make_piece(&ed, -1, 1);
+        ed.num_lines = 1;
+        load_file(&ed, argv[0]);
+        finish_index(&ed);
+        if (!ed.orig.len) {
+            fprintf(stderr, "cannot read %s\n", argv[0]);
+            return 1;
+        }
+        if (!i) printf("%s: %d lines, %.1f MB, %d CPUs, :%s\n", argv[0], ed.num_lines, ed.orig.len / 1e6, cpus, argv[1]);
+        subst_threads = counts[i];
+        double t = now();
+        if (!substitute(&ed, argv[1])) {
+            fprintf(stderr, "not a substitute command: %s\n", argv[1]);
+            return 1;
+        }
+        t = now() - t;
+        Hash h = { 0 };
+        for (int y = 0; y < ed.num_lines; ++y) {
+            LineView lv;
+            get_line(&ed, y, &lv);
+            hash_add(&h, lv.p[0], lv.n[0]);
+            hash_add(&h, lv.p[1], lv.n[1]);
+            hash_add(&h, "\n", 1);
+        }
+        unsigned long sum = hash_end(&h);
+        if (!i) {
+            base = t;
+            first = sum;
+        }
+        printf("%3d threads %8.3f s  %5.2fx  %s%s\n", counts[i], t, base / t, ed.message,
+               sum == first ? "" : "  (text differs from the first run)");
+        re_free(&ed.re);
+        free_lines(&ed);
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("peak RSS %.1f MB\n", ru.ru_maxrss / 1024.0);
+    return 0;
+}
+
+void handle_key(Editor *ed, int c) {
+    search_cancel(ed);
+    ed->keys++;
+    ed->message[0] = 0;
+    ed->overlay.length = 0;
+    EditorMode was = ed->mode;
+    if (c == KEY_PASTE) process_paste(ed);
+    else if (c == KEY_MOUSE) process_mouse(ed);
+    else if (ed->mode == MODE_INSERT) process_insert(ed, c);
+    else if (ed->mode == MODE_COMMAND) process_command(ed, c);
+    else if (ed->mode == MODE_NORMAL) process_normal(ed, c);
+    else if (ed->mode == MODE_SEARCH) process_search(ed, c);
+    // an insert session is one undo group; moving the cursor ends it
+    if (was != MODE_INSERT || ed->mode != MODE_INSERT || c >= KEY_ARROW_LEFT) undo_break(ed);
+    journal_flush(ed);
+    int len = line_length(ed, ed->cy);
+    if (ed->cx < 0) ed->cx = 0;
+    if (ed->cx > len) ed->cx = len;
+    if (ed->cy < 0) ed->cy = 0;
+    if (ed->cy >= ed->num_lines) ed->cy = ed->num_lines-1;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+// Types keys characters into FILE, one key per main loop turn, without the
+// journal, with group commit and with an fdatasync per key.
+int bench_journal(int argc, char *argv[]) {
+    const char *modes[] = { "off", "group", "sync" };
+    const char *text = "the quick brown fox jumps over the lazy dog ";
+    int keys = argc > 1 ? atoi(argv[1]) : 20000;
+    double *t = malloc((keys > 0 ? keys : 1) * sizeof(double));
+    for (int m = 0; m < 3; ++m) {
+        Editor ed;
+        memset(&ed, 0, sizeof(ed));
+        ed.root = make_piece(&ed, -1, 1);
+        ed.num_lines = 1;
+        strncpy(ed.filename, argv[0], FILENAME_MAXLEN - 1);
+        load_file(&ed, ed.filename);
+        finish_index(&ed);
+        if (m) {
+            journal_reset(&ed);
+            if (!ed.journal.on) {
+                fprintf(stderr, "cannot create the swap file of %s\n", argv[0]);
+                return 1;
+            }
+        }
+        if (m == 2) journal_stop(&ed.journal);     // flushes sync inline from now on
+        int n = m == 2 && keys > 2000 ? 2000 : keys;
+        double total = now();
+        for (int i = 0; i < n; ++i) {
+            double k = now();
+            if (ed.cx >= 72) {
+                split_line(&ed, ed.cy, ed.cx);
+                ed.cy++;
+                ed.cx = 0;
+            } else {
+                insert_char(&ed, ed.cy, ed.cx++, text[i % 44]);
+            }
+            journal_flush(&ed);
+            t[i] = now() - k;
+        }
+        total = now() - total;
+        qsort(t, n, sizeof(double), cmp_double);
+        printf("%-6s %6d keys %7.2f us/key  p50 %6.2f  p99 %7.2f  max %8.2f us  %8ld bytes %5ld syncs\n",
+               modes[m], n, total / n * 1e6, t[n / 2] * 1e6, t[n * 99 / 100] * 1e6, t[n - 1] * 1e6,
+               ed.journal.bytes, ed.journal.syncs);
+        journal_close(&ed, 1);
+        free_lines(&ed);
+    }
+    free(t);
+    return 0;
+}
+
+// --- Pager: read-only viewing of files of any size through a page cache ---
+
+#define PAGER_PAGE (64L << 10)
+#define PAGER_BUDGET 64         // MB of pages unless given
+#define PAGER_STRIDE 1024       // lines between entries of the line index
+#define PAGER_CHUNK 65536       // index entries per chunk
+#define PAGER_CHUNKS 4096
+#define PAGER_READ (4L << 20)   // the indexer reads this much at a time
+
+typedef struct {
+    long page;          // which page of the file, -1 if none yet
+    char *data;
+    long len;
+    int prev, next;     // recency list, most recent first
+    int chain;          // next slot in the same hash bucket
+} PagerPage;
+
+// The file is read in PAGER_PAGE pages kept in a fixed number of slots,
+// recycled least recently used first; lines are found by scanning pages
+// from the nearest entry of a sparse index built in the background.
+typedef struct {
+    int fd;
+    long size;
+    const char *name;
+    PagerPage *pages;
+    int npages, *bucket, nbucket;
+    int mru, lru;
+    long hits, misses;
+    long *idx[PAGER_CHUNKS];    // where every PAGER_STRIDE-th line starts
+    long lines;                 // counted by the indexer so far
+    int done, stop;
+    pthread_t indexer;
+    long top, top_off;  // first line shown, negative if counted back from the end
+    long left;          // first column shown
+    long jump;          // line waiting for the indexer, or -1
+    int typing;         // a :N is being typed into cmd
+    char cmd[24];
+    char message[128];
+    Screen scr;
+} Pager;
+
+static void pager_unlink(Pager *pg, int s) {
+    PagerPage *p = &pg->pages[s];
+    if (p->prev >= 0) pg->pages[p->prev].next = p->next;
+    else pg->mru = p->next;
+    if (p->next >= 0) pg->pages[p->next].prev = p->prev;
+    else pg->lru = p->prev;
+}
+// The bytes from off to the end of its page, read in if not cached.
+static const char *pager_at(Pager *pg, long off, long *n) {
+    long page = off / PAGER_PAGE;
+    int b = page % pg->nbucket, s;
+    for (s = pg->bucket[b]; s >= 0 && pg->pages[s].page != page; s = pg->pages[s].chain) {}
+    if (s >= 0) {
+        pg->hits++;
+    } else {
+        // recycle the least recently used slot
+        pg->misses++;
+        s = pg->lru;
+        PagerPage *p = &pg->pages[s];
+        if (p->page >= 0) {
+            int *link = &pg->bucket[p->page % pg->nbucket];
+            while (*link != s) link = &pg->pages[*link].chain;
+            *link = p->chain;
+        }
+        if (!p->data) p->data = malloc(PAGER_PAGE);
+        p->len = 0;
+        while (p->len < PAGER_PAGE) {
+            ssize_t r = pread(pg->fd, p->data + p->len, PAGER_PAGE - p->len, page * PAGER_PAGE + p->len);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            p->len += r;
+        }
+        p->page = page;
+        p->chain = pg->bucket[b];
+        pg->bucket[b] = s;
+    }
+    if (pg->mru != s) {
+        pager_unlink(pg, s);
+        pg->pages[s].prev = -1;
+        pg->pages[s].next = pg->mru;
+        pg->pages[pg->mru].prev = s;
+        pg->mru = s;
+    }
+    *n = pg->pages[s].len - off % PAGER_PAGE;
+    return pg->pages[s].data + off % PAGER_PAGE;
+}
+// Start of the line after the one starting at off; size at the last one.
+static long pager_next(Pager *pg, long off) {
+    while (off < pg->size) {
+        long n;
+        const char *p = pager_at(pg, off, &n), *nl = n > 0 ? memchr(p, '\n', n) : NULL;
+        if (nl) return off + (nl - p) + 1;
+        if (n <= 0) break;
+        off += n;
+    }
+    return pg->size;
+}
+// Start of the line before the one starting at off.
+static long pager_prev(Pager *pg, long off) {
+    long end = off - 1;         // the newline ending that line is not its start
+    while (end > 0) {
+        long start = (end - 1) / PAGER_PAGE * PAGER_PAGE, n;
+        const char *p = pager_at(pg, start, &n);
+        const char *nl = memrchr(p, '\n', end - start < n ? end - start : n);
+        if (nl) return start + (nl - p) + 1;
+        end = start;
+    }
+    return 0;
+}
+// Finds the k-th newline in [p, end). If there is none, *count gets how many
+// there were.
+static const char *nth_newline(const char *p, const char *end, long k, long *count) {
+    long c = 0;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        int b = __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl)));
+        if (c + b >= k) break;
+        c += b;
+        p += 16;
+    }
+#endif
+    for (; p < end; ++p)
+        if (*p == '\n' && ++c == k) break;
+    *count = c;
+    return p < end ? p : NULL;
+}
+static void *pager_indexer(void *arg) {
+    Pager *pg = arg;
+    char *buf = malloc(PAGER_READ), last = '\n';
+    long off = 0, lines = 0;
+    while (off < pg->size && !__atomic_load_n(&pg->stop, __ATOMIC_RELAXED)) {
+        ssize_t n = pread(pg->fd, buf, PAGER_READ, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        const char *p = buf, *nl;
+        long got;
+        while ((nl = nth_newline(p, buf + n, PAGER_STRIDE - lines % PAGER_STRIDE, &got))) {
+            long e = (lines += got) / PAGER_STRIDE;
+            if (e / PAGER_CHUNK >= PAGER_CHUNKS) break;
+            if (!pg->idx[e / PAGER_CHUNK]) pg->idx[e / PAGER_CHUNK] = malloc(PAGER_CHUNK * sizeof(long));
+            pg->idx[e / PAGER_CHUNK][e % PAGER_CHUNK] = off + (nl - buf) + 1;
+            p = nl + 1;
+        }
+        if (!nl) lines += got;
+        last = buf[n - 1];
+        off += n;
+        __atomic_store_n(&pg->lines, lines, __ATOMIC_RELEASE);
+    }
+    // a last line without a newline counts too
+    __atomic_store_n(&pg->lines, lines + (last != '\n'), __ATOMIC_RELEASE);
+    __atomic_store_n(&pg->done, 1, __ATOMIC_RELEASE);
+    free(buf);
+    return NULL;
+}
+static Pager *pager_open(const char *path, long budget_mb) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    Pager *pg = calloc(1, sizeof(Pager));
+    pg->fd = fd;
+    pg->size = st.st_size;
+    pg->name = path;
+    pg->npages = (int)((budget_mb << 20) / PAGER_PAGE);
+    if (pg->npages < 4) pg->npages = 4;
+    pg->pages = malloc(pg->npages * sizeof(PagerPage));
+    for (int i = 0; i < pg->npages; ++i)
+        pg->pages[i] = (PagerPage){ .page = -1, .prev = i - 1, .next = i + 1 < pg->npages ? i + 1 : -1, .chain = -1 };
+    pg->mru = 0;
+    pg->lru = pg->npages - 1;
+    pg->nbucket = pg->npages * 2;
+    pg->bucket = malloc(pg->nbucket * sizeof(int));
+    memset(pg->bucket, -1, pg->nbucket * sizeof(int));
+    pg->idx[0] = malloc(PAGER_CHUNK * sizeof(long));
+    pg->idx[0][0] = 0;
+    pg->jump = -1;
+    if (pthread_create(&pg->indexer, NULL, pager_indexer, pg)) {
+        pager_indexer(pg);
+        pg->indexer = pthread_self();
+    }
+    return pg;
+}
+static void pager_close(Pager *pg) {
+    __atomic_store_n(&pg->stop, 1, __ATOMIC_RELAXED);
+    if (!pthread_equal(pg->indexer, pthread_self())) pthread_join(pg->indexer, NULL);
+    for (int i = 0; i < pg->npages; ++i) free(pg->pages[i].data);
+    for (int i = 0; i < PAGER_CHUNKS; ++i) free(pg->idx[i]);
+    free(pg->pages);
+    free(pg->bucket);
+    free(pg->scr.cur);
+    free(pg->scr.prev);
+    free(pg->scr.ob.data);
+    close(pg->fd);
+    free(pg);
+}
+static int pager_rows(void) {
+    int h = get_terminal_height();
+    return h < 3 ? 1 : h - 2;
+}
+// Start of the first line of the last screenful, and how many lines it has.
+static long pager_last(Pager *pg, long *count) {
+    long off = pg->size, n = 0;
+    if (off > 0) {
+        // the start of the last line, which may lack its newline
+        const char *p = pager_at(pg, off - 1, &n);
+        off = pager_prev(pg, *p == '\n' ? off : off + 1);
+        n = 1;
+    }
+    while (n < pager_rows() && off > 0) {
+        off = pager_prev(pg, off);
+        n++;
+    }
+    *count = n;
+    return off;
+}
+static void pager_down(Pager *pg, long k) {
+    long count, last = pager_last(pg, &count);
+    for (; k > 0 && pg->top_off < last; --k) {
+        pg->top_off = pager_next(pg, pg->top_off);
+        pg->top++;
+    }
+}
+static void pager_up(Pager *pg, long k) {
+    for (; k > 0 && pg->top_off > 0; --k) {
+        pg->top_off = pager_prev(pg, pg->top_off);
+        pg->top--;
+    }
+}
+// Goes to line y (from 0), from the index entry before it, or waits for the
+// indexer to get there.
+static void pager_goto(Pager *pg, long y) {
+    long lines = __atomic_load_n(&pg->lines, __ATOMIC_ACQUIRE);
+    int done = __atomic_load_n(&pg->done, __ATOMIC_ACQUIRE);
+    if (y < 0) y = 0;
+    if (done && y >= lines) y = lines > 0 ? lines - 1 : 0;
+    if (!done && y >= lines - lines % PAGER_STRIDE) {
+        pg->jump = y;
+        return;
+    }
+    long e = y / PAGER_STRIDE;
+    pg->jump = -1;
+    pg->top = e * PAGER_STRIDE;
+    pg->top_off = pg->idx[e / PAGER_CHUNK][e % PAGER_CHUNK];
+    for (long k = y - pg->top; k > 0; --k) pg->top_off = pager_next(pg, pg->top_off);
+    pg->top = y;
+}
+static void pager_end(Pager *pg) {
+    long count;
+    pg->top_off = pager_last(pg, &count);
+    pg->top = -count;
+    pg->jump = -1;
+}
+// Catches up with the indexer: line numbers counted back from the end become
+// known, and a jump waiting for the index is made.
+static void pager_poll(Pager *pg) {
+    long lines = __atomic_load_n(&pg->lines, __ATOMIC_ACQUIRE);
+    int done = __atomic_load_n(&pg->done, __ATOMIC_ACQUIRE);
+    if (done && pg->top < 0) pg->top += lines;
+    if (pg->jump >= 0 && (done || pg->jump < lines - lines % PAGER_STRIDE)) pager_goto(pg, pg->jump);
+}
+static void pager_draw(Pager *pg) {
+    Screen *scr = &pg->scr;
+    int w = get_terminal_width(), rows = pager_rows();
+    char line[512], status[512];
+    if (w > (int)sizeof(line)) w = sizeof(line);
+    screen_begin(scr, rows + 2, w, rows);
+    long off = pg->top_off;
+    for (int r = 0; r < rows && off < pg->size; ++r) {
+        // the columns [left, left + w) of the line at off
+        long pos = off, from = off + pg->left, to = from + w;
+        int len = 0;
+        while (pos < to && pos < pg->size) {
+            long n;
+            const char *p = pager_at(pg, pos, &n), *nl = n > 0 ? memchr(p, '\n', n) : NULL;
+            long end = nl ? pos + (nl - p) : pos + n;
+            long a = pos > from ? pos : from, b = end < to ? end : to;
+            if (b > a) {
+                memcpy(line + len, p + (a - pos), b - a);
+                len += b - a;
+            }
+            if (nl || n <= 0) break;
+            pos = end;
+        }
+        screen_put(scr, r, 0, line, len, 0);
+        off = pager_next(pg, off);
+    }
+    long lines = __atomic_load_n(&pg->lines, __ATOMIC_ACQUIRE);
+    int done = __atomic_load_n(&pg->done, __ATOMIC_ACQUIRE), n;
+    if (pg->top >= 0) n = snprintf(status, sizeof(status), "%.64s  line %ld of %ld%s", pg->name, pg->top + 1, lines, done ? "" : "...");
+    else n = snprintf(status, sizeof(status), "%.64s  line %ld from the end of %ld...", pg->name, -pg->top, lines);
+    if (pg->left) n += snprintf(status + n, sizeof(status) - n, "  col %ld", pg->left + 1);
+    n += snprintf(status + n, sizeof(status) - n, "  [cache %ld of %d pages, %.0f%% hits]",
+                  pg->misses < pg->npages ? pg->misses : (long)pg->npages, pg->npages,
+                  pg->hits + pg->misses ? 100.0 * pg->hits / (pg->hits + pg->misses) : 100.0);
+    if (pg->jump >= 0) n += snprintf(status + n, sizeof(status) - n, "  going to line %ld when indexed", pg->jump + 1);
+    if (pg->message[0]) n += snprintf(status + n, sizeof(status) - n, "  %s", pg->message);
+    screen_put(scr, rows, 0, status, n < (int)sizeof(status) ? n : (int)sizeof(status) - 1, ATTR_REVERSE);
+    if (pg->typing) {
+        n = snprintf(status, sizeof(status), ":%s", pg->cmd);
+        screen_put(scr, rows + 1, 0, status, n, 0);
+    }
+    screen_flush(scr, rows + 1, pg->typing ? n : 0);
+}
+// Handles a key; returns 1 to quit.
+static int pager_key(Pager *pg, int c) {
+    int page = pager_rows() - 1 > 0 ? pager_rows() - 1 : 1;
+    pg->message[0] = 0;
+    if (pg->typing) {
+        int len = strlen(pg->cmd);
+        if (c == '\r' || c == '\n') {
+            pg->typing = 0;
+            if (!strcmp(pg->cmd, "q")) return 1;
+            char *end;
+            long y = strtol(pg->cmd, &end, 10);
+            if (end != pg->cmd && !*end) pager_goto(pg, y - 1);
+            else if (!strcmp(pg->cmd, "$")) pager_end(pg);
+            else snprintf(pg->message, sizeof(pg->message), "Not a pager command: %.24s", pg->cmd);
+        } else if (c == 27) {
+            pg->typing = 0;
+        } else if (c == 127 || c == 8) {
+            if (len) pg->cmd[len - 1] = 0;
+            else pg->typing = 0;
+        } else if (c >= 32 && c < 127 && len + 1 < (int)sizeof(pg->cmd)) {
+            pg->cmd[len] = c;
+            pg->cmd[len + 1] = 0;
+        }
+        return 0;
+    }
+    if (c == KEY_EOF || c == 'q') return 1;
+    if (c == ':') {
+        pg->typing = 1;
+        pg->cmd[0] = 0;
+    } else if (c == 'j' || c == KEY_ARROW_DOWN || c == '\r') {
+        pager_down(pg, 1);
+    } else if (c == 'k' || c == KEY_ARROW_UP) {
+        pager_up(pg, 1);
+    } else if (c == ' ' || c == 'f' || c == 6 || c == KEY_PAGE_DOWN) {
+        pager_down(pg, page);
+    } else if (c == 'b' || c == 2 || c == KEY_PAGE_UP) {
+        pager_up(pg, page);
+    } else if (c == 'g' || c == KEY_HOME) {
+        pager_goto(pg, 0);
+    } else if (c == 'G' || c == KEY_END) {
+        pager_end(pg);
+    } else if (c == 'l' || c == KEY_ARROW_RIGHT) {
+        pg->left += 8;
+    } else if ((c == 'h' || c == KEY_ARROW_LEFT) && pg->left) {
+        pg->left -= 8;
+    } else if (c == KEY_MOUSE && (input.mouse_button == 64 || input.mouse_button == 65)) {
+        if (input.mouse_button == 64) pager_up(pg, 3);
+        else pager_down(pg, 3);
+    }
+    return 0;
+}
+// vi --pager FILE [MB]: pages through FILE read-only, keeping at most MB of
+// it in memory.
+int pager(int argc, char *argv[]) {
+    Pager *pg = pager_open(argv[0], argc > 1 ? atol(argv[1]) : PAGER_BUDGET);
+    if (!pg) {
+        fprintf(stderr, "cannot read %s\n", argv[0]);
+        return 1;
+    }
+    enableRawMode();
+    for (;;) {
+        pager_poll(pg);
+        pager_draw(pg);
+        // the line count moves on while the indexer runs
+        while (!input_wait(__atomic_load_n(&pg->done, __ATOMIC_ACQUIRE) ? -1 : 100)) {
+            pager_poll(pg);
+            pager_draw(pg);
+        }
+        if (pager_key(pg, read_key())) break;
+    }
+    write_all(STDOUT_FILENO, "\x1b[0m\x1b[H\x1b[2J", 11);
+    disableRawMode();
+    pager_close(pg);
+    return 0;
+}
+// vi --bench-pager FILE [MB [LINE]]: opens FILE in the pager headless, with
+// the memory budget of --pager, times building its index and jumps to LINE
+// (50000000 if not given) and to random lines, and reports what memory
+// that took.
+int bench_pager(int argc, char *argv[]) {
+    OutBuf sink = { 0 };
+    double t = now();
+    Pager *pg = pager_open(argv[0], argc > 1 ? atol(argv[1]) : PAGER_BUDGET);
+    if (!pg) {
+        fprintf(stderr, "cannot read %s\n", argv[0]);
+        return 1;
+    }
+    headless.cols = 120;
+    headless.rows = 40;
+    headless.sink = &sink;
+    long target = argc > 2 ? atol(argv[2]) : 50000000;
+    // the first jump waits for the indexer to get there
+    pager_goto(pg, target - 1);
+    while (pg->jump >= 0) {
+        usleep(1000);
+        pager_poll(pg);
+    }
+    pager_draw(pg);
+    printf("%s: line %ld shown after %.3f s\n", argv[0], pg->top + 1, now() - t);
+    pthread_join(pg->indexer, NULL);
+    pg->indexer = pthread_self();
+    t = now() - t;
+    printf("indexed %ld lines, %.1f MB in %.3f s (%.0f MB/s)\n", pg->lines, pg->size / 1e6, t, pg->size / 1e6 / t);
+    int n = 1000;
+    double *lat = malloc(n * sizeof(double));
+    srand(1);
+    for (int i = 0; i < n; ++i) {
+        long y = (long)((double)rand() / RAND_MAX * (pg->lines - 1));
+        t = now();
+        pager_goto(pg, y);
+        pager_draw(pg);
+        lat[i] = now() - t;
+        sink.length = 0;
+    }
+    qsort(lat, n, sizeof(double), cmp_double);
+    printf("%d random jumps: p50 %.1f us  p99 %.1f us  max %.1f us\n", n, lat[n / 2] * 1e6, lat[n * 99 / 100] * 1e6, lat[n - 1] * 1e6);
+    t = now();
+    for (int i = 0; i < 1000; ++i) pager_down(pg, pager_rows());
+    printf("paging: %.1f us per screen\n", (now() - t) * 1e3);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("cache %d pages of %ld KB, %ld hits, %ld misses; peak RSS %.1f MB\n", pg->npages, PAGER_PAGE >> 10,
+           pg->hits, pg->misses, ru.ru_maxrss / 1024.0);
+    free(lat);
+    free(sink.data);
+    pager_close(pg);
+    return 0;
+}
+
+// --- Replay: a keystroke trace run headless ---
+
+// Reads a double-quoted string with C escapes (and \e for ESC) into out.
+static const char *trace_string(const char *p, OutBuf *out) {
+    while (*p == ' ' || *p == '\t') ++p;
+    if (*p++ != '"') return NULL;
+    for (; *p && *p != '"'; ++p) {
+        char c = *p;
+        if (c == '\\') {
+            switch (*++p) {
+                case 'r': c = '\r'; break;
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'e': c = 27; break;
+                case 'x': c = (char)strtol(p + 1, (char **)&p, 16); --p; break;
+                case 0: return NULL;
+                default: c = *p;
+            }
+        }
+        outbuf_append(out, &c, 1);
+    }
+    return *p == '"' ? p + 1 : NULL;
+}
+// Turns a trace into the bytes a terminal would send, one directive a line:
+//   size COLS ROWS        the virtual terminal
+//   lines N "format"      start from N lines, %d standing for the line number
+//   longline N "text"     start from one line of N copies of text
+//   file PATH             start from a file
+//   syntax NAME           highlight as for a file called NAME
+//   keys "..."            keys as the terminal sends them
+//   repeat N "..."        the same, N times
+//   paste N "..."         one bracketed paste of N copies
+static int trace_parse(Editor *ed, char *text, OutBuf *keys) {
+    int lineno = 0;
+    for (char *line = strtok(text, "\n"); line; line = strtok(NULL, "\n")) {
+        OutBuf str = { 0 };
+        char word[16], path[FILENAME_MAXLEN];
+        long n = 1;
+        int used = 0;
+        ++lineno;
+        if (sscanf(line, " %15s%n", word, &used) != 1 || word[0] == '#') continue;
+        const char *rest = line + used;
+        if (!strcmp(word, "size")) {
+            if (sscanf(rest, "%d %d", &headless.cols, &headless.rows) == 2) continue;
+        } else if (!strcmp(word, "syntax")) {
+            if (sscanf(rest, " %255s", path) == 1 && (ed->syn.lang = syn_lang(path))) continue;
+        } else if (!strcmp(word, "file")) {
+            if (sscanf(rest, " %255s", path) == 1) {
+                load_file(ed, path);
+                finish_index(ed);
+                if (ed->orig.len) continue;
+            }
+        } else if (!strcmp(word, "keys") || !strcmp(word, "repeat") || !strcmp(word, "paste") ||
+                   !strcmp(word, "lines") || !strcmp(word, "longline")) {
+            if (strcmp(word, "keys")) n = strtol(rest, (char **)&rest, 10);
+            if (n >= 0 && trace_string(rest, &str)) {
+                if (!strcmp(word, "lines") || !strcmp(word, "longline")) {
+                    OrigText *o = &ed->orig;
+                    OutBuf doc = { 0 };
+                    char num[16];
+                    char *at = memmem(str.data, str.length, "%d", 2);
+                    long head = at ? at - str.data : str.length;
+                    if (!strcmp(word, "longline")) {
+                        doc.alloced = n * str.length + 1;
+                        doc.data = malloc(doc.alloced);
+                        for (long i = 0; i < n; ++i) outbuf_append(&doc, str.data, str.length);
+                        outbuf_append(&doc, "\n", 1);
+                    } else {
+                        for (long i = 1; i <= n; ++i) {
+                            outbuf_append(&doc, str.data, head);
+                            if (at) {
+                                outbuf_append(&doc, num, snprintf(num, sizeof(num), "%ld", i));
+                                outbuf_append(&doc, at + 2, str.length - head - 2);
+                            }
+                            outbuf_append(&doc, "\n", 1);
+                        }
+                    }
+                    free_lines(ed);
+                    o->data = doc.data;
+                    o->len = doc.length;
+                    load_text(ed);
+                    finish_index(ed);
+                } else {
+                    if (!strcmp(word, "paste")) outbuf_append(keys, "\x1b[200~", 6);
+                    for (long i = 0; i < n; ++i) outbuf_append(keys, str.data, str.length);
+                    if (!strcmp(word, "paste")) outbuf_append(keys, "\x1b[201~", 6);
+                }
+                free(str.data);
+                continue;
+            }
+        }
+        fprintf(stderr, "trace line %d: cannot use \"%s\"\n", lineno, line);
+        free(str.data);
+        return -1;
+    }
+    return 0;
+}
+// Cells where the emulated terminal differs from what the editor believes
+// it shows.
+static int screen_diff(Screen *s, struct vt *vt) {
+    int bad = 0;
+    for (int r = 0; r < s->rows; ++r)
+        for (int c = 0; c < s->cols; ++c) {
+            struct vt_cell *v = vt__cell(vt, r, c);
+            Cell e = s->prev[r * s->cols + c];
+            if (v->ch != e.ch || v->mark != e.mark) bad++;
+            // the right half of a wide character has the attributes of the left
+            else if (e.ch && (!(v->attr & VT_REVERSE) != !(e.attr & ATTR_REVERSE) || v->fg != e.attr >> 4)) bad++;
+        }
+    return bad;
+}
+// Feeds a trace through the normal key handling and drawing, against a
+// virtual terminal, and times each key from its decoding to its frame.
+// Every frame also goes through the terminal model in src/vt.c, which
+// must end up showing what the editor thinks it shows.
+int replay(int argc, char *argv[]) {
+    Editor ed;
+    OutBuf keys = { 0 }, sink = { 0 };
+    struct stat st;
+    int fd = open(argv[0], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "cannot read %s\n", argv[0]);
+        return 1;
+    }
+    char *text = malloc(st.st_size + 1);
+    long got = read(fd, text, st.st_size);
+    close(fd);
+    text[got > 0 ? got : 0] = 0;
+    memset(&ed, 0, sizeof(ed));
+    ed.root = make_piece(&ed, -1, 1);
+    ed.num_lines = 1;
+    ed.mode = MODE_INSERT;
+    headless.cols = 80;
+    headless.rows = 24;
+    double setup = now();
+    if (trace_parse(&ed, text, &keys) < 0) return 1;
+    setup = now() - setup;
+    if (argc > 1) sscanf(argv[1], "%dx%d", &headless.cols, &headless.rows);
+    headless.sink = &sink;
+    headless.trace = keys.data;
+    headless.trace_len = keys.length;
+    struct vt *vt = vt__new(headless.cols, headless.rows);
+    draw(&ed);
+    int bad = 0, bad_key = -1;
+    long n = 0, cap = 1024, frame0 = ed.scr.total_bytes;
+    double *lat = malloc(cap * sizeof(double)), total = now();
+    for (;;) {
+        double t = now();
+        int c = read_key();
+        if (c == KEY_EOF) break;
+        handle_key(&ed, c);
+        // the key is done when its search has finished too
+        while (ed.job.active) {
+            struct pollfd pfd = { ed.job.wake[0], POLLIN, 0 };
+            poll(&pfd, 1, -1);
+            search_poll(&ed);
+        }
+        draw(&ed);
+        if (n == cap) lat = realloc(lat, (cap *= 2) * sizeof(double));
+        lat[n++] = now() - t;
+        vt__feed(vt, sink.data, sink.length);
+        sink.length = 0;
+        if (bad_key < 0 && (bad = screen_diff(&ed.scr, vt))) bad_key = n;
+    }
+    total = now() - total;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    qsort(lat, n, sizeof(double), cmp_double);
+    printf("%s: %d lines, %dx%d, setup %.3f s\n", argv[0], ed.num_lines, headless.cols, headless.rows, setup);
+    if (n) {
+        printf("%ld keys in %.3f s: p50 %.1f us  p90 %.1f us  p99 %.1f us  max %.1f us\n", n, total,
+               lat[n / 2] * 1e6, lat[n * 9 / 10] * 1e6, lat[n * 99 / 100] * 1e6, lat[n - 1] * 1e6);
+        printf("emitted %ld bytes, %.1f bytes/key, first frame %ld bytes\n",
+               ed.scr.total_bytes, (double)(ed.scr.total_bytes - frame0) / n, frame0);
+    }
+    printf("terminal: %ld glyphs, %ld scrolls, %ld wasted bytes (%.1f%%), %ld unknown sequences\n",
+           vt->glyphs, vt->scrolls, vt->wasted, vt->bytes ? 100.0 * vt->wasted / vt->bytes : 0.0, vt->unknown);
+    if (bad_key >= 0) printf("screen differs in %d cells after key %d\n", bad, bad_key);
+    else printf("screen matches\n");
+    printf("peak RSS %.1f MB\n", ru.ru_maxrss / 1024.0);
+    vt__dispose(vt);
+    free(lat);
+    free(keys.data);
+    free(sink.data);
+    free(text);
+    free_lines(&ed);
+    return bad_key >= 0;
+}
+
+int main(int argc, char *argv[]) {
+    Editor ed;
+    if (argc > 2 && strcmp(argv[1], "--bench-search") == 0)
+        return bench_search(argc - 2, argv + 2);
+    if (argc > 2 && strcmp(argv[1], "--bench-journal") == 0)
+        return bench_journal(argc - 2, argv + 2);
+    if (argc > 3 && strcmp(argv[1], "--bench-subst") == 0)
+        return bench_subst(argc - 2, argv + 2);
+    if (argc > 2 && strcmp(argv[1], "--replay") == 0)
+        return replay(argc - 2, argv + 2);
+    if (argc > 2 && strcmp(argv[1], "--pager") == 0)
+        return pager(argc - 2, argv + 2);
+    if (argc > 2 && strcmp(argv[1], "--bench-pager") == 0)
+        return bench_pager(argc - 2, argv + 2);
+    memset(&ed, 0, sizeof(ed));
+    ed.root = make_piece(&ed, -1, 1);
+    ed.num_lines = 1;
+    ed.cx = ed.cy = 0;
+    ed.mode = MODE_INSERT;
+    ed.filename[0] = 0;
+    int recover = argc > 2 && strcmp(argv[1], "-r") == 0;
+    if (argc > 1 + recover) {
+        strncpy(ed.filename, argv[1 + recover], FILENAME_MAXLEN-1);
+        load_file(&ed, ed.filename);
+        undo_load(&ed);
+        journal_open(&ed, recover);
+    } else {
+        printf("Usage: %s [-r] [filename] | --pager filename [MB] | --bench-pager filename [MB [line]]\n",
+               argc > 0 ? argv[0] : "editor");
+        fflush(stdout);
+    }
+    enableRawMode();
+
+    double painted = 0;
+    while (1) {
+        // every key already typed is handled before anything is painted,
+        // and frames come no closer than FRAME_INTERVAL: keys arriving
+        // meanwhile go into the same frame
+        double wait = painted + FRAME_INTERVAL - now();
+        if (!input_wait(0) && (wait <= 0 || !input_wait((int)(wait * 1000) + 1))) {
+            draw(&ed);
+            painted = now();
+            latency_paint(&ed.lat, painted);
+            // keep the line count and search counter moving until a key comes
+            while (!input_pending() && (indexing(&ed) || ed.job.active)) {
+                struct pollfd pfd[2] = { { STDIN_FILENO, POLLIN, 0 }, { ed.job.active ? ed.job.wake[0] : -1, POLLIN, 0 } };
+                if (poll(pfd, 2, indexing(&ed) ? 100 : -1) > 0 && pfd[0].revents) break;
+                int changed = sync_index(&ed);
+                if (pfd[1].revents) changed |= search_poll(&ed);
+                if (changed) draw(&ed);
+            }
+        }
+        sync_index(&ed);
         int c = read_key();
-        if (ed.mode == MODE_INSERT) process_insert(&ed, c);
-        else if (ed.mode == MODE_COMMAND) process_command(&ed, c);
-        else if (ed.mode == MODE_NORMAL) process_normal(&ed, c);
-        else if (ed.mode == MODE_SEARCH) process_search(&ed, c);
-        int len = (ed.lines && ed.lines[ed.cy]) ? gapbuf_length(ed.lines[ed.cy]) : 0;
-        if (ed.cx < 0) ed.cx = 0;
-        if (ed.cx > len) ed.cx = len;
-        if (ed.cy < 0) ed.cy = 0;
-        if (ed.cy >= ed.num_lines) ed.cy = ed.num_lines-1;
-    }
-    if (ed.lines) {
-        for (int i = 0; i < ed.num_lines; ++i) free_gapbuf(ed.lines[i]);
-        free(ed.lines);
+        latency_key(&ed.lat, input.read_at);
+        handle_key(&ed, c);
     }
+    free_lines(&ed);
     disableRawMode();
     return 0;
 }
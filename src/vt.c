@@ -0,0 +1,810 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include "vt.h"
+
+enum {
+	VT_GROUND,
+	VT_ESC,
+	VT_CHARSET,
+	VT_CSI,
+	VT_OSC,
+	VT_OSC_ESC
+};
+
+/*
+ * Display widths, as a two-level table: the code point's high bits pick
+ * one of a few distinct 256-entry pages, which hold two bits per
+ * character. It is built from the ranges below on first use; callers on
+ * several threads may race to build it, and all but one copy is dropped.
+ */
+static const unsigned int zero_width[][2] = {
+	{ 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD },
+	{ 0x05BF, 0x05BF }, { 0x05C1, 0x05C2 }, { 0x05C4, 0x05C5 },
+	{ 0x05C7, 0x05C7 }, { 0x0600, 0x0605 }, { 0x0610, 0x061A },
+	{ 0x061C, 0x061C }, { 0x064B, 0x065F }, { 0x0670, 0x0670 },
+	{ 0x06D6, 0x06DD }, { 0x06DF, 0x06E4 }, { 0x06E7, 0x06E8 },
+	{ 0x06EA, 0x06ED }, { 0x070F, 0x070F }, { 0x0711, 0x0711 },
+	{ 0x0730, 0x074A }, { 0x07A6, 0x07B0 }, { 0x07EB, 0x07F3 },
+	{ 0x0816, 0x0819 }, { 0x081B, 0x0823 }, { 0x0825, 0x0827 },
+	{ 0x0829, 0x082D }, { 0x0859, 0x085B }, { 0x08D3, 0x0902 },
+	{ 0x093A, 0x093A }, { 0x093C, 0x093C }, { 0x0941, 0x0948 },
+	{ 0x094D, 0x094D }, { 0x0951, 0x0957 }, { 0x0962, 0x0963 },
+	{ 0x0981, 0x0981 }, { 0x09BC, 0x09BC }, { 0x09C1, 0x09C4 },
+	{ 0x09CD, 0x09CD }, { 0x09E2, 0x09E3 }, { 0x0A01, 0x0A02 },
+	{ 0x0A3C, 0x0A3C }, { 0x0A41, 0x0A42 }, { 0x0A47, 0x0A48 },
+	{ 0x0A4B, 0x0A4D }, { 0x0A51, 0x0A51 }, { 0x0A70, 0x0A71 },
+	{ 0x0A75, 0x0A75 }, { 0x0A81, 0x0A82 }, { 0x0ABC, 0x0ABC },
+	{ 0x0AC1, 0x0AC5 }, { 0x0AC7, 0x0AC8 }, { 0x0ACD, 0x0ACD },
+	{ 0x0AE2, 0x0AE3 }, { 0x0B01, 0x0B01 }, { 0x0B3C, 0x0B3C },
+	{ 0x0B3F, 0x0B3F }, { 0x0B41, 0x0B44 }, { 0x0B4D, 0x0B4D },
+	{ 0x0B56, 0x0B56 }, { 0x0B62, 0x0B63 }, { 0x0B82, 0x0B82 },
+	{ 0x0BC0, 0x0BC0 }, { 0x0BCD, 0x0BCD }, { 0x0C00, 0x0C00 },
+	{ 0x0C3E, 0x0C40 }, { 0x0C46, 0x0C48 }, { 0x0C4A, 0x0C4D },
+	{ 0x0C55, 0x0C56 }, { 0x0C62, 0x0C63 }, { 0x0C81, 0x0C81 },
+	{ 0x0CBC, 0x0CBC }, { 0x0CBF, 0x0CBF }, { 0x0CC6, 0x0CC6 },
+	{ 0x0CCC, 0x0CCD }, { 0x0CE2, 0x0CE3 }, { 0x0D00, 0x0D01 },
+	{ 0x0D41, 0x0D44 }, { 0x0D4D, 0x0D4D }, { 0x0D62, 0x0D63 },
+	{ 0x0DCA, 0x0DCA }, { 0x0DD2, 0x0DD4 }, { 0x0DD6, 0x0DD6 },
+	{ 0x0E31, 0x0E31 }, { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E },
+	{ 0x0EB1, 0x0EB1 }, { 0x0EB4, 0x0EBC }, { 0x0EC8, 0x0ECD },
+	{ 0x0F18, 0x0F19 }, { 0x0F35, 0x0F35 }, { 0x0F37, 0x0F37 },
+	{ 0x0F39, 0x0F39 }, { 0x0F71, 0x0F7E }, { 0x0F80, 0x0F84 },
+	{ 0x0F86, 0x0F87 }, { 0x0F8D, 0x0FBC }, { 0x0FC6, 0x0FC6 },
+	{ 0x102D, 0x1030 }, { 0x1032, 0x1037 }, { 0x1039, 0x103A },
+	{ 0x103D, 0x103E }, { 0x1058, 0x1059 }, { 0x105E, 0x1060 },
+	{ 0x1071, 0x1074 }, { 0x1082, 0x1082 }, { 0x1085, 0x1086 },
+	{ 0x108D, 0x108D }, { 0x109D, 0x109D }, { 0x1160, 0x11FF },
+	{ 0x135D, 0x135F }, { 0x1712, 0x1714 }, { 0x1732, 0x1734 },
+	{ 0x1752, 0x1753 }, { 0x1772, 0x1773 }, { 0x17B4, 0x17B5 },
+	{ 0x17B7, 0x17BD }, { 0x17C6, 0x17C6 }, { 0x17C9, 0x17D3 },
+	{ 0x17DD, 0x17DD }, { 0x180B, 0x180E }, { 0x18A9, 0x18A9 },
+	{ 0x1920, 0x1922 }, { 0x1927, 0x1928 }, { 0x1932, 0x1932 },
+	{ 0x1939, 0x193B }, { 0x1A17, 0x1A18 }, { 0x1A1B, 0x1A1B },
+	{ 0x1A56, 0x1A56 }, { 0x1A58, 0x1A5E }, { 0x1A60, 0x1A60 },
+	{ 0x1A62, 0x1A62 }, { 0x1A65, 0x1A6C }, { 0x1A73, 0x1A7C },
+	{ 0x1A7F, 0x1A7F }, { 0x1AB0, 0x1AFF }, { 0x1B00, 0x1B03 },
+	{ 0x1B34, 0x1B34 }, { 0x1B36, 0x1B3A }, { 0x1B3C, 0x1B3C },
+	{ 0x1B42, 0x1B42 }, { 0x1B6B, 0x1B73 }, { 0x1B80, 0x1B81 },
+	{ 0x1BA2, 0x1BA5 }, { 0x1BA8, 0x1BA9 }, { 0x1BAB, 0x1BAD },
+	{ 0x1BE6, 0x1BE6 }, { 0x1BE8, 0x1BE9 }, { 0x1BED, 0x1BED },
+	{ 0x1BEF, 0x1BF1 }, { 0x1C2C, 0x1C33 }, { 0x1C36, 0x1C37 },
+	{ 0x1CD0, 0x1CD2 }, { 0x1CD4, 0x1CE0 }, { 0x1CE2, 0x1CE8 },
+	{ 0x1CED, 0x1CED }, { 0x1CF4, 0x1CF4 }, { 0x1CF8, 0x1CF9 },
+	{ 0x1DC0, 0x1DFF }, { 0x200B, 0x200F }, { 0x202A, 0x202E },
+	{ 0x2060, 0x2064 }, { 0x206A, 0x206F }, { 0x20D0, 0x20F0 },
+	{ 0x2CEF, 0x2CF1 }, { 0x2D7F, 0x2D7F }, { 0x2DE0, 0x2DFF },
+	{ 0x302A, 0x302D }, { 0x3099, 0x309A }, { 0xA66F, 0xA672 },
+	{ 0xA674, 0xA67D }, { 0xA69E, 0xA69F }, { 0xA6F0, 0xA6F1 },
+	{ 0xA802, 0xA802 }, { 0xA806, 0xA806 }, { 0xA80B, 0xA80B },
+	{ 0xA825, 0xA826 }, { 0xA8C4, 0xA8C5 }, { 0xA8E0, 0xA8F1 },
+	{ 0xA926, 0xA92D }, { 0xA947, 0xA951 }, { 0xA980, 0xA982 },
+	{ 0xA9B3, 0xA9B3 }, { 0xA9B6, 0xA9B9 }, { 0xA9BC, 0xA9BD },
+	{ 0xAA29, 0xAA2E }, { 0xAA31, 0xAA32 }, { 0xAA35, 0xAA36 },
+	{ 0xAA43, 0xAA43 }, { 0xAA4C, 0xAA4C }, { 0xAAB0, 0xAAB0 },
+	{ 0xAAB2, 0xAAB4 }, { 0xAAB7, 0xAAB8 }, { 0xAABE, 0xAABF },
+	{ 0xAAC1, 0xAAC1 }, { 0xAAEC, 0xAAED }, { 0xAAF6, 0xAAF6 },
+	{ 0xABE5, 0xABE5 }, { 0xABE8, 0xABE8 }, { 0xABED, 0xABED },
+	{ 0xD7B0, 0xD7FF }, { 0xFB1E, 0xFB1E }, { 0xFE00, 0xFE0F },
+	{ 0xFE20, 0xFE2F }, { 0xFEFF, 0xFEFF }, { 0xFFF9, 0xFFFB },
+	{ 0x101FD, 0x101FD }, { 0x102E0, 0x102E0 }, { 0x10376, 0x1037A },
+	{ 0x10A01, 0x10A03 }, { 0x10A05, 0x10A06 }, { 0x10A0C, 0x10A0F },
+	{ 0x10A38, 0x10A3A }, { 0x10A3F, 0x10A3F }, { 0x10AE5, 0x10AE6 },
+	{ 0x10D24, 0x10D27 }, { 0x10F46, 0x10F50 }, { 0x11001, 0x11001 },
+	{ 0x11038, 0x11046 }, { 0x1107F, 0x11081 }, { 0x110B3, 0x110B6 },
+	{ 0x110B9, 0x110BA }, { 0x11100, 0x11102 }, { 0x11127, 0x1112B },
+	{ 0x1112D, 0x11134 }, { 0x11173, 0x11173 }, { 0x11180, 0x11181 },
+	{ 0x111B6, 0x111BE }, { 0x16AF0, 0x16AF4 }, { 0x16B30, 0x16B36 },
+	{ 0x16F8F, 0x16F92 }, { 0x1BC9D, 0x1BC9E }, { 0x1BCA0, 0x1BCA3 },
+	{ 0x1D167, 0x1D169 }, { 0x1D173, 0x1D182 }, { 0x1D185, 0x1D18B },
+	{ 0x1D1AA, 0x1D1AD }, { 0x1D242, 0x1D244 }, { 0x1DA00, 0x1DA36 },
+	{ 0x1DA3B, 0x1DA6C }, { 0x1DA75, 0x1DA75 }, { 0x1DA84, 0x1DA84 },
+	{ 0x1DA9B, 0x1DAAF }, { 0x1E000, 0x1E02A }, { 0x1E8D0, 0x1E8D6 },
+	{ 0x1E944, 0x1E94A }, { 0x1F3FB, 0x1F3FF }, { 0xE0001, 0xE0001 },
+	{ 0xE0020, 0xE007F }, { 0xE0100, 0xE01EF },
+};
+
+/* East Asian wide and fullwidth characters, and the emoji shown as such. */
+static const unsigned int double_width[][2] = {
+	{ 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A },
+	{ 0x23E9, 0x23EC }, { 0x23F0, 0x23F0 }, { 0x23F3, 0x23F3 },
+	{ 0x25FD, 0x25FE }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 },
+	{ 0x267F, 0x267F }, { 0x2693, 0x2693 }, { 0x26A1, 0x26A1 },
+	{ 0x26AA, 0x26AB }, { 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 },
+	{ 0x26CE, 0x26CE }, { 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA },
+	{ 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 }, { 0x26FA, 0x26FA },
+	{ 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B },
+	{ 0x2728, 0x2728 }, { 0x274C, 0x274C }, { 0x274E, 0x274E },
+	{ 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 },
+	{ 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF }, { 0x2B1B, 0x2B1C },
+	{ 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 }, { 0x2E80, 0x303E },
+	{ 0x3041, 0x33FF }, { 0x3400, 0x4DBF }, { 0x4E00, 0x9FFF },
+	{ 0xA000, 0xA4CF }, { 0xA960, 0xA97F }, { 0xAC00, 0xD7A3 },
+	{ 0xF900, 0xFAFF }, { 0xFE10, 0xFE19 }, { 0xFE30, 0xFE6F },
+	{ 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x16FE0, 0x16FE4 },
+	{ 0x17000, 0x187F7 }, { 0x18800, 0x18CD5 }, { 0x1B000, 0x1B2FB },
+	{ 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF }, { 0x1F18E, 0x1F18E },
+	{ 0x1F191, 0x1F19A }, { 0x1F200, 0x1F202 }, { 0x1F210, 0x1F23B },
+	{ 0x1F240, 0x1F248 }, { 0x1F250, 0x1F251 }, { 0x1F260, 0x1F265 },
+	{ 0x1F300, 0x1F320 }, { 0x1F32D, 0x1F335 }, { 0x1F337, 0x1F37C },
+	{ 0x1F37E, 0x1F393 }, { 0x1F3A0, 0x1F3CA }, { 0x1F3CF, 0x1F3D3 },
+	{ 0x1F3E0, 0x1F3F0 }, { 0x1F3F4, 0x1F3F4 }, { 0x1F3F8, 0x1F43E },
+	{ 0x1F440, 0x1F440 }, { 0x1F442, 0x1F4FC }, { 0x1F4FF, 0x1F53D },
+	{ 0x1F54B, 0x1F54E }, { 0x1F550, 0x1F567 }, { 0x1F57A, 0x1F57A },
+	{ 0x1F595, 0x1F596 }, { 0x1F5A4, 0x1F5A4 }, { 0x1F5FB, 0x1F64F },
+	{ 0x1F680, 0x1F6C5 }, { 0x1F6CC, 0x1F6CC }, { 0x1F6D0, 0x1F6D2 },
+	{ 0x1F6D5, 0x1F6D7 }, { 0x1F6EB, 0x1F6EC }, { 0x1F6F4, 0x1F6FC },
+	{ 0x1F7E0, 0x1F7EB }, { 0x1F90C, 0x1F93A }, { 0x1F93C, 0x1F945 },
+	{ 0x1F947, 0x1F9FF }, { 0x1FA70, 0x1FAFF }, { 0x20000, 0x2FFFD },
+	{ 0x30000, 0x3FFFD },
+};
+
+#define WIDTH_PAGES 128
+
+struct width_table {
+	unsigned char page[0x110000 >> 8];
+	unsigned char bits[WIDTH_PAGES][64];
+};
+
+static struct width_table *widths;
+
+static void width_fill(unsigned char *cells, unsigned int base,
+		       const unsigned int (*ranges)[2], int n, int w)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		unsigned int lo = ranges[i][0], hi = ranges[i][1];
+		if (hi < base || lo > base + 255) {
+			continue;
+		}
+		if (lo < base) {
+			lo = base;
+		}
+		if (hi > base + 255) {
+			hi = base + 255;
+		}
+		memset(cells + (lo - base), w, hi - lo + 1);
+	}
+}
+
+static struct width_table *width_build(void)
+{
+	struct width_table *t = calloc(1, sizeof(*t)), *old = NULL;
+	unsigned char cells[256], bits[64];
+	int npages = 1, p, i;
+	/* page 0 of the bits is the common one: every character one cell */
+	memset(t->bits[0], 0x55, 64);
+	for (p = 0; p < 0x110000 >> 8; p++) {
+		memset(cells, 1, 256);
+		width_fill(cells, p << 8, double_width, sizeof(double_width) / sizeof(double_width[0]), 2);
+		width_fill(cells, p << 8, zero_width, sizeof(zero_width) / sizeof(zero_width[0]), 0);
+		memset(bits, 0, 64);
+		for (i = 0; i < 256; i++) {
+			bits[i >> 2] |= cells[i] << (i & 3) * 2;
+		}
+		for (i = 0; i < npages && memcmp(t->bits[i], bits, 64); i++) {
+		}
+		if (i == npages && npages < WIDTH_PAGES) {
+			memcpy(t->bits[npages++], bits, 64);
+		}
+		t->page[p] = i < npages ? i : 0;
+	}
+	if (!__atomic_compare_exchange_n(&widths, &old, t, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(t);
+		t = old;
+	}
+	return t;
+}
+
+/*
+ * Cells a character takes: 2 for East Asian wide and fullwidth ones, 0
+ * for combining marks and other characters drawn over the one before, 1
+ * for the rest. Control characters count as 1; callers show them as
+ * something printable.
+ */
+int vt__width(unsigned int ch)
+{
+	struct width_table *t;
+	if (ch < 0x300) {
+		return 1;
+	}
+	if (ch >= 0x110000) {
+		return 1;
+	}
+	t = __atomic_load_n(&widths, __ATOMIC_ACQUIRE);
+	if (!t) {
+		t = width_build();
+	}
+	return t->bits[t->page[ch >> 8]][(ch & 255) >> 2] >> (ch & 3) * 2 & 3;
+}
+
+struct vt *vt__new(int cols, int rows)
+{
+	struct vt *self = calloc(1, sizeof(*self));
+	int i;
+	self->cols = cols;
+	self->rows = rows;
+	self->cells = malloc(sizeof(struct vt_cell) * cols * rows);
+	for (i = 0; i < cols * rows; i++) {
+		self->cells[i].ch = ' ';
+		self->cells[i].mark = 0;
+		self->cells[i].attr = 0;
+		self->cells[i].fg = 0;
+	}
+	self->bottom = rows - 1;
+	self->cursor_visible = 1;
+	return self;
+}
+
+void vt__dispose(struct vt *self)
+{
+	free(self->cells);
+	free(self);
+}
+
+struct vt_cell *vt__cell(struct vt *self, int row, int col)
+{
+	return self->cells + row * self->cols + col;
+}
+
+static void put(struct vt *self, int row, int col, unsigned int ch, int attr, int fg)
+{
+	struct vt_cell *c = vt__cell(self, row, col);
+	if (c->ch == ch && !c->mark && c->attr == attr && c->fg == fg) {
+		return;
+	}
+	c->ch = ch;
+	c->mark = 0;
+	c->attr = attr;
+	c->fg = fg;
+	self->dirty = 1;
+}
+
+static void erase(struct vt *self, int row, int from, int to)
+{
+	while (from < to) {
+		put(self, row, from++, ' ', 0, 0);
+	}
+}
+
+/* Moves rows top..bottom up by n (down when n < 0), blanking the rest. */
+static void scroll(struct vt *self, int top, int bottom, int n)
+{
+	int w = self->cols;
+	int h = bottom - top + 1;
+	int i;
+	if (n > h) {
+		n = h;
+	}
+	if (n < -h) {
+		n = -h;
+	}
+	if (n == 0) {
+		return;
+	}
+	if (n > 0) {
+		memmove(vt__cell(self, top, 0), vt__cell(self, top + n, 0),
+			sizeof(struct vt_cell) * w * (h - n));
+		for (i = bottom - n + 1; i <= bottom; i++) {
+			erase(self, i, 0, w);
+		}
+	} else {
+		memmove(vt__cell(self, top - n, 0), vt__cell(self, top, 0),
+			sizeof(struct vt_cell) * w * (h + n));
+		for (i = top; i < top - n; i++) {
+			erase(self, i, 0, w);
+		}
+	}
+	self->scrolls++;
+	self->dirty = 1;
+}
+
+static void line_feed(struct vt *self)
+{
+	if (self->row == self->bottom) {
+		scroll(self, self->top, self->bottom, 1);
+	} else if (self->row < self->rows - 1) {
+		self->row++;
+	}
+}
+
+static void reverse_index(struct vt *self)
+{
+	if (self->row == self->top) {
+		scroll(self, self->top, self->bottom, -1);
+	} else if (self->row > 0) {
+		self->row--;
+	}
+}
+
+static void move_to(struct vt *self, int row, int col)
+{
+	if (row < 0) {
+		row = 0;
+	}
+	if (row >= self->rows) {
+		row = self->rows - 1;
+	}
+	if (col < 0) {
+		col = 0;
+	}
+	if (col >= self->cols) {
+		col = self->cols - 1;
+	}
+	self->row = row;
+	self->col = col;
+	self->wrap = 0;
+}
+
+static void glyph(struct vt *self, unsigned int ch);
+
+/* A combining mark joins the glyph before the cursor; only the first is kept. */
+static void combine(struct vt *self, unsigned int ch)
+{
+	int col = self->wrap ? self->col : self->col - 1;
+	struct vt_cell *c;
+	if (col < 0) {
+		/* nothing to join: the mark stands on a blank */
+		glyph(self, ' ');
+		col = self->wrap ? self->col : self->col - 1;
+	}
+	c = vt__cell(self, self->row, col);
+	if (c->ch == 0 && col > 0) {
+		c--;
+	}
+	if (!c->mark) {
+		c->mark = ch;
+		self->dirty = 1;
+	}
+}
+
+static void glyph(struct vt *self, unsigned int ch)
+{
+	int w = vt__width(ch);
+	if (w == 0) {
+		combine(self, ch);
+		return;
+	}
+	/* a wide glyph that does not fit in the last column wraps first */
+	if (w == 2 && self->col == self->cols - 1 && self->col > 0) {
+		self->wrap = 1;
+	}
+	if (self->wrap) {
+		self->col = 0;
+		self->wrap = 0;
+		line_feed(self);
+	}
+	if (w == 2 && self->col + 1 >= self->cols) {
+		w = 1;
+	}
+	/* overwriting half of a wide glyph blanks the other half */
+	if (self->col > 0 && vt__cell(self, self->row, self->col)->ch == 0) {
+		put(self, self->row, self->col - 1, ' ', 0, 0);
+	}
+	if (self->col + w < self->cols && vt__cell(self, self->row, self->col + w)->ch == 0) {
+		put(self, self->row, self->col + w, ' ', 0, 0);
+	}
+	put(self, self->row, self->col, ch, self->attr, self->fg);
+	if (w == 2) {
+		put(self, self->row, self->col + 1, 0, self->attr, self->fg);
+	}
+	self->glyphs++;
+	if (self->col + w >= self->cols) {
+		self->col = self->cols - 1;
+		self->wrap = 1;
+	} else {
+		self->col += w;
+	}
+}
+
+static void control(struct vt *self, int c)
+{
+	switch (c) {
+	case '\r':
+		self->col = 0;
+		self->wrap = 0;
+		break;
+	case '\n':
+	case '\v':
+	case '\f':
+		line_feed(self);
+		self->wrap = 0;
+		break;
+	case '\b':
+		if (self->col > 0) {
+			self->col--;
+		}
+		self->wrap = 0;
+		break;
+	case '\t':
+		move_to(self, self->row, (self->col / 8 + 1) * 8);
+		break;
+	}
+}
+
+static int arg(struct vt *self, int i, int def)
+{
+	if (i >= self->nparam || self->param[i] == 0) {
+		return def;
+	}
+	return self->param[i];
+}
+
+static void sgr(struct vt *self)
+{
+	int i;
+	if (self->nparam == 0) {
+		self->attr = 0;
+		self->fg = 0;
+	}
+	for (i = 0; i < self->nparam; i++) {
+		int p = self->param[i];
+		if (p >= 30 && p <= 37) {
+			self->fg = p - 29;
+			continue;
+		}
+		if (p >= 90 && p <= 97) {
+			self->fg = p - 81;
+			continue;
+		}
+		switch (p) {
+		case 0: self->attr = 0; self->fg = 0; break;
+		case 1: self->attr |= VT_BOLD; break;
+		case 4: self->attr |= VT_UNDERLINE; break;
+		case 7: self->attr |= VT_REVERSE; break;
+		case 22: self->attr &= ~VT_BOLD; break;
+		case 24: self->attr &= ~VT_UNDERLINE; break;
+		case 27: self->attr &= ~VT_REVERSE; break;
+		case 39: self->fg = 0; break;
+		default:
+			/* background and 256-colour or RGB colours are not modelled */
+			if (p == 38 || p == 48) {
+				i = self->nparam;
+			}
+			break;
+		}
+	}
+}
+
+static void mode(struct vt *self, int on)
+{
+	int i;
+	if (!self->priv) {
+		self->unknown++;
+		return;
+	}
+	for (i = 0; i < self->nparam; i++) {
+		switch (self->param[i]) {
+		case 25: self->cursor_visible = on; break;
+		case 2026: self->sync = on; break;
+		case 1000: case 1002: case 1006: case 2004: case 1049: break;
+		default: self->unknown++; break;
+		}
+	}
+}
+
+static void csi(struct vt *self, int final)
+{
+	int n = arg(self, 0, 1);
+	int i;
+	if (self->priv && final != 'h' && final != 'l') {
+		self->unknown++;
+		return;
+	}
+	switch (final) {
+	case 'A': move_to(self, self->row - n, self->col); break;
+	case 'B': move_to(self, self->row + n, self->col); break;
+	case 'C': move_to(self, self->row, self->col + n); break;
+	case 'D': move_to(self, self->row, self->col - n); break;
+	case 'E': move_to(self, self->row + n, 0); break;
+	case 'F': move_to(self, self->row - n, 0); break;
+	case 'G':
+	case '`': move_to(self, self->row, n - 1); break;
+	case 'd': move_to(self, n - 1, self->col); break;
+	case 'H':
+	case 'f': move_to(self, n - 1, arg(self, 1, 1) - 1); break;
+	case 'J':
+		switch (arg(self, 0, 0)) {
+		case 0:
+			erase(self, self->row, self->col, self->cols);
+			for (i = self->row + 1; i < self->rows; i++) {
+				erase(self, i, 0, self->cols);
+			}
+			break;
+		case 1:
+			for (i = 0; i < self->row; i++) {
+				erase(self, i, 0, self->cols);
+			}
+			erase(self, self->row, 0, self->col + 1);
+			break;
+		default:
+			for (i = 0; i < self->rows; i++) {
+				erase(self, i, 0, self->cols);
+			}
+			break;
+		}
+		break;
+	case 'K':
+		switch (arg(self, 0, 0)) {
+		case 0: erase(self, self->row, self->col, self->cols); break;
+		case 1: erase(self, self->row, 0, self->col + 1); break;
+		default: erase(self, self->row, 0, self->cols); break;
+		}
+		break;
+	case 'X':
+		erase(self, self->row, self->col,
+		      self->col + n < self->cols ? self->col + n : self->cols);
+		break;
+	case 'P':
+	case '@': {
+		struct vt_cell *c = vt__cell(self, self->row, 0);
+		int w = self->cols - self->col;
+		if (n > w) {
+			n = w;
+		}
+		if (final == 'P') {
+			memmove(c + self->col, c + self->col + n, sizeof(*c) * (w - n));
+			erase(self, self->row, self->cols - n, self->cols);
+		} else {
+			memmove(c + self->col + n, c + self->col, sizeof(*c) * (w - n));
+			erase(self, self->row, self->col, self->col + n);
+		}
+		self->dirty = 1;
+		break;
+	}
+	case 'L':
+	case 'M':
+		if (self->row >= self->top && self->row <= self->bottom) {
+			scroll(self, self->row, self->bottom, final == 'M' ? n : -n);
+			self->col = 0;
+		}
+		break;
+	case 'S': scroll(self, self->top, self->bottom, n); break;
+	case 'T': scroll(self, self->top, self->bottom, -n); break;
+	case 'm': sgr(self); break;
+	case 'r': {
+		int top = arg(self, 0, 1) - 1;
+		int bottom = arg(self, 1, self->rows) - 1;
+		if (bottom >= self->rows) {
+			bottom = self->rows - 1;
+		}
+		if (top < bottom) {
+			self->top = top;
+			self->bottom = bottom;
+		}
+		move_to(self, 0, 0);
+		break;
+	}
+	case 's':
+		self->saved_row = self->row;
+		self->saved_col = self->col;
+		break;
+	case 'u': move_to(self, self->saved_row, self->saved_col); break;
+	case 'h': mode(self, 1); break;
+	case 'l': mode(self, 0); break;
+	default: self->unknown++; break;
+	}
+}
+
+static void reset(struct vt *self)
+{
+	int i;
+	for (i = 0; i < self->rows; i++) {
+		erase(self, i, 0, self->cols);
+	}
+	move_to(self, 0, 0);
+	self->attr = 0;
+	self->fg = 0;
+	self->top = 0;
+	self->bottom = self->rows - 1;
+	self->cursor_visible = 1;
+	self->sync = 0;
+}
+
+static void escape(struct vt *self, int c)
+{
+	switch (c) {
+	case '7':
+		self->saved_row = self->row;
+		self->saved_col = self->col;
+		self->saved_attr = self->attr;
+		self->saved_fg = self->fg;
+		break;
+	case '8':
+		move_to(self, self->saved_row, self->saved_col);
+		self->attr = self->saved_attr;
+		self->fg = self->saved_fg;
+		break;
+	case 'D': line_feed(self); break;
+	case 'E': line_feed(self); self->col = 0; break;
+	case 'M': reverse_index(self); break;
+	case 'c': reset(self); break;
+	case '=': case '>': break;
+	default: self->unknown++; break;
+	}
+}
+
+/* Cursor, attributes and modes, to tell a sequence that did nothing. */
+static unsigned long state_of(struct vt *self)
+{
+	unsigned long h = self->row;
+	h = h * 4099 + self->col;
+	h = h * 4099 + self->wrap;
+	h = h * 4099 + self->attr;
+	h = h * 4099 + self->fg;
+	h = h * 4099 + self->top;
+	h = h * 4099 + self->bottom;
+	h = h * 4099 + self->cursor_visible;
+	return h * 4099 + self->sync;
+}
+
+void vt__feed(struct vt *self, const char *data, long len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	long i;
+	self->bytes += len;
+	for (i = 0; i < len; i++) {
+		int c = p[i];
+		if (self->state == VT_GROUND) {
+			if (self->utf_left) {
+				if ((c & 0xC0) == 0x80) {
+					self->utf = self->utf << 6 | (c & 0x3F);
+					self->seq_len++;
+					if (--self->utf_left) {
+						continue;
+					}
+					c = self->utf;
+				} else {
+					/* a broken sequence shows as one replacement glyph */
+					self->utf_left = 0;
+					i--;
+					c = 0xFFFD;
+				}
+			} else if (c >= 0xC0 && c < 0xF8) {
+				self->utf_left = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+				self->utf = c & (0x3F >> self->utf_left);
+				self->seq_len = 1;
+				continue;
+			} else {
+				self->seq_len = 1;
+				if (c >= 0x80) {
+					c = 0xFFFD;
+				}
+			}
+			if (c == 0x1B) {
+				self->state = VT_ESC;
+				self->dirty = 0;
+				self->before = state_of(self);
+			} else if (c < 0x20 || c == 0x7F) {
+				control(self, c);
+			} else {
+				self->dirty = 0;
+				glyph(self, c);
+				if (!self->dirty) {
+					self->wasted += self->seq_len;
+				}
+			}
+			continue;
+		}
+		self->seq_len++;
+		switch (self->state) {
+		case VT_ESC:
+			self->state = VT_GROUND;
+			if (c == '[') {
+				self->state = VT_CSI;
+				self->priv = 0;
+				self->nparam = 0;
+				self->param[0] = 0;
+				continue;
+			} else if (c == ']' || c == 'P' || c == '_' || c == '^') {
+				self->state = VT_OSC;
+				continue;
+			} else if (c == '(' || c == ')' || c == '#') {
+				self->state = VT_CHARSET;
+				continue;
+			}
+			escape(self, c);
+			break;
+		case VT_CHARSET:
+			self->state = VT_GROUND;
+			break;
+		case VT_OSC:
+			if (c == 0x07) {
+				self->state = VT_GROUND;
+			} else if (c == 0x1B) {
+				self->state = VT_OSC_ESC;
+			}
+			continue;
+		case VT_OSC_ESC:
+			self->state = c == '\\' ? VT_GROUND : VT_OSC;
+			continue;
+		case VT_CSI:
+			if (c >= '0' && c <= '9') {
+				if (self->nparam == 0) {
+					self->nparam = 1;
+				}
+				self->param[self->nparam - 1] = self->param[self->nparam - 1] * 10 + c - '0';
+				continue;
+			} else if (c == ';' || c == ':') {
+				if (self->nparam == 0) {
+					self->nparam = 1;
+				}
+				if (self->nparam < 16) {
+					self->param[self->nparam++] = 0;
+				}
+				continue;
+			} else if (c >= 0x3C && c <= 0x3F) {
+				self->priv = 1;
+				continue;
+			} else if (c >= 0x20 && c < 0x30) {
+				continue;
+			} else if (c < 0x20) {
+				control(self, c);
+				continue;
+			}
+			self->state = VT_GROUND;
+			csi(self, c);
+			break;
+		}
+		if (self->state == VT_GROUND && !self->dirty && state_of(self) == self->before) {
+			self->wasted += self->seq_len;
+		}
+	}
+}
+
+static int encode(unsigned int ch, char *out)
+{
+	if (ch < 0x80) {
+		out[0] = ch;
+		return 1;
+	}
+	if (ch < 0x800) {
+		out[0] = 0xC0 | ch >> 6;
+		out[1] = 0x80 | (ch & 0x3F);
+		return 2;
+	}
+	if (ch < 0x10000) {
+		out[0] = 0xE0 | ch >> 12;
+		out[1] = 0x80 | (ch >> 6 & 0x3F);
+		out[2] = 0x80 | (ch & 0x3F);
+		return 3;
+	}
+	out[0] = 0xF0 | ch >> 18;
+	out[1] = 0x80 | (ch >> 12 & 0x3F);
+	out[2] = 0x80 | (ch >> 6 & 0x3F);
+	out[3] = 0x80 | (ch & 0x3F);
+	return 4;
+}
+
+/* The text of a row as UTF-8 without trailing blanks; returns its length. */
+int vt__line(struct vt *self, int row, char *buf, int size)
+{
+	struct vt_cell *c = vt__cell(self, row, 0);
+	int n = 0;
+	int end = self->cols;
+	int i;
+	while (end > 0 && c[end - 1].ch == ' ' && !c[end - 1].mark) {
+		end--;
+	}
+	for (i = 0; i < end; i++) {
+		char tmp[8];
+		int k;
+		if (c[i].ch == 0) {
+			continue;
+		}
+		k = encode(c[i].ch, tmp);
+		if (c[i].mark) {
+			k += encode(c[i].mark, tmp + k);
+		}
+		if (n + k >= size) {
+			break;
+		}
+		memcpy(buf + n, tmp, k);
+		n += k;
+	}
+	if (size > 0) {
+		buf[n] = 0;
+	}
+	return n;
+}
+
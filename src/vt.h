@@ -0,0 +1,67 @@
+
+#ifndef VT_H
+#define VT_H
+
+/*
+ * A model of the VT100/xterm subset the editors here emit: feed it the
+ * bytes written to the terminal and read back the cell grid. It also
+ * counts what the output cost, including bytes that changed nothing on
+ * screen. It uses only libc so that programs outside this tree (the
+ * headless editor in copilot-gpt4.1) can link it too. Wide glyphs take
+ * two cells and combining marks join the glyph before them, by the widths
+ * vt__width() gives; the editor lays out its text by the same table.
+ */
+
+#define VT_REVERSE 1
+#define VT_BOLD 2
+#define VT_UNDERLINE 4
+
+struct vt_cell {
+	unsigned int ch;	/* 0 for the right half of a wide glyph */
+	unsigned int mark;	/* first combining mark on the glyph, or 0 */
+	unsigned char attr;
+	unsigned char fg;	/* 0 default, 1-8 SGR 30-37, 9-16 SGR 90-97 */
+};
+
+struct vt {
+	int cols;
+	int rows;
+	struct vt_cell *cells;
+	int row;
+	int col;
+	int wrap;		/* last column written, next glyph wraps */
+	int attr;
+	int fg;
+	int top;		/* scroll region, inclusive */
+	int bottom;
+	int saved_row;
+	int saved_col;
+	int saved_attr;
+	int saved_fg;
+	int cursor_visible;
+	int sync;		/* inside a synchronized update */
+	int state;
+	int priv;
+	int nparam;
+	int param[16];
+	unsigned int utf;	/* partial UTF-8 sequence */
+	int utf_left;
+	int dirty;		/* the sequence changed a cell */
+	unsigned long before;	/* state_of() when it began */
+	long seq_len;		/* bytes of the sequence being parsed */
+	long bytes;		/* everything fed */
+	long glyphs;
+	long wasted;		/* glyphs and sequences that changed nothing */
+	long scrolls;
+	long unknown;		/* sequences not modelled */
+};
+
+struct vt *vt__new(int cols, int rows);
+void vt__dispose(struct vt *self);
+void vt__feed(struct vt *self, const char *data, long len);
+struct vt_cell *vt__cell(struct vt *self, int row, int col);
+int vt__line(struct vt *self, int row, char *buf, int size);
+int vt__width(unsigned int ch);
+
+#endif
+